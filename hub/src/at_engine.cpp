@@ -0,0 +1,104 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <string.h>
+
+#include "at_engine.h"
+#include "serial.h"
+#include "modem_trace.h"
+#include "utilities.h"
+
+bool AtEngine::run(const AtStep* steps, size_t steps_len, void* ctx, AtStepResult* out_results) {
+  bool success = true;
+  bool aborted = false;
+  int64_t start_time = k_uptime_get();
+
+  for (size_t i = 0; i < steps_len; i++) {
+    const AtStep& step = steps[i];
+    AtStepResult result = {};
+    if (!step.skip && (!aborted || step.cleanup)) {
+      if (!run_step(step, ctx, &result) && step.on_fail == AtOnFail::ABORT) {
+        if (!aborted) printk(">>Step %u failed, aborting<<\n", i);
+        success = false;
+        aborted = true;
+      }
+    }
+    if (out_results) out_results[i] = result;
+  }
+
+  printk("AT script %s in %lldms\n", success ? "succeeded" : "failed", k_uptime_get() - start_time);
+  // Keep what the modem said around for the next time someone has a console attached
+  if (!success) modem_trace_persist();
+  if (out_results) {
+    for (size_t i = 0; i < steps_len; i++) {
+      if (!out_results[i].attempts) continue;
+      printk("\t#%u %s %lldms x%u\n", i, out_results[i].success ? "ok" : "FAIL",
+        out_results[i].duration_ms, out_results[i].attempts);
+    }
+  }
+  return success;
+}
+
+bool AtEngine::run_step(const AtStep& step, void* ctx, AtStepResult* result) {
+  int64_t start_time = k_uptime_get();
+  char built_command[AT_BUILT_COMMAND_SIZE];
+  Deadline deadline;
+  State state = State::SEND;
+
+  while (state != State::DONE && state != State::FAILED) {
+    switch (state) {
+    case State::SEND: {
+      const char* command = step.command;
+      if (step.build_command) {
+        step.build_command(built_command, sizeof(built_command), ctx);
+        command = built_command;
+      }
+      if (step.bulk_header) serial_bulk_arm(step.bulk_header, step.bulk_buf, step.bulk_size);
+      result->attempts++;
+      deadline = Deadline(step.timeout_ms);
+      serial_print_uart(command);
+      state = step.intermediate ? State::WAIT_INTERMEDIATE : State::WAIT_FINAL;
+      break;
+    }
+    case State::WAIT_INTERMEDIATE:
+    case State::WAIT_FINAL: {
+      const char* line = serial_line_borrow(deadline.remaining());
+      if (!line) {
+        printk(">>Network Request Timeout<<\n");
+        state = State::RETRY;
+        break;
+      }
+      state = on_line(step, state, line, ctx);
+      serial_line_release(line);
+      break;
+    }
+    case State::WAIT_BULK:
+      state = serial_bulk_wait(deadline.remaining_ms()) >= 0 ? State::DONE : State::RETRY;
+      break;
+    case State::RETRY:
+      if (step.bulk_header) serial_bulk_cancel();
+      state = result->attempts <= step.retries ? State::SEND : State::FAILED;
+      break;
+    default:
+      break;
+    }
+  }
+
+  result->success = state == State::DONE;
+  result->duration_ms = k_uptime_get() - start_time;
+  if (!result->success) Utilities::write_rgb(70, 5, 0);
+  return result->success;
+}
+
+AtEngine::State AtEngine::on_line(const AtStep& step, State state, const char* line, void* ctx) {
+  printk("\tSIM7000 says: %s\n", line);
+  if (strncmp(line, "ERROR", 5) == 0 || strncmp(line, "+CME ERROR", 10) == 0) {
+    return State::RETRY;
+  }
+  if (state == State::WAIT_INTERMEDIATE) {
+    return strncmp(line, step.intermediate, strlen(step.intermediate)) == 0 ? State::WAIT_FINAL : state;
+  }
+  if (strncmp(line, step.expect, strlen(step.expect)) != 0) return state;
+
+  if (step.on_match && !step.on_match(line, ctx)) return State::RETRY;
+  return step.bulk_header ? State::WAIT_BULK : State::DONE;
+}
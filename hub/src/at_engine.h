@@ -0,0 +1,103 @@
+#ifndef HUB_AT_ENGINE_H
+#define HUB_AT_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Max length of a command produced by AtStep::build_command
+#define AT_BUILT_COMMAND_SIZE   40
+
+enum class AtOnFail : uint8_t {
+  // Skip every remaining step except cleanup steps
+  ABORT,
+  // Log the failure and move on, the script can still succeed
+  CONTINUE,
+};
+
+/**
+ * A single command of an AT script and what it takes for it to succeed
+ */
+struct AtStep {
+  // Command to send including the trailing \r
+  const char* command = nullptr;
+  // Builds the command instead when it depends on earlier responses, e.g. AT+SHREAD length
+  void (*build_command)(char* out, size_t out_size, void* ctx) = nullptr;
+  // Line that has to be seen before expect, e.g. "OK" before "+SHREQ: "
+  const char* intermediate = nullptr;
+  // Line prefix that completes the step
+  const char* expect = "OK";
+  // ms allowed for each attempt
+  int64_t timeout_ms = 2000;
+  // Number of times the command is resent after a timeout or ERROR
+  uint8_t retries = 0;
+  AtOnFail on_fail = AtOnFail::ABORT;
+  // Runs even after the script aborted, e.g. AT+SHDISC
+  bool cleanup = false;
+  // Leave the step out entirely, e.g. SNI when it isn't used
+  bool skip = false;
+  // Called with the expect line, returning false fails the step
+  bool (*on_match)(const char* line, void* ctx) = nullptr;
+  // Set to read a length-delimited payload announced by this header, see serial_bulk_arm
+  const char* bulk_header = nullptr;
+  char* bulk_buf = nullptr;
+  size_t bulk_size = 0;
+};
+
+/**
+ * What happened to a single step of a script
+ */
+struct AtStepResult {
+  // ms from the first send until the step completed or gave up
+  int64_t duration_ms;
+  // 0 if the step never ran
+  uint8_t attempts;
+  bool success;
+};
+
+/**
+ * Runs AT scripts as a state machine driven by received lines, the script stops at
+ * the first failed ABORT step.
+ *
+ * run() blocks the calling thread for the whole script. Each state transition
+ * still happens on a UART event: the thread sleeps in serial_line_borrow or
+ * serial_bulk_wait until the RX interrupt hands over a line, or until the step's
+ * deadline passes. Only modem jobs call run(), on the arbiter thread, and the job
+ * needs the script's result before it can return, so callbacks from the RX path
+ * would only move the same wait into the arbiter.
+ */
+class AtEngine {
+public:
+  /**
+   * @brief Sends each step in order, waiting for its expected response. Blocks until
+   * the script finished, call from a modem job
+   * @param steps the script to run
+   * @param steps_len number of steps
+   * @param ctx passed through to the build_command and on_match hooks
+   * @param out_results [optional] steps_len results with per step timing
+   * @return True if every step that wasn't skipped or CONTINUE succeeded
+   */
+  bool run(const AtStep* steps, size_t steps_len, void* ctx = nullptr, AtStepResult* out_results = nullptr);
+
+private:
+  enum class State : uint8_t {
+    SEND,
+    WAIT_INTERMEDIATE,
+    WAIT_FINAL,
+    WAIT_BULK,
+    RETRY,
+    DONE,
+    FAILED,
+  };
+
+  /**
+   * @brief Runs a single step until it succeeds or runs out of attempts
+   */
+  bool run_step(const AtStep& step, void* ctx, AtStepResult* result);
+
+  /**
+   * @return The state to move to after receiving line while in state
+   */
+  State on_line(const AtStep& step, State state, const char* line, void* ctx);
+};
+
+#endif
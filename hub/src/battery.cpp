@@ -61,7 +61,7 @@ int battery_update(void) {
 
   int err = network_reqs->handle_update_battery_level(r.real_mV, r.percent);
   if (err) {
-    printk("Failed to update the battery level, skipping this period\n");
+    printk("Failed to queue the battery level, skipping this period\n");
   }
   battery_last_update = k_uptime_get();
   return err;
@@ -19,6 +19,9 @@
 #include "network_requests.h"
 #include "network.h"
 #include "diagnostic.h"
+#include "modem_power.h"
+#include "modem_stats.h"
+#include "known_sensors.h"
 
 #define DEVICE_NAME			  CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN		(sizeof(DEVICE_NAME) - 1)
@@ -26,14 +29,32 @@
 #define PERIPHERAL_NAME	"HandleIt Client"
 
 #define BLE_COOLDOWN_MS   30 * 1000
+// Longest the sensor link is kept up waiting for its GATT reads
+#define SENSOR_READ_TIMEOUT_MS  3000
+// Sensors remembered for the cooldown, others are accepted right away
+#define RECENT_SENSORS    (2 * CONFIG_HUB_SENSOR_CONN_MAX)
+// Events captured closer together than this count as one burst for the events per minute
+#define BURST_GAP_MS      60000
+
+// Posted to a sensor's reads event once each read finished, successfully or not
+#define SENSOR_READ_VERSION   BIT(0)
+#define SENSOR_READ_LEVEL     BIT(1)
+#define SENSOR_READ_VOLTS     BIT(2)
+#define SENSOR_READ_BATTERY   (SENSOR_READ_LEVEL | SENSOR_READ_VOLTS)
+#define SENSOR_READ_ALL       (SENSOR_READ_VERSION | SENSOR_READ_BATTERY)
 #define ADV_DURATION_MS		30 * 1000
 
 #define BT_UUID_HUB_SERVICE_VAL      BT_UUID_128_ENCODE(0x0000181a, 0x0000, 0x1000, 0x8000, 0x00805f9b34fc)
 
 static struct bt_uuid_128 hub_svc_uuid = BT_UUID_INIT_128(BT_UUID_HUB_SERVICE_VAL);
 static struct bt_uuid_128 command_char_uuid = BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x00002A58, 0x0000, 0x1000, 0x8000, 0x00805f9b34fd));
+static struct bt_uuid_128 stats_char_uuid = BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x00002A59, 0x0000, 0x1000, 0x8000, 0x00805f9b34fd));
 #define FIRMWARE_VERSION_CHAR   BT_UUID_DIS_FIRMWARE_REVISION
 
+// Modem latency histograms, see modem_stats.h for the layout
+static uint8_t stats_char_val[256];
+static size_t stats_char_len;
+
 struct k_work work;
 struct k_work_q ble_work_q;
 K_THREAD_STACK_DEFINE(ble_stack_area, 4096);
@@ -61,12 +82,58 @@ const char* COMMAND_SENSOR_CONNECT = "SensorConnect";
 const char* COMMAND_START_DIAGNOSTIC = "StartDiagnostic";
 const char* COMMAND_DIAGNOSTIC_RESULT = "DiagnosticResult";
 
+BUILD_ASSERT(CONFIG_BT_MAX_CONN > CONFIG_HUB_SENSOR_CONN_MAX, "CONFIG_BT_MAX_CONN needs a link for the phone on top of the sensors");
+
+/*
+ * A sensor link from the scan match to its release after disconnecting. Its work items all
+ * run on ble_work_q so they never overlap, which also takes turns on gatt_dm, it only runs
+ * one discovery at a time. The GATT reads of several sensors run in parallel.
+ */
+struct sensor_ctx_t {
+  // Held from bt_conn_le_create until release_work, NULL while the context is free
+  struct bt_conn* conn;
+  // Connected while adding a sensor, kept until the phone sends SensorConnect
+  bool adding;
+  // The event was queued or given up on, the read timeout and the last read race for it
+  bool finished;
+  struct sensor_details_t details;
+  // SENSOR_READ_* bits of the reads that finished, successfully or not
+  struct k_event reads;
+  // SENSOR_READ_* bits the running discovery was going to read
+  uint32_t discovering;
+  struct bt_gatt_read_params level_params;
+  struct bt_gatt_read_params volts_params;
+  struct bt_gatt_read_params version_params;
+  Deadline read_deadline;
+  int64_t found_time;
+  int64_t connected_time;
+  struct k_work read_work;
+  struct k_work_delayable finish_work;
+  struct k_work release_work;
+};
+
 static struct bt_conn* phone_conn;
-static struct bt_conn* sensor_conn;
+static struct sensor_ctx_t sensors[CONFIG_HUB_SENSOR_CONN_MAX];
+// The controller creates one connection at a time, scanning waits for it
+static struct sensor_ctx_t* connecting_sensor;
+// Given by the discovery callbacks once the running discovery is done with
+static K_SEM_DEFINE(discovery_done, 0, 1);
 
 // Have to declare here to avoid "taking address of temporary array" error
 const struct bt_le_adv_param* adv_param = BT_LE_ADV_CONN;
 const struct bt_le_scan_param* scan_param = BT_LE_SCAN_ACTIVE;
+#ifdef CONFIG_HUB_SCAN_ACCEPT_LIST
+// Same as scan_param but the controller drops every advertiser not in its filter accept list
+static struct bt_le_scan_param accept_list_scan_param;
+// known_sensors_version the accept list was last loaded from, usable is false if they didn't fit
+static uint32_t accept_list_version;
+static bool accept_list_synced;
+static bool accept_list_usable;
+#endif
+// How the running scan filters, its advertising reports each woke the host
+static bool scan_uses_accept_list;
+static uint32_t scan_reports;
+static int64_t scan_start_time;
 const struct bt_conn_le_create_param* create_param = BT_CONN_LE_CREATE_CONN;
 const struct bt_le_conn_param* conn_param = BT_LE_CONN_PARAM_DEFAULT;
 
@@ -76,16 +143,81 @@ static Network* network;
 int64_t adv_start_time;
 int64_t last_event_time;
 bool is_adding_new_sensor = false;
-bool is_making_network_request = false;
 
-// 10 available address slots
-char known_sensor_addrs[10][50];
-uint8_t known_sensor_addrs_len;
+// Events captured less than BURST_GAP_MS apart, from when the first one's sensor was found
+static int64_t burst_start_time;
+static int64_t burst_last_time;
+static uint16_t burst_events;
 
-static struct sensor_details_t sensor_details;
+// Sensors that just sent an event, so they aren't reconnected while the door settles
+static struct {
+  bt_addr_le_t addr;
+  int64_t time;
+} recent_sensors[RECENT_SENSORS];
 static uint8_t door_column;
 static uint8_t door_row;
 
+static bool is_recent_sensor(const bt_addr_le_t* addr) {
+  int64_t now = k_uptime_get();
+  for (uint8_t i = 0; i < RECENT_SENSORS; i++) {
+    if (recent_sensors[i].time && now < recent_sensors[i].time + BLE_COOLDOWN_MS &&
+      bt_addr_le_cmp(&recent_sensors[i].addr, addr) == 0) return true;
+  }
+  return false;
+}
+
+// Replaces the entry of addr if it has one, otherwise the oldest
+static void add_recent_sensor(const bt_addr_le_t* addr) {
+  uint8_t slot = 0;
+  for (uint8_t i = 0; i < RECENT_SENSORS; i++) {
+    if (bt_addr_le_cmp(&recent_sensors[i].addr, addr) == 0) {
+      slot = i;
+      break;
+    }
+    if (recent_sensors[i].time < recent_sensors[slot].time) slot = i;
+  }
+  bt_addr_le_copy(&recent_sensors[slot].addr, addr);
+  recent_sensors[slot].time = k_uptime_get();
+}
+
+static bool sensors_in_use(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    if (sensors[i].conn) return true;
+  }
+  return false;
+}
+
+static struct sensor_ctx_t* free_sensor(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    if (!sensors[i].conn) return &sensors[i];
+  }
+  return NULL;
+}
+
+static struct sensor_ctx_t* sensor_for_conn(const struct bt_conn* conn) {
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    if (sensors[i].conn && sensors[i].conn == conn) return &sensors[i];
+  }
+  return NULL;
+}
+
+static struct sensor_ctx_t* adding_sensor(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    if (sensors[i].conn && sensors[i].adding) return &sensors[i];
+  }
+  return NULL;
+}
+
+/*
+ * The pre-warm is shared by every sensor being read, only take it back once none is left
+ */
+static void abort_prewarm_if_unused(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    if (sensors[i].conn && !sensors[i].adding) return;
+  }
+  modem_power_prewarm_abort();
+}
+
 static void handle_sensor_search_work(struct k_work* work_item) {
   printk("handling sensor search work\n");
   is_adding_new_sensor = true;
@@ -94,26 +226,32 @@ static void handle_sensor_search_work(struct k_work* work_item) {
 
 static void handle_add_sensor_work(struct k_work* work_item) {
   printk("handling add sensor work\n");
+  size_t err_size = 210;
+  struct sensor_ctx_t* sensor = adding_sensor();
+  if (!sensor) {
+    printk("No sensor connected to add\n");
+    snprintk(command_char_val, err_size, "Error:Sensor not connected");
+    return;
+  }
   char addr[MAC_ADDR_LEN];
-  bt_addr_le_to_str(bt_conn_get_dst(sensor_conn), addr, sizeof(addr));
+  bt_addr_le_to_str(bt_conn_get_dst(sensor->conn), addr, sizeof(addr));
   addr[MAC_ADDR_LEN - 1] = '\0';
+  // The reads go on after the discoveries, the command can come in before they're done
+  k_event_wait_all(&sensor->reads, SENSOR_READ_ALL, false, sensor->read_deadline.remaining());
 
-  size_t err_size = 210;
   char err_msg[err_size] = "";
-  is_making_network_request = true;
-  int err = network_reqs->handle_add_new_sensor(addr, &sensor_details, door_column, door_row, err_msg);
-  is_making_network_request = false;
+  int err = network_reqs->handle_add_new_sensor(addr, &sensor->details, door_column, door_row, err_msg);
   if (err) {
     printk("Unable to add sensor\n");
     snprintk(command_char_val, err_size, "Error:%s", err_msg);
   } else {
-    add_known_sensor(addr);
+    known_sensors_add(&bt_conn_get_dst(sensor->conn)->a);
     if (phone_conn) {
       // TODO Use notify
       strcpy(command_char_val, "SensorAdded:1");
     }
   }
-  bt_conn_disconnect(sensor_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+  bt_conn_disconnect(sensor->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
 }
 
 static void diagnostic_work(struct k_work* work_item) {
@@ -121,7 +259,7 @@ static void diagnostic_work(struct k_work* work_item) {
   char result_msg[210] = "";
   diagnostic_run(result_msg);
   k_msleep(200);
-  while(diagnostic_running) {
+  while(diagnostic_busy()) {
     k_msleep(100);
     snprintk(command_char_val, 200, "%s:%s", COMMAND_DIAGNOSTIC_RESULT, result_msg);
   }
@@ -181,6 +319,15 @@ static ssize_t read_version_char(struct bt_conn* conn, const struct bt_gatt_attr
   return bt_gatt_attr_read(conn, attr, buf, len, offset, value, strlen(value));
 }
 
+static ssize_t read_stats_char(struct bt_conn* conn, const struct bt_gatt_attr* attr,
+  void* buf, uint16_t len, uint16_t offset)
+{
+  // Longer than the MTU, take a snapshot only at the start of a long read so the parts match
+  if (offset == 0) stats_char_len = modem_stats_encode(stats_char_val, sizeof(stats_char_val));
+
+  return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_char_val, stats_char_len);
+}
+
 BT_GATT_SERVICE_DEFINE(hub_svc,
   BT_GATT_PRIMARY_SERVICE(&hub_svc_uuid),
   BT_GATT_CHARACTERISTIC(&command_char_uuid.uuid,
@@ -192,6 +339,10 @@ BT_GATT_SERVICE_DEFINE(hub_svc,
     BT_GATT_CHRC_READ,
     BT_GATT_PERM_READ,
     read_version_char, NULL, version),
+  BT_GATT_CHARACTERISTIC(&stats_char_uuid.uuid,
+    BT_GATT_CHRC_READ,
+    BT_GATT_PERM_READ,
+    read_stats_char, NULL, stats_char_val),
   );
 
 static const struct bt_data ad[] = {
@@ -210,7 +361,8 @@ static struct bt_data sd[] = {
 
 
 bool ble_is_busy() {
-  return adv_start_time > 0 || phone_conn || sensor_conn || last_event_time > 0 || was_pressed;
+  bool cooling_down = last_event_time && k_uptime_get() < last_event_time + BLE_COOLDOWN_MS;
+  return adv_start_time > 0 || phone_conn || sensors_in_use() || cooling_down || was_pressed;
 }
 
 int advertise_start(void) {
@@ -220,22 +372,22 @@ int advertise_start(void) {
   }
   int err;
   printk("Starting to advertise\n");
-  err = bt_le_scan_stop();
-  if (err) {
-    printk("Error stopping scan (err %d)\n", err);
-  }
+  // Scanning carries on so other sensors are still picked up, a phone connecting stops it
   err = bt_le_adv_start(adv_param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
   if (err) {
     printk("Error starting to advertise (err %d)\n", err);
     return err;
   }
-  network->set_power(true);
+  // Early power on for the login that usually follows, queued behind any modem job using it
+  modem_power_wake(ADV_DURATION_MS);
   adv_start_time = k_uptime_get();
   alarm_adv_counter_set();
   return 0;
 }
 
 int advertise_stop(void) {
+  // Not advertising, there is no window to end
+  if (adv_start_time == 0) return 0;
   int err = bt_le_adv_stop();
   if (err) {
     printk("Error stopping advertisement (err %d)\n", err);
@@ -244,9 +396,9 @@ int advertise_stop(void) {
   printk("Stopped advertising after %lld seconds\n", (k_uptime_get() - adv_start_time) / 1000);
   adv_start_time = 0;
   Utilities::write_rgb(0, 0, 0);
-  if (!phone_conn && !sensor_conn) {
+  if (!phone_conn) {
     start_scan();
-    network->set_power(false);
+    if (!sensors_in_use()) modem_power_idle();
   }
   return 0;
 }
@@ -264,32 +416,49 @@ int adv_led_interval_cb(void) {
 }
 
 
+/*
+ * Stops scanning and prints how often the host was woken by advertising reports since it started
+ */
+static int stop_scan(void) {
+  int err = bt_le_scan_stop();
+  if (err) return err;
+  int64_t elapsed = k_uptime_get() - scan_start_time;
+  if (elapsed > 0) {
+    uint32_t per_100s = (uint32_t)(scan_reports * 100000LL / elapsed);
+    printk("Scan woke the host %u times in %llds, %u.%02u/s with the %s\n", scan_reports, elapsed / 1000,
+      per_100s / 100, per_100s % 100, scan_uses_accept_list ? "accept list" : "name filter");
+  }
+  return 0;
+}
+
 void scan_match(struct bt_scan_device_info* device_info, struct bt_scan_filter_match* filter_match, bool connectable) {
-  if (last_event_time && k_uptime_get() < last_event_time + BLE_COOLDOWN_MS) {
+  scan_reports++;
+  const bt_addr_le_t* addr_le = device_info->recv_info->addr;
+  if (is_recent_sensor(addr_le)) {
     printk("-");
     return;
-  } else last_event_time = 0;
+  }
+
+  bool is_known_sensor = known_sensors_contains(&addr_le->a);
 
-  const bt_addr_le_t* addr_le = device_info->recv_info->addr;
   char addr_str[MAC_ADDR_LEN];
   bt_addr_le_to_str(addr_le, addr_str, sizeof(addr_str));
   addr_str[MAC_ADDR_LEN - 1] = '\0';
   printk("\t\t\t📱 Scanned MAC: %s, rssi: %d, connectable: %d\n",
     addr_str, device_info->recv_info->rssi, connectable);
 
-  if (sensor_conn) {
+  if (connecting_sensor) {
+    printk("Already connecting to a sensor\n");
+    return;
+  }
+  if (is_adding_new_sensor && adding_sensor()) {
     printk("Already connected to a sensor\n");
     return;
   }
-
-  // determine if known sensor
-  bool is_known_sensor = false;
-  for (uint8_t i = 0; i < known_sensor_addrs_len; i++) {
-    printk("Checking for a match with: %s\n", known_sensor_addrs[i]);
-    if (strcmp(addr_str, known_sensor_addrs[i]) == 0) {
-      is_known_sensor = true;
-      break;
-    }
+  struct sensor_ctx_t* sensor = free_sensor();
+  if (!sensor) {
+    printk("All %d sensor connections in use\n", CONFIG_HUB_SENSOR_CONN_MAX);
+    return;
   }
 
   // if we're not adding new sensors and it's unknown
@@ -306,20 +475,32 @@ void scan_match(struct bt_scan_device_info* device_info, struct bt_scan_filter_m
   // We found a Sensor!
   Utilities::write_rgb(255, 30, 0);
   printk("\nSENSOR ELIGIBLE FOR CONNECTION\n");
-
-  int err = bt_le_scan_stop();
+  // Details of the last sensor in this context mustn't end up in this one's event
+  memset(&sensor->details, 0, sizeof(sensor->details));
+  k_event_clear(&sensor->reads, SENSOR_READ_ALL);
+  sensor->adding = is_adding_new_sensor;
+  sensor->finished = false;
+  sensor->found_time = k_uptime_get();
+  // A known sensor means an event to upload, registering overlaps with connecting and reading it
+  if (!is_adding_new_sensor) modem_power_prewarm();
+
+  int err = stop_scan();
   if (err) {
     printk("Error stopping BLE scan (err %d)\n", err);
+    abort_prewarm_if_unused();
     return;
   }
-  err = bt_conn_le_create(addr_le, create_param, conn_param, &sensor_conn);
+  err = bt_conn_le_create(addr_le, create_param, conn_param, &sensor->conn);
   if (err) {
+    sensor->conn = NULL;
+    abort_prewarm_if_unused();
     Utilities::write_rgb(255, 0, 0);
     printk("\tError connecting to sensor 😭 Restarting scan...\n");
     k_msleep(1000L);
     start_scan();
     return;
   }
+  connecting_sensor = sensor;
 
   if (is_adding_new_sensor) {
     printk("Waiting for command to connect~~~");
@@ -328,15 +509,20 @@ void scan_match(struct bt_scan_device_info* device_info, struct bt_scan_filter_m
   }
 }
 
+// Advertisers the name filter turned away still cost a host wakeup each
+void scan_no_match(struct bt_scan_device_info* device_info, bool connectable) {
+  scan_reports++;
+}
+
 void scan_error(struct bt_scan_device_info* device_info) {
   printk("scan_error\n");
 }
 
+// Only called with connect_if_match, connections are created in scan_match instead
 void scan_conn(struct bt_scan_device_info* device_info, struct bt_conn* conn) {
   printk("scan_conn\n");
-  sensor_conn = bt_conn_ref(conn);
 }
-BT_SCAN_CB_INIT(scan_cb, scan_match, NULL, scan_error, scan_conn);
+BT_SCAN_CB_INIT(scan_cb, scan_match, scan_no_match, scan_error, scan_conn);
 
 static int scan_init(void) {
   int err;
@@ -357,33 +543,112 @@ static int scan_init(void) {
     printk("Filters cannot be turned on (err %d)\n", err);
     return err;
   }
+#ifdef CONFIG_HUB_SCAN_ACCEPT_LIST
+  accept_list_scan_param = *scan_param;
+  accept_list_scan_param.options |= BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST;
+#endif
 
   return 0;
 }
 
+#ifdef CONFIG_HUB_SCAN_ACCEPT_LIST
+/*
+ * Loads the known sensors into the controller's filter accept list, the scan must be stopped.
+ * The server only has the MAC, so the type is guessed: random static addresses have the
+ * two top bits set, which public ones practically never do
+ * @return False if they don't all fit, scanning then has to fall back to the name filter alone
+ */
+static bool load_accept_list(void) {
+  bt_addr_t addrs[CONFIG_HUB_SCAN_ACCEPT_LIST_SIZE];
+  uint32_t version = known_sensors_version();
+  if (accept_list_synced && accept_list_version == version) return accept_list_usable;
+  // Not retried until the sensors change, a failed load would otherwise restart the scan every time
+  accept_list_synced = true;
+  accept_list_version = version;
+  accept_list_usable = false;
+  bt_le_filter_accept_list_clear();
+
+  size_t n = known_sensors_copy(addrs, ARRAY_SIZE(addrs));
+  if (n == 0 || n > ARRAY_SIZE(addrs)) return false;
+  for (size_t i = 0; i < n; i++) {
+    bt_addr_le_t addr_le;
+    addr_le.type = BT_ADDR_IS_STATIC(&addrs[i]) ? BT_ADDR_LE_RANDOM : BT_ADDR_LE_PUBLIC;
+    bt_addr_copy(&addr_le.a, &addrs[i]);
+    int err = bt_le_filter_accept_list_add(&addr_le);
+    if (err) {
+      printk("Filter accept list full after %u of %u sensors (err %d)\n", i, n, err);
+      bt_le_filter_accept_list_clear();
+      return false;
+    }
+  }
+  accept_list_usable = true;
+  return true;
+}
+#endif
+
 void start_scan(void)
 {
   int err;
-
-  err = bt_le_scan_start(scan_param, NULL);
+  bool use_accept_list = false;
+  // Nothing to do with a match until the connection being created is done or a link frees up
+  if (connecting_sensor || !free_sensor()) return;
+#ifdef CONFIG_HUB_SCAN_ACCEPT_LIST
+  bool accept_list_stale = !accept_list_synced || accept_list_version != known_sensors_version();
+  // New sensors aren't in the accept list, only the name filter finds them
+  bool want_accept_list = !is_adding_new_sensor && known_sensors_count() > 0 &&
+    (accept_list_stale || accept_list_usable);
+  // The accept list can't be changed while scanning with it
+  if (want_accept_list != scan_uses_accept_list || (want_accept_list && accept_list_stale)) stop_scan();
+  use_accept_list = want_accept_list && load_accept_list();
+#endif
+
+  err = bt_le_scan_start(use_accept_list ? &accept_list_scan_param : scan_param, NULL);
+  if (err == -EALREADY) return;
   if (err) {
     printk("Scanning failed to start (err %d)\n", err);
     return;
   }
-  printk("Hub scanning for peripheral...\n");
+  scan_uses_accept_list = use_accept_list;
+  scan_reports = 0;
+  scan_start_time = k_uptime_get();
+  printk("Hub scanning for peripheral%s...\n", use_accept_list ? " with the filter accept list" : "");
 }
 
 
 static void dis_discovery_completed_cb(struct bt_gatt_dm *dm, void *context);
 static void bas_discovery_completed_cb(struct bt_gatt_dm *dm, void *context);
 
+/*
+ * Marks reads of sensor as finished, the event is queued once all of them are
+ */
+static void post_reads(struct sensor_ctx_t* sensor, uint32_t bits) {
+  k_event_post(&sensor->reads, bits);
+  if (!sensor->adding && k_event_wait_all(&sensor->reads, SENSOR_READ_ALL, false, K_NO_WAIT)) {
+    k_work_reschedule_for_queue(&ble_work_q, &sensor->finish_work, K_NO_WAIT);
+  }
+}
+
+// context is the sensor_ctx_t the discovery runs for
+static void service_not_found_cb(struct bt_conn* conn, void* context) {
+  struct sensor_ctx_t* sensor = (struct sensor_ctx_t*)context;
+  printk("Service not found on sensor\n");
+  post_reads(sensor, sensor->discovering);
+  k_sem_give(&discovery_done);
+}
+
+static void discovery_error_cb(struct bt_conn* conn, int err, void* context) {
+  struct sensor_ctx_t* sensor = (struct sensor_ctx_t*)context;
+  printk("Sensor discovery failed (err %d)\n", err);
+  post_reads(sensor, sensor->discovering);
+  k_sem_give(&discovery_done);
+}
+
 static const struct bt_gatt_dm_cb bas_discovery_cb = {
   .completed = bas_discovery_completed_cb,
+  .service_not_found = service_not_found_cb,
+  .error_found = discovery_error_cb,
 };
 
-const bt_gatt_dm_attr *batt_level_char;
-const bt_gatt_dm_attr *batt_volts_char;
-const bt_gatt_dm_attr *software_rev_char;
 static struct bt_uuid_16 battery_svc_uuid = BT_UUID_INIT_16(BT_UUID_BAS_VAL);
 static struct bt_uuid_16 device_info_uuid = BT_UUID_INIT_16(BT_UUID_DIS_VAL);
 
@@ -392,17 +657,17 @@ static uint8_t read_firmware_version_cb(struct bt_conn *conn, uint8_t err,
 				    struct bt_gatt_read_params *params,
 				    const void *data, uint16_t length)
 {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(params, struct sensor_ctx_t, version_params);
   printk("Checking read_firmware_version...\n");
   if (err) {
     printk("Error reading firmware version characteristic (err %d)\n", err);
-    return -1;
-  }
-  if (length > 0) {
+  } else if (length > 0) {
     const char* firmware_version = (const char*)data;
     printk("Firmware version: %s\n", firmware_version); // "0.1.3"
-    strncpy(sensor_details.firmware_version, firmware_version, sizeof(sensor_details.firmware_version));
+    strncpy(sensor->details.firmware_version, firmware_version, sizeof(sensor->details.firmware_version));
   }
-  return 0;
+  post_reads(sensor, SENSOR_READ_VERSION);
+  return err ? -1 : 0;
 }
 
 // 0x2a19 Battery Level - value:(0x) 64,"d" ... "100%" recieved - response 02 35 00 18 2b
@@ -410,6 +675,7 @@ static uint8_t read_battery_level_cb(struct bt_conn *conn, uint8_t err,
 				    struct bt_gatt_read_params *params,
 				    const void *data, uint16_t length)
 {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(params, struct sensor_ctx_t, level_params);
   printk("Checking read_battery_level...\n");
   for(int i = 0; i < length; i++) {
     // print hex values of bytes in data
@@ -418,14 +684,13 @@ static uint8_t read_battery_level_cb(struct bt_conn *conn, uint8_t err,
   printk("\n");
   if (err) {
     printk("Error reading battery level characteristic (err %d)\n", err);
-    return -1;
-  }
-  if (length > 0) {
+  } else if (length > 0) {
     uint8_t battery_level = *(uint8_t*)data;
     printk("Battery level: %u\n", battery_level);
-    sensor_details.battery_level = battery_level;
+    sensor->details.battery_level = battery_level;
   }
-  return 0;
+  post_reads(sensor, SENSOR_READ_LEVEL);
+  return err ? -1 : 0;
 }
 
 // 0x2b18 Voltage - "(0x) 0C-E3" recieved
@@ -433,6 +698,7 @@ static uint8_t read_battery_volts_cb(struct bt_conn *conn, uint8_t err,
 				    struct bt_gatt_read_params *params,
 				    const void *data, uint16_t length)
 {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(params, struct sensor_ctx_t, volts_params);
   printk("Checking read_battery_volts...\n");
   for(int i = 0; i < length; i++) {
     // print hex values of bytes in data
@@ -441,132 +707,197 @@ static uint8_t read_battery_volts_cb(struct bt_conn *conn, uint8_t err,
   printk("\n");
   if (err) {
     printk("Error reading battery level characteristic (err %d)\n", err);
-    return -1;
-  }
-  if (length > 0) {
+  } else if (length > 0) {
     // Assuming the data is big-endian
     const uint8_t *raw_data = (const uint8_t *)data;
     const uint16_t voltage = (raw_data[0] << 8) | raw_data[1];
     printk("Voltage is %u\n", voltage);
-    sensor_details.battery_volts = voltage;
+    sensor->details.battery_volts = voltage;
   }
-  return 0;
+  post_reads(sensor, SENSOR_READ_VOLTS);
+  return err ? -1 : 0;
 }
 
 struct bt_uuid *software_rev_uuid = BT_UUID_DIS_SOFTWARE_REVISION;
 struct bt_uuid *batt_volts_uuid = BT_UUID_GATT_V;
 struct bt_uuid *batt_level_uuid = BT_UUID_BAS_BATTERY_LEVEL;
 
-// create params for bt_gatt_read
-struct bt_gatt_read_params batt_level_read_params = {
-  .func = &read_battery_level_cb,
-  .handle_count = 1,
-  .single = { .offset = 0 },
-};
-struct bt_gatt_read_params batt_volts_read_params = {
-  .func = &read_battery_volts_cb,
-  .handle_count = 1,
-  .single = { .offset = 0 },
-};
-struct bt_gatt_read_params software_rev_read_params = {
-  .func = &read_firmware_version_cb,
-  .handle_count = 1,
-  .single = { .offset = 0 },
-};
+/*
+ * Starts a read for one of sensor's bits, a read that can't be started counts as finished
+ */
+static void start_read(struct sensor_ctx_t* sensor, struct bt_gatt_read_params* params,
+  const struct bt_gatt_dm_attr* chrc, uint32_t bit) {
+  params->single.handle = chrc->handle + 1;
+  if (bt_gatt_read(sensor->conn, params)) {
+    printk("Error reading characteristic 0x%04x\n", params->single.handle);
+    post_reads(sensor, bit);
+  }
+}
 
 static void bas_discovery_completed_cb(struct bt_gatt_dm *dm, void *context)
 {
+  struct sensor_ctx_t* sensor = (struct sensor_ctx_t*)context;
   printk("Found service 180f - Battery Service UUID\n");
 
-  batt_level_char = bt_gatt_dm_char_by_uuid(dm, batt_level_uuid);
-  batt_volts_char = bt_gatt_dm_char_by_uuid(dm, batt_volts_uuid);
+  const struct bt_gatt_dm_attr* batt_level_char = bt_gatt_dm_char_by_uuid(dm, batt_level_uuid);
+  const struct bt_gatt_dm_attr* batt_volts_char = bt_gatt_dm_char_by_uuid(dm, batt_volts_uuid);
 
   if(!batt_level_char) {
     printk("Unable to find BT_UUID_BAS_BATTERY_LEVEL\n");
-    return;
-  }
-  if(!batt_volts_char) {
+    post_reads(sensor, SENSOR_READ_BATTERY);
+  } else if(!batt_volts_char) {
     printk("Unable to find BT_UUID_BAS_BATTERY_VOLTAGE\n");
-    return;
-  }
-
-  batt_level_read_params.single.handle = batt_level_char->handle + 1;
-  batt_volts_read_params.single.handle = batt_volts_char->handle + 1;
-
-  if(bt_gatt_read(sensor_conn, &batt_level_read_params)) {
-    printk("Error reading batt_level_char\n");
-  }
-  if(bt_gatt_read(sensor_conn, &batt_volts_read_params)) {
-    printk("Error reading batt_volts_char\n");
+    post_reads(sensor, SENSOR_READ_BATTERY);
+  } else {
+    start_read(sensor, &sensor->level_params, batt_level_char, SENSOR_READ_LEVEL);
+    start_read(sensor, &sensor->volts_params, batt_volts_char, SENSOR_READ_VOLTS);
   }
 
   printk("Releasing DM\n");
   bt_gatt_dm_data_release(dm);
   printk("Finished service 0x180f\n");
-
+  k_sem_give(&discovery_done);
 }
 
+
+
 static const struct bt_gatt_dm_cb dis_discovery_cb = {
   .completed = dis_discovery_completed_cb,
+  .service_not_found = service_not_found_cb,
+  .error_found = discovery_error_cb,
 };
 
-
 static void dis_discovery_completed_cb(struct bt_gatt_dm *dm, void *context)
 {
+  struct sensor_ctx_t* sensor = (struct sensor_ctx_t*)context;
   printk("Found service 180a - Device Information Service\n");
 
-  
-  software_rev_char = bt_gatt_dm_char_by_uuid(dm, software_rev_uuid);
+  const struct bt_gatt_dm_attr* software_rev_char = bt_gatt_dm_char_by_uuid(dm, software_rev_uuid);
 
   if(!software_rev_char) {
     printk("Unable to find BT_UUID_DIS_SOFTWARE_REVISION\n");
-    return;
-  }
-  printk("Found software_rev_char...[0x%04X]\n", software_rev_char->handle);
-  software_rev_read_params.single.handle = software_rev_char->handle + 1;
-  
-  if(bt_gatt_read(sensor_conn, &software_rev_read_params)) {
-    printk("Error reading software_rev_char\n");
+    post_reads(sensor, SENSOR_READ_VERSION);
+  } else {
+    printk("Found software_rev_char...[0x%04X]\n", software_rev_char->handle);
+    start_read(sensor, &sensor->version_params, software_rev_char, SENSOR_READ_VERSION);
   }
   printk("Releasing DM\n");
   bt_gatt_dm_data_release(dm);
   printk("Finished service 0x180a\n");
+  k_sem_give(&discovery_done);
+}
 
+/*
+ * Called by the outbox once the event was delivered or given up on, from the modem
+ * arbiter thread with the outbox locked
+ */
+static void event_done_cb(const outbox_record_t* record, int result, void* user_data) {
+  if (result == 0) {
+    printk("Event from %s delivered %llds after the door moved\n", record->event.serial,
+      record->capture_time ? (k_uptime_get() - record->capture_time) / 1000 : -1LL);
+  } else {
+    printk("Event from %s dropped (err %d)\n", record->event.serial, result);
+  }
 }
 
-static void handle_sensor_connected_work(struct k_work* work_item) {
-  char addr[MAC_ADDR_LEN];
-  bt_addr_le_to_str(bt_conn_get_dst(sensor_conn), addr, sizeof(addr));
-  addr[MAC_ADDR_LEN - 1] = '\0';
-  Utilities::write_rgb(255, 100, 200);
-  printk("\nPeripheral connected!\n");
-  
-  int err;
-  int start_time = k_uptime_get();
-  
-  if ((err = bt_gatt_dm_start(sensor_conn, &device_info_uuid.uuid, &dis_discovery_cb, NULL))) {
-    printk("Could not start the discovery procedure for Device Information Service, error code: %d\n", err);
+/*
+ * Prints where the time from finding the sensor to having its event went, and how much
+ * of the modem pre-warm happened while BLE was busy anyway
+ */
+static void print_event_timing(const struct sensor_ctx_t* sensor, int64_t captured_time) {
+  printk("Event timing: connect %lldms, reads %lldms", sensor->connected_time - sensor->found_time,
+    captured_time - sensor->connected_time);
+  int64_t ready_time = modem_power_prewarm_ready_time();
+  if (ready_time < sensor->found_time) {
+    printk(", modem still warming up\n");
+    return;
   }
-  while(strlen(sensor_details.firmware_version) == 0 && k_uptime_get() < start_time + 5000LL) {
-    printk("Waiting for dis discovery to complete...\n");
-    k_msleep(100);
+  printk(", modem ready after %lldms, %lldms of it overlapped\n", ready_time - sensor->found_time,
+    MIN(ready_time, captured_time) - sensor->found_time);
+}
+
+/*
+ * Counts the event towards the current burst and prints its events per minute, the
+ * figure to watch when several doors move together
+ */
+static void count_burst_event(const struct sensor_ctx_t* sensor, int64_t captured_time) {
+  if (!burst_events || captured_time - burst_last_time > BURST_GAP_MS) {
+    burst_start_time = sensor->found_time;
+    burst_events = 0;
   }
-  if ((err = bt_gatt_dm_start(sensor_conn, &battery_svc_uuid.uuid, &bas_discovery_cb, NULL))) {
-    printk("Could not start the discovery procedure for Battery Service, error code: %d\n", err);
+  burst_events++;
+  burst_last_time = captured_time;
+  if (burst_events < 2) return;
+  int64_t elapsed = MAX(captured_time - burst_start_time, 1LL);
+  printk("Burst of %u events in %lldms, %lld events/min\n", burst_events, elapsed,
+    burst_events * 60000LL / elapsed);
+}
+
+/*
+ * Runs the discovery of one service on sensor and waits for it, the reads the
+ * callback starts go on in the background. A discovery that can't run counts its reads as finished
+ */
+static void discover(struct sensor_ctx_t* sensor, const struct bt_uuid* uuid, const struct bt_gatt_dm_cb* cb,
+  uint32_t bits, const char* name) {
+  sensor->discovering = bits;
+  k_sem_reset(&discovery_done);
+  int err = bt_gatt_dm_start(sensor->conn, uuid, cb, sensor);
+  if (err) {
+    printk("Could not start the discovery procedure for %s, error code: %d\n", name, err);
+    post_reads(sensor, bits);
+    return;
+  }
+  if (k_sem_take(&discovery_done, sensor->read_deadline.remaining())) {
+    printk("Discovery of %s timed out\n", name);
+    post_reads(sensor, bits);
   }
+}
 
-  if (!is_adding_new_sensor) {
-    is_making_network_request = true;
-    int err = network_reqs->handle_send_event(addr, &sensor_details);
-    is_making_network_request = false;
-    if (err) {
-      printk("Unable to send event\n");
-      bt_conn_disconnect(sensor_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-      return;
-    }
-    bt_conn_disconnect(sensor_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-    advertise_start();
+static void sensor_read_work(struct k_work* work_item) {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(work_item, struct sensor_ctx_t, read_work);
+  Utilities::write_rgb(255, 100, 200);
+  printk("\nPeripheral connected!\n");
+  discover(sensor, &device_info_uuid.uuid, &dis_discovery_cb, SENSOR_READ_VERSION, "Device Information Service");
+  discover(sensor, &battery_svc_uuid.uuid, &bas_discovery_cb, SENSOR_READ_BATTERY, "Battery Service");
+}
+
+/*
+ * Queues the event once every read finished, the read timeout passed or the sensor
+ * disconnected, whichever is first
+ */
+static void sensor_finish_work(struct k_work* work_item) {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(k_work_delayable_from_work(work_item), struct sensor_ctx_t, finish_work);
+  // Sensors being added wait for the phone's SensorConnect instead
+  if (sensor->adding || sensor->finished || !sensor->conn) return;
+  sensor->finished = true;
+  char addr[MAC_ADDR_LEN];
+  bt_addr_le_to_str(bt_conn_get_dst(sensor->conn), addr, sizeof(addr));
+  addr[MAC_ADDR_LEN - 1] = '\0';
+
+  // The event is complete once read, the sensor can go and the upload happens in the background
+  int64_t captured_time = k_uptime_get();
+  int err = network_reqs->handle_send_event(addr, &sensor->details, event_done_cb);
+  bt_conn_disconnect(sensor->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+  if (err) {
+    printk("Unable to queue event\n");
+    abort_prewarm_if_unused();
+    return;
   }
+  printk("Event from %s captured in %lldms\n", addr, captured_time - sensor->connected_time);
+  print_event_timing(sensor, captured_time);
+  count_burst_event(sensor, captured_time);
+  advertise_start();
+}
+
+/*
+ * Frees sensor after it disconnected, queued behind its other work items so none of them
+ * can still be using it
+ */
+static void sensor_release_work(struct k_work* work_item) {
+  struct sensor_ctx_t* sensor = CONTAINER_OF(work_item, struct sensor_ctx_t, release_work);
+  bt_conn_unref(sensor->conn);
+  sensor->conn = NULL;
+  if (!phone_conn) start_scan();
 }
 
 static void handle_phone_connected_work(struct k_work* work_item) {
@@ -600,9 +931,7 @@ static void handle_phone_connected_work(struct k_work* work_item) {
   uint16_t hub_id;
   size_t err_size = 210;
   char err_msg[err_size] = "";
-  is_making_network_request = true;
   int err = network_reqs->handle_get_token_and_hub_id(command.value, hub_mac, &hub_id, err_msg);
-  is_making_network_request = false;
   if (err) {
     printk("Unable to get token and hub_id\n");
     snprintk(command_char_val, err_size, "Error:%s", err_msg);
@@ -623,27 +952,36 @@ static void connected(struct bt_conn* conn, uint8_t err) {
   char addr[MAC_ADDR_LEN];
   bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
   addr[MAC_ADDR_LEN - 1] = '\0';
-  bool is_sensor = sensor_conn && sensor_conn == conn;
+  struct sensor_ctx_t* sensor = sensor_for_conn(conn);
+  if (sensor && sensor == connecting_sensor) connecting_sensor = NULL;
   if (err) {
     printk("Failed to connect to %s (err %u)\n", addr, err);
-    if (is_sensor) {
-      bt_conn_unref(sensor_conn);
-      sensor_conn = NULL;
+    if (sensor) {
+      // No work was queued for it yet, it can be freed right away
+      bt_conn_unref(sensor->conn);
+      sensor->conn = NULL;
+      abort_prewarm_if_unused();
       start_scan();
     }
     return;
   }
 
-  printk("\n>>> BLE Connected to %s -- MAC: %s\n", is_sensor ? "SENSOR" : "PHONE", addr);
+  printk("\n>>> BLE Connected to %s -- MAC: %s\n", sensor ? "SENSOR" : "PHONE", addr);
 
-  if (is_sensor) {
-    advertise_stop();
-    k_work_init(&work, handle_sensor_connected_work);
-    k_work_submit_to_queue(&ble_work_q, &work);
+  if (sensor) {
+    sensor->connected_time = k_uptime_get();
+    sensor->read_deadline = Deadline(SENSOR_READ_TIMEOUT_MS);
+    k_work_submit_to_queue(&ble_work_q, &sensor->read_work);
+    if (!sensor->adding) {
+      k_work_schedule_for_queue(&ble_work_q, &sensor->finish_work, K_MSEC(SENSOR_READ_TIMEOUT_MS));
+    }
+    // More doors may be opening while this one is read, a phone's advertising window carries on
+    if (!phone_conn) start_scan();
   } else {
     phone_conn = bt_conn_ref(conn);
     advertise_stop();
-    err = bt_le_scan_stop();
+    alarm_adv_counter_cancel();
+    err = stop_scan();
     if (err) {
       printk("Failed to stop scan\n");
     }
@@ -655,32 +993,35 @@ static void connected(struct bt_conn* conn, uint8_t err) {
       }
     }
   }
-  alarm_adv_counter_cancel();
 }
 
 static void disconnected(struct bt_conn* conn, uint8_t reason) {
   char addr[MAC_ADDR_LEN];
-  if (conn != sensor_conn && conn != phone_conn) {
+  struct sensor_ctx_t* sensor = sensor_for_conn(conn);
+  if (!sensor && conn != phone_conn) {
     return;
   }
-  if (!(sensor_conn && phone_conn) && !is_making_network_request) network->set_power(false);
+  // Ignored by the power policy while a modem job runs
+  if (!(sensors_in_use() && phone_conn)) modem_power_idle();
   bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
   addr[MAC_ADDR_LEN - 1] = '\0';
-  bool is_sensor = sensor_conn && sensor_conn == conn;
-  printk("\n>>> BLE Disconnecting from %s -- MAC: %s (reason 0x%02x)\n", is_sensor ? "SENSOR" : "PHONE", addr, reason);
+  printk("\n>>> BLE Disconnecting from %s -- MAC: %s (reason 0x%02x)\n", sensor ? "SENSOR" : "PHONE", addr, reason);
 
-  if (is_sensor) {
+  if (sensor) {
     Utilities::write_rgb(0, 0, 0);
-    bt_conn_unref(sensor_conn);
-    sensor_conn = NULL;
+    add_recent_sensor(bt_conn_get_dst(conn));
+    // A sensor that left before its reads finished still sends what was read, then it's freed
+    if (!sensor->adding) k_work_reschedule_for_queue(&ble_work_q, &sensor->finish_work, K_NO_WAIT);
+    k_work_submit_to_queue(&ble_work_q, &sensor->release_work);
     last_event_time = k_uptime_get();
-    printk("Cooling down to prevent peripheral reconnection---");
+    printk("Cooling down to prevent %s reconnecting---", addr);
   } else {
     bt_conn_unref(phone_conn);
     phone_conn = NULL;
     is_adding_new_sensor = false;
     memset(command_char_val, 0, sizeof(command_char_val));
-    if (sensor_conn) bt_conn_disconnect(sensor_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    sensor = adding_sensor();
+    if (sensor) bt_conn_disconnect(sensor->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
   }
   if (!phone_conn) start_scan();
 }
@@ -690,11 +1031,6 @@ BT_CONN_CB_DEFINE(conn_callbacks) = {
   .disconnected = disconnected,
 };
 
-void add_known_sensor(char* addr) {
-  strcpy(known_sensor_addrs[known_sensor_addrs_len], addr);
-  printk("\tAdded known_sensor_addr: %s\n", known_sensor_addrs[known_sensor_addrs_len]);
-  known_sensor_addrs_len++;
-}
 
 int diagnostic_trigger(void) {
   return diagnostic_run();
@@ -729,6 +1065,20 @@ int init_ble(NetworkRequests* network_requests, Network* net) {
   hub_mac[MAC_ADDR_LEN - 1] = '\0';
   printk("\tHub MAC initialized as (%s)\n", hub_mac);
 
+  for (size_t i = 0; i < ARRAY_SIZE(sensors); i++) {
+    struct sensor_ctx_t* sensor = &sensors[i];
+    k_event_init(&sensor->reads);
+    k_work_init(&sensor->read_work, sensor_read_work);
+    k_work_init_delayable(&sensor->finish_work, sensor_finish_work);
+    k_work_init(&sensor->release_work, sensor_release_work);
+    sensor->level_params.func = read_battery_level_cb;
+    sensor->volts_params.func = read_battery_volts_cb;
+    sensor->version_params.func = read_firmware_version_cb;
+    sensor->level_params.handle_count = 1;
+    sensor->volts_params.handle_count = 1;
+    sensor->version_params.handle_count = 1;
+  }
+
   k_work_queue_start(&ble_work_q, ble_stack_area,
     K_THREAD_STACK_SIZEOF(ble_stack_area),
     CONFIG_SYSTEM_WORKQUEUE_PRIORITY + 1, &ble_work_q_config);
@@ -8,10 +8,6 @@
 extern "C" {
 #endif
 
-  // 10 available address slots
-  extern char known_sensor_addrs[10][50];
-  extern uint8_t known_sensor_addrs_len;
-
   // Enables Bluetooth, must be called before any other ble functions
   int init_ble(NetworkRequests* network_requests, Network* network);
 
@@ -32,11 +28,6 @@ extern "C" {
 
   void start_scan(void);
 
-  /**
-   * @brief Add a single sensor address to the known_sensor_addrs array
-   */
-  void add_known_sensor(char* addr);
-
 #ifdef __cplusplus
 }
 #endif
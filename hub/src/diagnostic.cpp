@@ -3,6 +3,9 @@
 #include <string.h>
 
 #include "diagnostic.h"
+#include "modem_trace.h"
+#include "modem_stats.h"
+#include "modem_arbiter.h"
 
 static NetworkRequests *network_reqs;
 static Network *network;
@@ -11,6 +14,9 @@ bool diagnostic_running = false;
 
 static char* msg_result;
 
+// Longest the diagnostic waits for other modem jobs before giving up
+#define DIAGNOSTIC_MAX_WAIT_MS    60000LL
+
 static struct k_work work;
 static struct k_work_q diagnostic_work_q;
 K_THREAD_STACK_DEFINE(diagnostic_stack_area, 2048);
@@ -27,12 +33,8 @@ void diagnostic_init(NetworkRequests* network_requests, Network* net) {
     CONFIG_SYSTEM_WORKQUEUE_PRIORITY + 1, &diagnostic_work_q_config);
 }
 
-static void diagnostic_work(struct k_work* work_item) {
+static int diagnostic_job(void* user_data) {
   printk("\n***** Running diagnostic *****\n");
-  if(!network || !network_reqs) {
-    printk("\tNetwork or network requests not initialized\n");
-    return;
-  }
   diagnostic_running = true;
 
   PreferredMode modes[] = {
@@ -45,6 +47,12 @@ static void diagnostic_work(struct k_work* work_item) {
   int8_t fastest_mode = -1;
   
   for (int8_t i = 0; i < 4; i++) {
+    // Cycling through the modes takes minutes, don't hold up door events or provisioning
+    if (modem_arbiter_should_yield()) {
+      printk("<<<>>> Stopping for a more urgent modem job\n");
+      if(msg_result) snprintk(msg_result, 40, "Stopped for a more urgent job\n");
+      break;
+    }
     network->set_power(false);
     k_msleep(500);
 
@@ -100,14 +108,34 @@ static void diagnostic_work(struct k_work* work_item) {
   }
 
   network->set_power(false);
+  modem_trace_dump();
+  modem_stats_print();
 
   printk("**** Diagnostics complete *****\n");
 
   diagnostic_running = false;
+  return fastest_mode == -1 ? -EIO : 0;
+}
+
+static void diagnostic_work(struct k_work* work_item) {
+  if(!network || !network_reqs) {
+    printk("\tNetwork or network requests not initialized\n");
+    return;
+  }
+  struct modem_job_t job;
+  modem_job_init(&job, "diagnostic", ModemJobPriority::DIAGNOSTIC, diagnostic_job, NULL);
+  job.max_wait_ms = DIAGNOSTIC_MAX_WAIT_MS;
+  if (modem_arbiter_run_job(&job) == -ETIMEDOUT && msg_result) {
+    snprintk(msg_result, 40, "Modem busy, try again later\n");
+  }
+}
+
+bool diagnostic_busy(void) {
+  return k_work_busy_get(&work) > 0;
 }
 
 int diagnostic_run(char* out_result_msg) {
-  if(k_work_busy_get(&work) > 0) {
+  if(diagnostic_busy()) {
     printk("Diagnostic already running\n");
     return -1;
   }
@@ -19,7 +19,13 @@ extern "C"
   void diagnostic_init(NetworkRequests *network_requests, Network *net);
 
   /**
-   * @brief Run a full diagnostic test.
+   * @return True while the diagnostic waits for the modem or runs
+   */
+  bool diagnostic_busy(void);
+
+  /**
+   * @brief Run a full diagnostic test as the lowest priority modem job, it stops
+   * early if anything else needs the modem
    * @param out_result_msg Optional buffer to store result summary in
    * @return 0 on success, other numbers on error
    */
@@ -0,0 +1,320 @@
+#ifndef HUB_GRAPHQL_H
+#define HUB_GRAPHQL_H
+
+#include <zephyr/kernel.h>
+#include <limits>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Builds AT+SHBOD commands carrying a GraphQL document. The query text is wrapped
+ * twice, once as a JSON string in {"query":"..."} and again as the AT string
+ * argument, so a " in the query is sent as \\" and a \ as \\\\. The fixed parts
+ * of a query are escaped at compile time with GRAPHQL_TEXT, the arguments while
+ * writing, and the number of bytes the modem sends after removing the AT level
+ * of escaping is counted along the way for the AT+SHBOD length.
+ *
+ *   Graphql::Request request(GRAPHQL_TEXT("mutation{createSensor(doorRow:"),
+ *     Graphql::Uint<uint8_t>{row}, GRAPHQL_TEXT(",serial:"), Graphql::Str<17>{addr},
+ *     GRAPHQL_TEXT("){id}}"));
+ *   network->send_request(request);
+ *
+ * A Request's buffer is sized from the widest each of its parts can be, so it
+ * can't be truncated. The only thing that can fail is a Str longer than its bound.
+ */
+namespace Graphql {
+  // AT+SHBOD="{\"query\":\"
+  constexpr char BODY_START[] = "AT+SHBOD=\"{\\\"query\\\":\\\"";
+  // Sent by the modem as {"query":"
+  constexpr size_t BODY_START_SENT = 10;
+  // \",\"variables\":{}}",<len>\r
+  constexpr char BODY_END[] = "\\\",\\\"variables\\\":{}}\",";
+  // Sent by the modem as ","variables":{}}
+  constexpr size_t BODY_END_SENT = 17;
+  // Digits of the length, the modem takes up to AT+SHCONF="BODYLEN",1024
+  constexpr size_t BODY_LEN_DIGITS = 4;
+  // Everything a request adds around its parts, plus the terminator
+  constexpr size_t ENVELOPE_SIZE = sizeof(BODY_START) - 1 + sizeof(BODY_END) - 1 + BODY_LEN_DIGITS + 2;
+
+  /**
+   * @return Bytes c takes inside the query once escaped for JSON and then AT
+   */
+  constexpr size_t escaped_width(char c) {
+    return c == '"' ? 3 : c == '\\' ? 4 : 1;
+  }
+
+  /**
+   * @return Size of raw once escaped, including the terminator
+   */
+  constexpr size_t escaped_size(const char* raw) {
+    size_t size = 1;
+    while (*raw) size += escaped_width(*raw++);
+    return size;
+  }
+
+  /**
+   * Fixed query text, escaped at compile time by GRAPHQL_TEXT
+   */
+  template <size_t N>
+  struct Text {
+    static constexpr size_t MAX_SIZE = N - 1;
+    char text[N];
+    // Bytes the modem sends for it
+    size_t sent;
+  };
+
+  template <size_t N>
+  constexpr Text<N> make_text(const char* raw) {
+    Text<N> out{};
+    size_t i = 0;
+    for (; *raw; raw++) {
+      // JSON escapes it with \, which AT escapes again. The modem takes a " that
+      // isn't the end of the argument as is, so it's left alone
+      if (*raw == '"' || *raw == '\\') {
+        out.text[i++] = '\\';
+        out.text[i++] = '\\';
+        out.sent++;
+      }
+      if (*raw == '\\') out.text[i++] = '\\';
+      out.text[i++] = *raw;
+      out.sent++;
+    }
+    out.text[i] = '\0';
+    return out;
+  }
+
+  /**
+   * Unsigned integer argument, e.g. Uint<uint16_t>{volts}
+   */
+  template <typename T>
+  struct Uint {
+    static constexpr size_t MAX_SIZE = std::numeric_limits<T>::digits10 + 1;
+    T value;
+  };
+
+  /**
+   * Signed integer argument
+   */
+  template <typename T>
+  struct Int {
+    static constexpr size_t MAX_SIZE = std::numeric_limits<T>::digits10 + 2;
+    T value;
+  };
+
+  /**
+   * Decimal argument printed with Precision digits after the point. Values are
+   * clamped to IntDigits digits before the point so the width is bounded
+   */
+  template <size_t IntDigits, size_t Precision>
+  struct Fixed {
+    static constexpr size_t MAX_SIZE = 1 + IntDigits + 1 + Precision;
+    float value;
+  };
+
+  /**
+   * Quoted string argument of at most MaxLen characters, escaped while writing
+   */
+  template <size_t MaxLen>
+  struct Str {
+    // Quotes take 3 bytes inside the query, a backslash in the value takes 4
+    static constexpr size_t MAX_SIZE = 4 * MaxLen + 6;
+    const char* value;
+  };
+
+  constexpr size_t pow10(size_t n) {
+    return n == 0 ? 1 : 10 * pow10(n - 1);
+  }
+
+  /**
+   * Appends parts to a caller provided buffer, use Buffer or Request to get one
+   */
+  class Writer {
+  public:
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    // The complete AT+SHBOD command once end was called
+    const char* c_str(void) const { return buf; }
+    size_t length(void) const { return len; }
+    // Bytes of the HTTP body the modem sends
+    size_t sent_length(void) const { return sent; }
+    // False if a part didn't fit, nothing is written from then on
+    bool ok(void) const { return valid; }
+
+    // Current length, to undo the parts appended after it with rewind
+    size_t mark(void) const { return len; }
+
+    void rewind(size_t to) {
+      // Only ever rewinds within the query, sent stays in step with len
+      sent -= count_sent(buf + to, len - to);
+      len = to;
+      buf[len] = '\0';
+      valid = true;
+    }
+
+    void begin(void) {
+      len = 0;
+      sent = 0;
+      valid = true;
+      put(BODY_START, sizeof(BODY_START) - 1, BODY_START_SENT);
+    }
+
+    /**
+     * @brief Closes the query and adds the length the modem needs
+     * @return ok()
+     */
+    bool end(void) {
+      put(BODY_END, sizeof(BODY_END) - 1, BODY_END_SENT);
+      if (!valid || sent >= pow10(BODY_LEN_DIGITS) || capacity - len < BODY_LEN_DIGITS + 2) {
+        valid = false;
+        return false;
+      }
+      len += snprintf(buf + len, capacity - len, "%u\r", (unsigned)sent);
+      return true;
+    }
+
+    template <size_t N>
+    bool append(const Text<N>& part) {
+      return put(part.text, N - 1, part.sent);
+    }
+
+    template <typename T>
+    bool append(const Uint<T>& part) {
+      char digits[Uint<T>::MAX_SIZE + 1];
+      int n = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)part.value);
+      return put(digits, n, n);
+    }
+
+    template <typename T>
+    bool append(const Int<T>& part) {
+      char digits[Int<T>::MAX_SIZE + 1];
+      int n = snprintf(digits, sizeof(digits), "%lld", (long long)part.value);
+      return put(digits, n, n);
+    }
+
+    template <size_t IntDigits, size_t Precision>
+    bool append(const Fixed<IntDigits, Precision>& part) {
+      constexpr float limit = pow10(IntDigits) - 1;
+      float value = part.value;
+      // Also catches NaN, which compares false to everything
+      if (!(value > -limit)) value = -limit;
+      if (value > limit) value = limit;
+      char digits[Fixed<IntDigits, Precision>::MAX_SIZE + 1];
+      int n = snprintf(digits, sizeof(digits), "%.*f", (int)Precision, (double)value);
+      return put(digits, n, n);
+    }
+
+    template <size_t MaxLen>
+    bool append(const Str<MaxLen>& part) {
+      size_t value_len = strnlen(part.value, MaxLen + 1);
+      if (value_len > MaxLen) {
+        printk("GraphQL argument longer than %u: %.*s...\n", (unsigned)MaxLen, (int)MaxLen, part.value);
+        valid = false;
+        return false;
+      }
+      size_t needed = 6;
+      for (size_t i = 0; i < value_len; i++) needed += escaped_width(part.value[i]);
+      if (!valid || capacity - len <= needed) {
+        valid = false;
+        return false;
+      }
+      put_quote();
+      for (size_t i = 0; i < value_len; i++) {
+        char c = part.value[i];
+        // JSON doesn't allow raw control characters in strings
+        if ((uint8_t)c < 0x20) c = '?';
+        if (c == '"' || c == '\\') {
+          memcpy(buf + len, "\\\\", 2);
+          len += 2;
+          sent++;
+        }
+        if (c == '\\') buf[len++] = c;
+        buf[len++] = c;
+        sent++;
+      }
+      put_quote();
+      buf[len] = '\0';
+      return true;
+    }
+
+  protected:
+    Writer(char* buf, size_t capacity) : buf(buf), capacity(capacity) {
+      buf[0] = '\0';
+    }
+
+  private:
+    char* buf;
+    size_t capacity;
+    size_t len = 0;
+    size_t sent = 0;
+    bool valid = true;
+
+    bool put(const char* s, size_t n, size_t n_sent) {
+      if (!valid || capacity - len <= n) {
+        valid = false;
+        return false;
+      }
+      memcpy(buf + len, s, n);
+      len += n;
+      buf[len] = '\0';
+      sent += n_sent;
+      return true;
+    }
+
+    // \\" inside the query, sent as \"
+    void put_quote(void) {
+      memcpy(buf + len, "\\\\\"", 3);
+      len += 3;
+      sent += 2;
+    }
+
+    // Bytes the modem sends for s, undoing the AT level of escaping
+    static size_t count_sent(const char* s, size_t n) {
+      size_t count = 0;
+      for (size_t i = 0; i < n; i++, count++) {
+        if (s[i] == '\\') i++;
+      }
+      return count;
+    }
+  };
+
+  /**
+   * Writer with its own storage, for bodies put together at runtime like the outbox batches
+   */
+  template <size_t Capacity>
+  class Buffer : public Writer {
+  public:
+    Buffer() : Writer(storage, Capacity) {}
+
+  private:
+    char storage[Capacity];
+  };
+
+  /**
+   * A complete AT+SHBOD command built from parts in order, sized for the widest
+   * each part can be. Check ok() if it has Str parts
+   */
+  template <typename... Parts>
+  class Request : public Buffer<ENVELOPE_SIZE + (Parts::MAX_SIZE + ... + 0)> {
+  public:
+    explicit Request(const Parts&... parts) {
+      this->begin();
+      (this->append(parts), ...);
+      this->end();
+    }
+  };
+
+  template <typename... Parts>
+  Request(const Parts&...) -> Request<Parts...>;
+}
+
+/**
+ * Escapes raw for a query at compile time, the result lives in flash
+ */
+#define GRAPHQL_TEXT(raw) ([]() -> const auto& { \
+    static constexpr auto text = Graphql::make_text<Graphql::escaped_size(raw)>(raw); \
+    return text; \
+  }())
+
+#endif
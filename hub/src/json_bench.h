@@ -0,0 +1,22 @@
+#ifndef HUB_JSON_BENCH_H
+#define HUB_JSON_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_HUB_JSON_BENCH
+  /**
+   * @brief Times json_path against cJSON on typical API responses and prints the
+   * time, peak heap and peak stack each takes. Blocks for a few seconds
+   */
+  void json_bench_run(void);
+#else
+  static inline void json_bench_run(void) {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
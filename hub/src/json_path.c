@@ -0,0 +1,218 @@
+#include <zephyr/kernel.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_path.h"
+
+// Nesting levels tracked by skip_value, one bit each in a uint32_t
+#define MAX_DEPTH   32
+
+static const char* skip_ws(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+  return p;
+}
+
+/*
+ * @param p the opening quote
+ * @return Just past the closing quote, NULL if unterminated
+ */
+static const char* skip_string(const char* p, const char* end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\') p++;
+    else if (*p == '"') return p + 1;
+  }
+  return NULL;
+}
+
+/*
+ * Skips a complete value, keeping a stack of open containers as bits so
+ * mismatched brackets are caught without recursion
+ * @return Just past the value, NULL if malformed
+ */
+static const char* skip_value(const char* p, const char* end) {
+  uint32_t stack = 0;  // 1 = object, 0 = array
+  int depth = 0;
+  do {
+    if (p >= end) return NULL;
+    switch (*p) {
+    case '"':
+      p = skip_string(p, end);
+      if (!p) return NULL;
+      break;
+    case '{':
+    case '[':
+      if (depth == MAX_DEPTH) return NULL;
+      stack = (stack << 1) | (*p == '{');
+      depth++;
+      p++;
+      break;
+    case '}':
+    case ']':
+      if (depth == 0 || (stack & 1) != (*p == '}')) return NULL;
+      stack >>= 1;
+      depth--;
+      p++;
+      break;
+    case ',':
+    case ':':
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      // Only valid inside a container
+      if (depth == 0) return NULL;
+      p++;
+      break;
+    default: {
+      // Number, true, false or null
+      const char* start = p;
+      while (p < end && !strchr(",:]} \t\n\r\"{[", *p)) p++;
+      if (p == start) return NULL;
+      break;
+    }
+    }
+  } while (depth > 0);
+  return p;
+}
+
+/*
+ * @param p the opening brace
+ * @return The value of key, NULL if not in the object or malformed
+ */
+static const char* find_key(const char* p, const char* end, const char* key, size_t key_len) {
+  p = skip_ws(p + 1, end);
+  while (p < end && *p == '"') {
+    const char* key_end = skip_string(p, end);
+    if (!key_end) return NULL;
+    // Keys are compared raw, GraphQL names never need escaping
+    bool match = (size_t)(key_end - p - 2) == key_len && memcmp(p + 1, key, key_len) == 0;
+    p = skip_ws(key_end, end);
+    if (p >= end || *p != ':') return NULL;
+    p = skip_ws(p + 1, end);
+    if (match) return p;
+    p = skip_value(p, end);
+    if (!p) return NULL;
+    p = skip_ws(p, end);
+    if (p >= end || *p != ',') return NULL;
+    p = skip_ws(p + 1, end);
+  }
+  return NULL;
+}
+
+/*
+ * @param p the opening bracket
+ * @return Element index of the array, NULL if out of range or malformed
+ */
+static const char* find_index(const char* p, const char* end, unsigned long index) {
+  struct json_value_t array = { p, end };
+  struct json_value_t item = {};
+  do {
+    if (json_array_next(&array, &item) != 0) return NULL;
+  } while (index-- > 0);
+  return item.start;
+}
+
+int json_validate(const char* json, size_t len) {
+  const char* end = json + len;
+  const char* p = skip_value(skip_ws(json, end), end);
+  return p && skip_ws(p, end) == end ? 0 : -EINVAL;
+}
+
+int json_path_find(const char* json, size_t len, const char* path, struct json_value_t* out) {
+  const char* end = json + len;
+  const char* p = skip_ws(json, end);
+
+  while (*path) {
+    if (p >= end) return -EINVAL;
+    if (*path == '[') {
+      char* index_end;
+      unsigned long index = strtoul(path + 1, &index_end, 10);
+      if (*index_end != ']') return -EINVAL;
+      path = index_end + 1;
+      if (*p != '[') return -ENOENT;
+      p = find_index(p, end, index);
+    } else {
+      if (*path == '.') path++;
+      size_t key_len = strcspn(path, ".[");
+      if (*p != '{') return -ENOENT;
+      p = find_key(p, end, path, key_len);
+      path += key_len;
+    }
+    if (!p) return -ENOENT;
+  }
+
+  const char* value_end = skip_value(p, end);
+  if (!value_end) return -EINVAL;
+  out->start = p;
+  out->end = value_end;
+  return 0;
+}
+
+int json_path_get_int(const char* json, size_t len, const char* path, int32_t* out) {
+  struct json_value_t value;
+  int err = json_path_find(json, len, path, &value);
+  if (err) return err;
+  if (*value.start != '-' && (*value.start < '0' || *value.start > '9')) return -EINVAL;
+  *out = (int32_t)strtol(value.start, NULL, 10);
+  return 0;
+}
+
+int json_path_get_string(const char* json, size_t len, const char* path, char* out, size_t out_size) {
+  struct json_value_t value;
+  int err = json_path_find(json, len, path, &value);
+  if (err) return err;
+  if (*value.start != '"') return -EINVAL;
+
+  size_t n = 0;
+  for (const char* p = value.start + 1; p < value.end - 1; p++) {
+    char c = *p;
+    if (c == '\\') {
+      switch (*++p) {
+      case 'n': c = '\n'; break;
+      case 't': c = '\t'; break;
+      case 'r': c = '\r'; break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'u': {
+        // Only ASCII is expected, anything else becomes '?'
+        char hex[5] = {};
+        if (value.end - p < 6) return -EINVAL;
+        memcpy(hex, p + 1, 4);
+        unsigned long code = strtoul(hex, NULL, 16);
+        c = code < 0x80 ? (char)code : '?';
+        p += 4;
+        break;
+      }
+      default: c = *p; break;
+      }
+    }
+    if (n + 1 >= out_size) return -ENOMEM;
+    out[n++] = c;
+  }
+  out[n] = '\0';
+  return n;
+}
+
+int json_array_next(const struct json_value_t* array, struct json_value_t* item) {
+  const char* end = array->end;
+  const char* p;
+  if (!item->start) {
+    if (array->start >= end || *array->start != '[') return -EINVAL;
+    p = skip_ws(array->start + 1, end);
+  } else {
+    p = skip_ws(item->end, end);
+    if (p >= end) return -EINVAL;
+    if (*p == ',') p = skip_ws(p + 1, end);
+    else if (*p != ']') return -EINVAL;
+  }
+  if (p >= end) return -EINVAL;
+  if (*p == ']') return -ENOENT;
+
+  const char* value_end = skip_value(p, end);
+  if (!value_end) return -EINVAL;
+  item->start = p;
+  item->end = value_end;
+  return 0;
+}
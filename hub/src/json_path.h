@@ -0,0 +1,65 @@
+#ifndef HUB_JSON_PATH_H
+#define HUB_JSON_PATH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A JSON value inside a response buffer, nothing is copied or allocated.
+ * start points at the first character of the value (the quote of a string,
+ * the brace of an object) and end just past its last one
+ */
+struct json_value_t {
+  const char* start;
+  const char* end;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * @brief Checks that json holds exactly one well formed value, e.g. that a
+   * response wasn't cut short. Containers may nest up to 32 deep
+   * @return 0 if valid, -EINVAL otherwise
+   */
+  int json_validate(const char* json, size_t len);
+
+  /**
+   * @brief Finds the value at path without parsing anything else. Path segments are
+   * object keys separated by dots, with [n] for array elements: "errors[0].extensions.code"
+   * @param json document or value to search, e.g. a json_value_t from a previous call
+   * @param len length of json
+   * @param path the path to find, "" for json itself
+   * @param out set to the value found
+   * @return 0 if found, -ENOENT if not, -EINVAL if json is malformed on the way to it
+   */
+  int json_path_find(const char* json, size_t len, const char* path, struct json_value_t* out);
+
+  /**
+   * @brief Reads the integer at path, see json_path_find
+   * @return 0 if found, -ENOENT if missing, -EINVAL if not an integer
+   */
+  int json_path_get_int(const char* json, size_t len, const char* path, int32_t* out);
+
+  /**
+   * @brief Copies the unescaped string at path into out, see json_path_find
+   * @param out_size size of out including the terminator
+   * @return Length of the string, -ENOENT if missing, -EINVAL if not a string,
+   * -ENOMEM if it doesn't fit in out
+   */
+  int json_path_get_string(const char* json, size_t len, const char* path, char* out, size_t out_size);
+
+  /**
+   * @brief Steps through the elements of an array, start with item zeroed
+   * @param array an array found with json_path_find
+   * @param item the previous element, set to the next one
+   * @return 0 if item was set, -ENOENT after the last element, -EINVAL if malformed
+   */
+  int json_array_next(const struct json_value_t* array, struct json_value_t* item);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
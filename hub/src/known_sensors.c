@@ -0,0 +1,181 @@
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "known_sensors.h"
+
+#define MAX_SENSORS       CONFIG_HUB_KNOWN_SENSORS_MAX
+// Kept at most half full so a lookup probes a slot or two
+#define TABLE_SLOTS       (2 * MAX_SENSORS)
+// Lets a burst of adds, e.g. the sensor list fetched on boot, be saved with one flash write
+#define SAVE_DELAY_MS     1000
+
+// An all zero address marks a free slot
+static bt_addr_t table[TABLE_SLOTS];
+static size_t count;
+static uint32_t version;
+static struct k_spinlock table_lock;
+
+// Saved packed, only the used slots, so the saved size follows the number of sensors
+static bt_addr_t save_buf[MAX_SENSORS];
+static struct k_work_delayable save_work;
+
+static bool is_free(const bt_addr_t* slot) {
+  return bt_addr_cmp(slot, BT_ADDR_ANY) == 0;
+}
+
+/*
+ * FNV-1a over the address bytes
+ */
+static uint32_t hash(const bt_addr_t* addr) {
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < sizeof(addr->val); i++) {
+    h = (h ^ addr->val[i]) * 16777619U;
+  }
+  return h;
+}
+
+/*
+ * Slot holding addr, or the free slot it would go in. There is always a free slot
+ * since the table is never more than half full. Must be called with table_lock held.
+ */
+static size_t find_slot(const bt_addr_t* addr) {
+  size_t i = hash(addr) % TABLE_SLOTS;
+  while (!is_free(&table[i]) && bt_addr_cmp(&table[i], addr) != 0) {
+    i = (i + 1) % TABLE_SLOTS;
+  }
+  return i;
+}
+
+/*
+ * Must be called with table_lock held.
+ */
+static int insert(const bt_addr_t* addr) {
+  if (is_free(addr)) return -EINVAL;
+  size_t i = find_slot(addr);
+  if (!is_free(&table[i])) return 0;
+  if (count >= MAX_SENSORS) return -ENOMEM;
+  bt_addr_copy(&table[i], addr);
+  count++;
+  version++;
+  return 0;
+}
+
+static int known_sensors_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+  const char* next;
+  int rc;
+  if (settings_name_steq(name, "addrs", &next) && !next) {
+    if (len % sizeof(bt_addr_t) || len > sizeof(save_buf)) {
+      printk("sensors/addrs size %d is not compatible with the application max %d\n", len, sizeof(save_buf));
+      return -EINVAL;
+    }
+    rc = read_cb(cb_arg, save_buf, len);
+    if (rc < 0) {
+      return rc;
+    }
+    k_spinlock_key_t key = k_spin_lock(&table_lock);
+    for (size_t i = 0; i < len / sizeof(bt_addr_t); i++) insert(&save_buf[i]);
+    k_spin_unlock(&table_lock, key);
+    return 0;
+  }
+  return -ENOENT;
+}
+
+static struct settings_handler known_sensors_conf = {
+    .name = "sensors",
+    .h_set = known_sensors_set,
+};
+
+static void save_known_sensors_work(struct k_work* work_item) {
+  // Never more than MAX_SENSORS, so all of them fit
+  size_t n = known_sensors_copy(save_buf, ARRAY_SIZE(save_buf));
+  int ret = n ? settings_save_one("sensors/addrs", save_buf, n * sizeof(bt_addr_t))
+    : settings_delete("sensors/addrs");
+  printk("Saved %u known sensor(s), status=%d\n", n, ret);
+}
+
+void known_sensors_init(void) {
+  k_work_init_delayable(&save_work, save_known_sensors_work);
+  settings_register(&known_sensors_conf);
+  settings_load_subtree("sensors");
+  printk("\t%u known sensor(s) loaded\n", count);
+}
+
+bool known_sensors_contains(const bt_addr_t* addr) {
+  k_spinlock_key_t key = k_spin_lock(&table_lock);
+  bool found = !is_free(addr) && !is_free(&table[find_slot(addr)]);
+  k_spin_unlock(&table_lock, key);
+  return found;
+}
+
+int known_sensors_add(const bt_addr_t* addr) {
+  k_spinlock_key_t key = k_spin_lock(&table_lock);
+  size_t before = count;
+  int err = insert(addr);
+  bool added = count != before;
+  k_spin_unlock(&table_lock, key);
+  if (err) {
+    printk("Unable to add known sensor: %d\n", err);
+    return err;
+  }
+  if (added) k_work_reschedule(&save_work, K_MSEC(SAVE_DELAY_MS));
+  return 0;
+}
+
+int known_sensors_add_str(const char* str) {
+  bt_addr_t addr;
+  if (bt_addr_from_str(str, &addr)) return -EINVAL;
+  int err = known_sensors_add(&addr);
+  if (!err) printk("\tAdded known sensor: %s\n", str);
+  return err;
+}
+
+int known_sensors_replace(const bt_addr_t* addrs, size_t n) {
+  int err = 0;
+  k_spinlock_key_t key = k_spin_lock(&table_lock);
+  uint32_t next_version = version + 1;
+  memset(table, 0, sizeof(table));
+  count = 0;
+  for (size_t i = 0; i < n; i++) {
+    int ret = insert(&addrs[i]);
+    if (ret && !err) err = ret;
+  }
+  // insert bumped it for every address, readers only need to see one change
+  version = next_version;
+  k_spin_unlock(&table_lock, key);
+  k_work_reschedule(&save_work, K_MSEC(SAVE_DELAY_MS));
+  if (err) printk("Unable to add known sensor: %d\n", err);
+  return err;
+}
+
+void known_sensors_clear(void) {
+  k_spinlock_key_t key = k_spin_lock(&table_lock);
+  memset(table, 0, sizeof(table));
+  count = 0;
+  version++;
+  k_spin_unlock(&table_lock, key);
+  k_work_reschedule(&save_work, K_MSEC(SAVE_DELAY_MS));
+}
+
+size_t known_sensors_count(void) {
+  return count;
+}
+
+size_t known_sensors_copy(bt_addr_t* out, size_t max) {
+  size_t n = 0;
+  k_spinlock_key_t key = k_spin_lock(&table_lock);
+  for (size_t i = 0; i < TABLE_SLOTS && n < max; i++) {
+    if (!is_free(&table[i])) bt_addr_copy(&out[n++], &table[i]);
+  }
+  size_t total = count;
+  k_spin_unlock(&table_lock, key);
+  return total;
+}
+
+uint32_t known_sensors_version(void) {
+  return version;
+}
@@ -0,0 +1,75 @@
+#ifndef KNOWN_SENSORS_H
+#define KNOWN_SENSORS_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+
+/*
+ * Sensors registered to this hub, keyed by their 6 byte address without the type,
+ * the server only knows the MAC. An open addressing table sized by
+ * CONFIG_HUB_KNOWN_SENSORS_MAX, lookups take a spinlock and never allocate so they
+ * can run in the scan callback. Changes are saved to the sensors settings subtree.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * @brief Loads the sensors saved before the last reboot, settings must already be initialized
+   */
+  void known_sensors_init(void);
+
+  /**
+   * @return True if addr is registered to this hub
+   */
+  bool known_sensors_contains(const bt_addr_t* addr);
+
+  /**
+   * @brief Adds addr and schedules a save
+   * @return 0 on success or if it was known already, -ENOMEM if the table is full,
+   * -EINVAL for the all zero address
+   */
+  int known_sensors_add(const bt_addr_t* addr);
+
+  /**
+   * @brief Adds a MAC given as text, e.g. a sensor serial from the server
+   * @return As known_sensors_add, -EINVAL if str isn't a MAC
+   */
+  int known_sensors_add_str(const char* str);
+
+  /**
+   * @brief Swaps the whole table for addrs in one go, with a single version change, and
+   * schedules a save. Lookups see either the old or the new set, never a partial one
+   * @return 0 on success, otherwise the first error as known_sensors_add, the other
+   * addresses are still added
+   */
+  int known_sensors_replace(const bt_addr_t* addrs, size_t n);
+
+  /**
+   * @brief Forgets every sensor and schedules a save
+   */
+  void known_sensors_clear(void);
+
+  /**
+   * @return Number of known sensors
+   */
+  size_t known_sensors_count(void);
+
+  /**
+   * @brief Copies up to max of the known sensors to out, in no particular order
+   * @return Number of known sensors, more than were copied if max was too small
+   */
+  size_t known_sensors_copy(bt_addr_t* out, size_t max);
+
+  /**
+   * @return A counter that changes whenever a sensor is added or the table is cleared,
+   * so copies of the table can tell they are out of date
+   */
+  uint32_t known_sensors_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,13 @@
 #include "utilities.h"
 #include "network.h"
 #include "network_requests.h"
+#include "modem_power.h"
+#include "battery.h"
+
+// Time between AT+CGNSINF polls while waiting for a fix
+#define GPS_POLL_MS             10000
+// How often a warm up checks whether a more urgent modem job is waiting
+#define GPS_YIELD_CHECK_MS      250
 
 // TODO find from a static library
 #define M_PI           3.14159265358979323846
@@ -80,29 +87,62 @@ LocReading Location::parse_inf(char* inf_buffer) {
 void Location::init(Network* net, NetworkRequests* network_requests) {
   network = net;
   network_reqs = network_requests;
+  modem_job_init(&update_job, "gps", ModemJobPriority::BACKGROUND, update_job_fn, this);
 }
 
 bool Location::should_warm_up() {
-  return !warm_up_start_time && (last_gps_time == 0 || k_uptime_get() > last_gps_time + GPS_UPDATE_INTERVAL);
+  return !update_job.busy && (last_gps_time == 0 || k_uptime_get() > last_gps_time + GPS_UPDATE_INTERVAL);
+}
+
+int Location::start_update() {
+  return modem_arbiter_submit(&update_job);
+}
+
+int Location::update_job_fn(void* user_data) {
+  return ((Location*)user_data)->run_update();
 }
 
-bool Location::should_send_update() {
-  return warm_up_start_time > 0;
+int Location::run_update() {
+  unsigned long prev_gps_time = last_gps_time;
+  if (start_warm_up() != 0) return -1;
+  int err = -1;
+  // send_update turns the GPS off once it queued a fix, gave up or timed out
+  while (warm_up_start_time) {
+    // No point sleeping past the warm up, send_update gives up once it's over
+    int64_t poll_ms = warm_up_deadline.clamp_ms(GPS_POLL_MS);
+    for (int64_t waited = 0; waited < poll_ms; waited += GPS_YIELD_CHECK_MS) {
+      if (modem_arbiter_should_yield()) {
+        // Not counted as a check, it's queued again on the next loop
+        last_gps_time = prev_gps_time;
+        turn_off("GPS warm up stopped for a more urgent modem job\n");
+        return -EAGAIN;
+      }
+      k_msleep(GPS_YIELD_CHECK_MS);
+    }
+    err = send_update(last_batt_reading.real_mV, last_batt_reading.percent);
+  }
+  return err;
 }
 
 void Location::turn_off(const char* msg) {
   if (strlen(msg)) printk("%s", msg);
   Utilities::write_rgb(0, 0, 0);
   set_gps_power(false);
-  network->set_power(false);
+  if (holds_modem) {
+    holds_modem = false;
+    modem_power_expect_use(GPS_UPDATE_INTERVAL);
+    modem_power_release();
+  }
   warm_up_start_time = 0;
 }
 
 int Location::start_warm_up() {
   // warm up the module
   Utilities::write_rgb(235, 30, 180);
-  network->set_power(true);
-  if (!network->wait_for_power_on()) {
+  holds_modem = true;
+  // Powering the modem on comes out of the warm up's time
+  warm_up_deadline = Deadline(GPS_BUFFER_TIME);
+  if (!modem_power_acquire(false, warm_up_deadline.remaining_ms())) {
     turn_off("Error: Network didn't start\n");
     return -1;
   } else if (!set_gps_power(true)) {
@@ -116,21 +156,21 @@ int Location::start_warm_up() {
 int Location::send_update(int real_mV, uint8_t percent) {
   Utilities::write_rgb(120, 10, 50);
 
-  if (k_uptime_get() > warm_up_start_time + GPS_BUFFER_TIME) {
+  if (warm_up_deadline.expired()) {
     turn_off("Location check timed out, aborting\n");
     return -1;
   }
 
-  if (!network->is_powered_on()) {
+  if (!network->is_powered_on_cached()) {
     turn_off("Modem isn't powered, aborting\n");
     return -1;
   }
   // module is warmed up
   last_gps_time = k_uptime_get();
   serial_print_uart("AT+CGNSINF\r");
-  serial_did_return_str("AT+CGNSINF", 5000LL);
-  char inf_buf[200];
-  serial_read_queue(inf_buf, 5000LL);
+  serial_did_return_str("AT+CGNSINF", warm_up_deadline.clamp_ms(5000LL));
+  char inf_buf[200]{};
+  serial_read_queue(inf_buf, warm_up_deadline.clamp_ms(5000LL));
   if (strlen(inf_buf) < 10) {
     printk("Failed to read inf from SIM module, aborting\n");
     return -1;
@@ -156,8 +196,8 @@ int Location::send_update(int real_mV, uint8_t percent) {
 
   int err = network_reqs->handle_update_gps_loc(reading.lat, reading.lng, reading.hdop, reading.kmph, reading.deg, real_mV, percent);
   last_sent_reading = reading;
-  if (err) turn_off("Network request to update gps loc failed\n");
-  else turn_off("Successfully updated gps location!\n");
+  if (err) turn_off("Unable to queue gps location\n");
+  else turn_off("Queued gps location update!\n");
   return err;
 }
 
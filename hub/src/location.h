@@ -3,6 +3,8 @@
 
 #include "network_requests.h"
 #include "network.h"
+#include "utilities.h"
+#include "modem_arbiter.h"
 
 struct LocReading {
   bool hasFix = false;
@@ -40,11 +42,42 @@ private:
   // If greater than 0, a warm up was kicked off at this ms time
   int64_t warm_up_start_time = 0;
 
+  // When the current warm up has to give up on getting a fix
+  Deadline warm_up_deadline;
+
   // The last sent LocReading sent to the server
   LocReading last_sent_reading;
 
   // If the GPS module is powered on (should be off on init)
   bool is_powered = false;
+
+  // Set while the GPS warm up holds the modem through modem_power_acquire
+  bool holds_modem = false;
+
+  // Warms up the GPS and sends a fix as a background modem job
+  struct modem_job_t update_job;
+
+  static int update_job_fn(void* user_data);
+
+  /**
+   * @brief Body of update_job, polls for a fix until it was sent or the warm up timed
+   * out. Gives the modem up early if a more urgent job is waiting
+   * @return 0 if a location was queued, -EAGAIN if it gave way, -1 for other failures
+   */
+  int run_update();
+
+  /**
+   * @brief Starts warm up process of turning on modem, send_update
+   * should be polled until it turns the GPS off
+   * @return 0 on success, -1 for any failure starting modem
+   */
+  int start_warm_up();
+
+  /**
+   * @brief Reads the location and attempts to send it across the network
+   * @return 0 on success, -1 for any failures
+   */
+  int send_update(int real_mV, uint8_t percent);
 public:
 
   static void print_loc_reading(LocReading reading);
@@ -73,31 +106,18 @@ public:
    */
   void init(Network* net, NetworkRequests* network_requests);
 
-  /**
-   * @return true if it's time to send another network request and
-   * send_update() should be called
-   */
-  bool should_send_update();
-
   /**
    * @return true if GPS_INTERVAL has passed since last update and
-   * haven't already started warming up
+   * an update isn't already waiting for or using the modem
    */
   bool should_warm_up();
 
   /**
-   * @brief Starts warm up process of turning on modem, should_send_update
-   * should be polled until send_update can be called
-   * @return 0 on success, -1 for any failure starting modem
+   * @brief Queues warming up the GPS and sending the location as a background
+   * modem job, doesn't block
+   * @return 0 on success, -EBUSY if an update is already queued
    */
-  int start_warm_up();
-
-  /**
-   * @brief Blocks while warming up the modem and reading location
-   * then attempts to send it across the network
-   * @return 0 on success, -1 for any failures
-   */
-  int send_update(int real_mV, uint8_t percent);
+  int start_update();
 
   /**
    * Powers on/off GPS module
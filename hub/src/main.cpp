@@ -1,17 +1,22 @@
 #include <zephyr/kernel.h>
 #include <zephyr/sys/printk.h>
 #include <string.h>
-#include <cJSON.h>
 
 #include "utilities.h"
 #include "battery.h"
 #include "network_requests.h"
 #include "network.h"
+#include "json_path.h"
+#include "json_bench.h"
 #include "location.h"
 #include "ble.h"
 #include "version.h"
 #include "serial.h"
 #include "diagnostic.h"
+#include "modem_power.h"
+#include "modem_arbiter.h"
+#include "outbox.h"
+#include "known_sensors.h"
 
 // UART over USB
 #ifdef CONFIG_UART_LINE_CTRL
@@ -33,7 +38,7 @@ const k_work_queue_config periodic_work_q_config = {
 };
 
 static void handle_loop_work(struct k_work* work_item) {
-  if (network.has_token() && !ble_is_busy() && !diagnostic_running) {
+  if (network.has_token() && !ble_is_busy()) {
     printk("⏰  [%lld] Bat: %d%%, Checking if background work is scheduled...", k_uptime_get(), last_batt_reading.percent);
     if(last_batt_reading.percent <= 5) {
       Utilities::write_rgb_low_battery();
@@ -41,9 +46,7 @@ static void handle_loop_work(struct k_work* work_item) {
       battery_update();
     } else if (location.should_warm_up()) {
       battery_update_cache();
-      if(last_batt_reading.percent > 10) location.start_warm_up();
-    } else if (location.should_send_update()) {
-      location.send_update(last_batt_reading.real_mV, last_batt_reading.percent);
+      if(last_batt_reading.percent > 10) location.start_update();
     }
     printk("\tBackground work complete\n");
   }
@@ -51,6 +54,44 @@ static void handle_loop_work(struct k_work* work_item) {
   k_work_schedule(&work, K_SECONDS(10));
 }
 
+/*
+ * Replaces the known sensors with the getMySensors response, one element at a time so the
+ * number of sensors isn't limited by the heap. Drops sensors removed on the server while the hub was off.
+ * The set is built first and swapped in at once so the scan never sees a half filled table
+ */
+static void add_fetched_sensors(const char* json, size_t len, void* user_data) {
+  static bt_addr_t addrs[CONFIG_HUB_KNOWN_SENSORS_MAX];
+  struct json_value_t sensors;
+  struct json_value_t sensor = {};
+  char serial[18];
+  int32_t id;
+  size_t n = 0;
+  if (json_path_find(json, len, "data.hubViewer.sensors", &sensors) != 0) return;
+  while (json_array_next(&sensors, &sensor) == 0) {
+    size_t sensor_len = sensor.end - sensor.start;
+    if (json_path_get_string(sensor.start, sensor_len, "serial", serial, sizeof(serial)) <= 0) continue;
+    if (json_path_get_int(sensor.start, sensor_len, "id", &id) != 0) id = -1;
+    printk("Sensor id %d, and serial is %s\n", id, serial);
+    if (n == ARRAY_SIZE(addrs)) {
+      printk("\tMore than %u sensors, ignoring %s\n", ARRAY_SIZE(addrs), serial);
+    } else if (bt_addr_from_str(serial, &addrs[n]) == 0) {
+      n++;
+    }
+  }
+  known_sensors_replace(addrs, n);
+}
+
+static int fetch_sensors_job(void* user_data) {
+  int err = -ENETUNREACH;
+  if (modem_power_acquire()) {
+    Graphql::Request request(GRAPHQL_TEXT("query getMySensors{hubViewer{sensors{id,serial}}}"));
+    err = network.send_request(request, add_fetched_sensors);
+  }
+  // Powered since configure_modem, release also covers a failed acquire
+  modem_power_release();
+  return err;
+}
+
 int main(void)
 {
   // UART over USB
@@ -86,7 +127,10 @@ int main(void)
   }
   printk("\t✔️   SIM peripherals ready\n");
 
+  modem_power_init(&network);
+  modem_arbiter_init();
   network_requests.init(&network);
+  outbox_init(&network);
   location.init(&network, &network_requests);
 
   // TODO battery init should store battery level when modem off
@@ -128,27 +172,16 @@ int main(void)
 
   printk("Checking peristent storage for saved configs...\n");
   network.initialize_access_token();
+  known_sensors_init();
   printk("\t✔️  Persistent storage ready\n");
 
-  if (network.has_token() && network.set_power_on_and_wait_for_reg()) {
-    char sensor_query[] = "{\\\"query\\\":\\\"query getMySensors{hubViewer{sensors{id,serial}}}\\\",\\\"variables\\\":{}}";
-    cJSON* doc = network.send_request(sensor_query);
-    cJSON* sensors = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "hubViewer"), "sensors");
-    if (cJSON_GetArraySize(sensors)) {
-      cJSON* sensor;
-      printk("Array size is %d\n", cJSON_GetArraySize(sensors));
-      cJSON_ArrayForEach(sensor, sensors) {
-        printk("Sensor id %d, and serial is %s\n",
-          cJSON_GetObjectItem(sensor, "id")->valueint,
-          cJSON_GetObjectItem(sensor, "serial")->valuestring
-        );
-        add_known_sensor(cJSON_GetObjectItem(sensor, "serial")->valuestring);
-      }
-    }
-    cJSON_Delete(doc);
+  if (network.has_token()) {
+    modem_arbiter_run(ModemJobPriority::PROVISIONING, "get sensors", fetch_sensors_job, NULL);
+  } else {
+    modem_power_idle();
   }
 
-  network.set_power(false);
+  json_bench_run();
 
   printk("\n>>>>> Setup complete in %lli(ms)! <<<<<\n\n", k_uptime_delta(&boot_time));
 
@@ -0,0 +1,162 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <errno.h>
+
+#include "modem_arbiter.h"
+#include "modem_stats.h"
+
+static const char* const PRIORITY_NAMES[] = { "diagnostic", "background", "provisioning", "event" };
+
+/* Jobs waiting to run, highest priority first */
+static sys_slist_t queue = SYS_SLIST_STATIC_INIT(&queue);
+static struct k_spinlock queue_lock;
+// Counts submits, the queue can have fewer jobs after a cancel
+static K_SEM_DEFINE(queue_sem, 0, K_SEM_MAX_LIMIT);
+static struct modem_job_t* running;
+
+static struct k_thread arbiter_thread;
+K_THREAD_STACK_DEFINE(arbiter_stack_area, 4096);
+
+/*
+ * Inserts job behind every job of the same or higher priority. Must be called with queue_lock held.
+ */
+static void enqueue(struct modem_job_t* job) {
+  sys_snode_t* prev = NULL;
+  struct modem_job_t* queued;
+  SYS_SLIST_FOR_EACH_CONTAINER(&queue, queued, node) {
+    if (queued->priority < job->priority) break;
+    prev = &queued->node;
+  }
+  if (prev) sys_slist_insert(&queue, prev, &job->node);
+  else sys_slist_prepend(&queue, &job->node);
+}
+
+static void finish(struct modem_job_t* job, int result) {
+  job->result = result;
+  job->busy = false;
+  k_sem_give(&job->done);
+}
+
+static void run(struct modem_job_t* job) {
+  int64_t start_time = k_uptime_get();
+  int64_t waited = start_time - job->submit_time;
+  if (job->max_wait_ms && waited > job->max_wait_ms) {
+    printk("Modem job %s dropped after waiting %lldms\n", job->name, waited);
+    modem_stats_record(MODEM_STAT_QUEUE_WAIT, waited, false);
+    finish(job, -ETIMEDOUT);
+    return;
+  }
+  modem_stats_record(MODEM_STAT_QUEUE_WAIT, waited, true);
+  printk("Modem job %s (%s) starting after %lldms in the queue\n", job->name,
+    PRIORITY_NAMES[(uint8_t)job->priority], waited);
+  int result = job->fn(job->user_data);
+  printk("Modem job %s done in %lldms: %d\n", job->name, k_uptime_get() - start_time, result);
+  finish(job, result);
+}
+
+static void arbiter_thread_fn(void* p1, void* p2, void* p3) {
+  while (true) {
+    k_sem_take(&queue_sem, K_FOREVER);
+    k_spinlock_key_t key = k_spin_lock(&queue_lock);
+    sys_snode_t* node = sys_slist_get(&queue);
+    struct modem_job_t* job = node ? CONTAINER_OF(node, struct modem_job_t, node) : NULL;
+    running = job;
+    k_spin_unlock(&queue_lock, key);
+    // Cancelled after it was counted
+    if (!job) continue;
+
+    run(job);
+
+    key = k_spin_lock(&queue_lock);
+    running = NULL;
+    k_spin_unlock(&queue_lock, key);
+  }
+}
+
+void modem_arbiter_init(void) {
+  k_thread_create(&arbiter_thread, arbiter_stack_area, K_THREAD_STACK_SIZEOF(arbiter_stack_area),
+    arbiter_thread_fn, NULL, NULL, NULL, CONFIG_SYSTEM_WORKQUEUE_PRIORITY + 1, 0, K_NO_WAIT);
+  k_thread_name_set(&arbiter_thread, "modem_arbiter");
+}
+
+void modem_job_init(struct modem_job_t* job, const char* name, ModemJobPriority priority,
+  modem_job_fn_t fn, void* user_data) {
+  *job = {};
+  job->name = name;
+  job->priority = priority;
+  job->fn = fn;
+  job->user_data = user_data;
+  k_sem_init(&job->done, 0, 1);
+}
+
+int modem_arbiter_submit(struct modem_job_t* job) {
+  k_spinlock_key_t key = k_spin_lock(&queue_lock);
+  if (job->busy) {
+    k_spin_unlock(&queue_lock, key);
+    return -EBUSY;
+  }
+  job->busy = true;
+  job->submit_time = k_uptime_get();
+  k_sem_reset(&job->done);
+  enqueue(job);
+  k_spin_unlock(&queue_lock, key);
+  k_sem_give(&queue_sem);
+  return 0;
+}
+
+int modem_arbiter_run_job(struct modem_job_t* job) {
+  if (modem_arbiter_is_owner()) return job->fn(job->user_data);
+  int err = modem_arbiter_submit(job);
+  if (err) return err;
+  k_sem_take(&job->done, K_FOREVER);
+  return job->result;
+}
+
+int modem_arbiter_run(ModemJobPriority priority, const char* name, modem_job_fn_t fn, void* user_data) {
+  struct modem_job_t job;
+  modem_job_init(&job, name, priority, fn, user_data);
+  return modem_arbiter_run_job(&job);
+}
+
+bool modem_arbiter_cancel(struct modem_job_t* job) {
+  k_spinlock_key_t key = k_spin_lock(&queue_lock);
+  bool removed = job->busy && job != running && sys_slist_find_and_remove(&queue, &job->node);
+  k_spin_unlock(&queue_lock, key);
+  if (removed) {
+    printk("Modem job %s cancelled\n", job->name);
+    finish(job, -ECANCELED);
+  }
+  return removed;
+}
+
+void modem_arbiter_raise(struct modem_job_t* job, ModemJobPriority priority) {
+  k_spinlock_key_t key = k_spin_lock(&queue_lock);
+  if (job->priority < priority && job->busy && job != running && sys_slist_find_and_remove(&queue, &job->node)) {
+    job->priority = priority;
+    enqueue(job);
+  }
+  k_spin_unlock(&queue_lock, key);
+}
+
+bool modem_arbiter_should_yield(void) {
+  k_spinlock_key_t key = k_spin_lock(&queue_lock);
+  sys_snode_t* head = sys_slist_peek_head(&queue);
+  bool yield = running && head && CONTAINER_OF(head, struct modem_job_t, node)->priority > running->priority;
+  k_spin_unlock(&queue_lock, key);
+  return yield;
+}
+
+bool modem_arbiter_pending(void) {
+  k_spinlock_key_t key = k_spin_lock(&queue_lock);
+  bool pending = !sys_slist_is_empty(&queue);
+  k_spin_unlock(&queue_lock, key);
+  return pending;
+}
+
+bool modem_arbiter_busy(void) {
+  return running != NULL;
+}
+
+bool modem_arbiter_is_owner(void) {
+  return k_current_get() == &arbiter_thread;
+}
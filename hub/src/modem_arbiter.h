@@ -0,0 +1,115 @@
+#ifndef HUB_MODEM_ARBITER_H
+#define HUB_MODEM_ARBITER_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/slist.h>
+#include <stdint.h>
+
+// Higher runs first, jobs of the same priority run in the order they were submitted
+enum class ModemJobPriority : uint8_t {
+  DIAGNOSTIC,
+  // Battery and location uploads, GPS warm up
+  BACKGROUND,
+  // Hub login, adding a sensor, fetching the sensor list
+  PROVISIONING,
+  // Outbox flushes carrying door events
+  EVENT,
+};
+
+/**
+ * Runs on the arbiter thread with the modem to itself
+ * @return Handed back to whoever waits for the job, negative errno by convention
+ */
+typedef int (*modem_job_fn_t)(void* user_data);
+
+/**
+ * A unit of modem work. Owned by the submitter and must stay valid until it finished,
+ * initialize with modem_job_init
+ */
+struct modem_job_t {
+  sys_snode_t node;
+  modem_job_fn_t fn;
+  void* user_data;
+  const char* name;
+  ModemJobPriority priority;
+  // Give up with -ETIMEDOUT if it didn't start within this many ms of being submitted, 0 waits forever
+  int64_t max_wait_ms;
+  int64_t submit_time;
+  // fn's return value, -ECANCELED or -ETIMEDOUT if it never ran
+  int result;
+  // Queued or running
+  bool busy;
+  // Given once the job finished or was cancelled
+  struct k_sem done;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * @brief Starts the arbiter thread, the only thread that talks to the modem
+   * once setup is done
+   */
+  void modem_arbiter_init(void);
+
+  void modem_job_init(struct modem_job_t* job, const char* name, ModemJobPriority priority,
+    modem_job_fn_t fn, void* user_data);
+
+  /**
+   * @brief Queues job without waiting for it
+   * @return 0 on success, -EBUSY if it is already queued or running
+   */
+  int modem_arbiter_submit(struct modem_job_t* job);
+
+  /**
+   * @brief Queues job and blocks until it finished. Called from a job it runs right
+   * away instead, the caller already has the modem
+   * @return The job's result
+   */
+  int modem_arbiter_run_job(struct modem_job_t* job);
+
+  /**
+   * @brief Shorthand for modem_arbiter_run_job with a job on the stack
+   */
+  int modem_arbiter_run(ModemJobPriority priority, const char* name, modem_job_fn_t fn, void* user_data);
+
+  /**
+   * @brief Removes job from the queue, a job that already started can't be cancelled
+   * but can be asked to stop through modem_arbiter_should_yield
+   * @return True if it was removed
+   */
+  bool modem_arbiter_cancel(struct modem_job_t* job);
+
+  /**
+   * @brief Moves a queued job up if priority is higher than its own, e.g. when a door
+   * event is added to an outbox flush that is waiting as a background job
+   */
+  void modem_arbiter_raise(struct modem_job_t* job, ModemJobPriority priority);
+
+  /**
+   * @brief Polled by long running jobs like the GPS warm up or the diagnostic
+   * @return True if a job of higher priority than the running one is waiting
+   */
+  bool modem_arbiter_should_yield(void);
+
+  /**
+   * @return True if jobs are queued behind the running one
+   */
+  bool modem_arbiter_pending(void);
+
+  /**
+   * @return True while a job is running
+   */
+  bool modem_arbiter_busy(void);
+
+  /**
+   * @return True if called from a job on the arbiter thread
+   */
+  bool modem_arbiter_is_owner(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,287 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <errno.h>
+
+#include "modem_power.h"
+#include "battery.h"
+#include "modem_arbiter.h"
+#include "utilities.h"
+
+// Weight of the newest gap in the learned interval between uses, as a shift (1/4)
+#define GAP_EWMA_SHIFT          2
+// How often the idle policy reconsiders stepping down while the modem is in standby
+#define POLICY_INTERVAL_MS      60000LL
+// Use promised to the idle policy after a pre-warm, covers the sensor reads and the outbox event delay
+#define PREWARM_USE_HINT_MS     30000LL
+
+static Network* network;
+
+static K_MUTEX_DEFINE(power_lock);
+static ModemPowerState state = ModemPowerState::OFF;
+static uint8_t users;
+static int64_t last_acquire_time;
+static int64_t last_release_time;
+// Learned time between acquires, starts out at the configured guess
+static int64_t expected_gap_ms = CONFIG_HUB_MODEM_EXPECTED_GAP_S * 1000LL;
+// Absolute uptime of the next known use from modem_power_expect_use, 0 if none
+static int64_t hinted_use_time;
+
+static struct k_work_delayable policy_work;
+static struct modem_job_t policy_job;
+static struct modem_job_t wake_job;
+static int64_t wake_use_in_ms;
+
+#ifdef CONFIG_HUB_MODEM_PREWARM
+static struct modem_job_t prewarm_job;
+static int64_t prewarm_ready_time;
+// Set when the request the pre-warm was for fell through
+static bool prewarm_aborted;
+// The pre-warm found the modem below sleep, so it is what woke it
+static bool prewarm_woke;
+#endif
+
+static const char* state_name(ModemPowerState s) {
+  switch (s) {
+  case ModemPowerState::OFF: return "off";
+  case ModemPowerState::AIRPLANE: return "airplane";
+  case ModemPowerState::SLEEP: return "sleep";
+  default: return "active";
+  }
+}
+
+/*
+ * The modem can also be powered on or off behind our back, e.g. by the diagnostic
+ * or a power down URC. Must be called with power_lock held.
+ */
+static void sync_state(void) {
+  bool powered = network->is_powered_on_cached();
+  if (state != ModemPowerState::OFF && !powered) {
+    printk("Modem lost power while %s\n", state_name(state));
+    state = ModemPowerState::OFF;
+  } else if (state == ModemPowerState::OFF && powered) {
+    state = ModemPowerState::ACTIVE;
+  }
+}
+
+/*
+ * Picks the standby state to be in given how long until the modem is expected
+ * to be needed. Thresholds shrink with the battery so a low battery powers off sooner.
+ */
+static ModemPowerState choose_state(void) {
+  uint8_t percent = last_batt_reading.percent;
+  if (percent < CONFIG_HUB_MODEM_STANDBY_MIN_BATTERY) return ModemPowerState::OFF;
+
+  int64_t now = k_uptime_get();
+  int64_t idle = now - last_release_time;
+  // Once overdue, assume the next use is at least as far away as it's been idle
+  int64_t until_use = expected_gap_ms > idle ? expected_gap_ms - idle : idle;
+  if (hinted_use_time > now) until_use = MIN(until_use, hinted_use_time - now);
+
+  // Scale the limits by percent / 100, s * 1000 * percent / 100 = s * 10 * percent ms
+  if (until_use < CONFIG_HUB_MODEM_SLEEP_MAX_S * 10LL * percent) return ModemPowerState::SLEEP;
+  if (until_use < CONFIG_HUB_MODEM_AIRPLANE_MAX_S * 10LL * percent) return ModemPowerState::AIRPLANE;
+  return ModemPowerState::OFF;
+}
+
+/*
+ * Steps the modem down to target. Must be called with power_lock held.
+ */
+static void enter_state(ModemPowerState target) {
+  if (target == state) return;
+  printk("Modem %s -> %s\n", state_name(state), state_name(target));
+  switch (target) {
+  case ModemPowerState::SLEEP:
+    if (!network->set_edrx(true) || !network->set_slow_clock(true)) target = ModemPowerState::ACTIVE;
+    break;
+  case ModemPowerState::AIRPLANE:
+    // AT+CFUN=4 would only wake it up otherwise
+    if (state == ModemPowerState::SLEEP) network->set_slow_clock(false);
+    if (!network->set_fun_mode(false)) {
+      network->set_power(false);
+      target = ModemPowerState::OFF;
+    }
+    break;
+  case ModemPowerState::OFF:
+    network->set_power(false);
+    break;
+  default:
+    break;
+  }
+  state = target;
+}
+
+static int policy_job_fn(void* user_data) {
+  k_mutex_lock(&power_lock, K_FOREVER);
+  if (users > 0) {
+    k_mutex_unlock(&power_lock);
+    return -EBUSY;
+  }
+  // Jobs still waiting probably need the modem, each one runs the policy again when it releases it
+  if (modem_arbiter_pending()) {
+    k_work_schedule(&policy_work, K_MSEC(POLICY_INTERVAL_MS));
+    k_mutex_unlock(&power_lock);
+    return -EAGAIN;
+  }
+  sync_state();
+  // Only ever step down here, waking up is left to modem_power_acquire
+  ModemPowerState target = MIN(state, choose_state());
+  enter_state(target);
+  if (state != ModemPowerState::OFF) {
+    k_work_schedule(&policy_work, K_MSEC(POLICY_INTERVAL_MS));
+  }
+  k_mutex_unlock(&power_lock);
+  return 0;
+}
+
+static void policy_work_handler(struct k_work* work_item) {
+  // Stepping down sends AT commands, wait for whatever job is using the modem
+  modem_arbiter_submit(&policy_job);
+}
+
+void modem_power_init(Network* net) {
+  network = net;
+  k_work_init_delayable(&policy_work, policy_work_handler);
+  modem_job_init(&policy_job, "power policy", ModemJobPriority::BACKGROUND, policy_job_fn, NULL);
+}
+
+/*
+ * A pre-warm and the request it is for are one use, only the request counts
+ * towards the learned gap
+ */
+static bool acquire(bool need_registration, bool is_use, int64_t timeout) {
+  k_mutex_lock(&power_lock, K_FOREVER);
+  k_work_cancel_delayable(&policy_work);
+  modem_arbiter_cancel(&policy_job);
+  users++;
+
+  int64_t now = k_uptime_get();
+  Deadline deadline(timeout);
+  if (is_use) {
+    if (last_acquire_time) {
+      expected_gap_ms += ((now - last_acquire_time) - expected_gap_ms) >> GAP_EWMA_SHIFT;
+    }
+    last_acquire_time = now;
+  }
+  hinted_use_time = 0;
+
+  sync_state();
+  ModemPowerState from = state;
+  bool ready;
+  switch (state) {
+  case ModemPowerState::OFF:
+    if (need_registration) {
+      ready = network->set_power_on_and_wait_for_reg(deadline.remaining_ms());
+    } else {
+      network->set_power(true);
+      ready = network->wait_for_power_on(deadline.clamp_ms(MODEM_POWER_ON_TIMEOUT_MS));
+    }
+    break;
+  case ModemPowerState::AIRPLANE:
+    // GPS works with the radio off, only leave airplane mode for data
+    ready = !need_registration || (network->set_fun_mode(true) && network->wait_for_reg(deadline.remaining_ms()));
+    break;
+  case ModemPowerState::SLEEP:
+    // Keep it awake while in use, it would doze off between commands otherwise
+    ready = network->set_slow_clock(false) && (!need_registration || network->wait_for_reg(deadline.remaining_ms()));
+    break;
+  default:
+    // Still registered unless coverage was lost, then it re-registers by itself
+    ready = !need_registration || network->wait_for_reg(deadline.remaining_ms());
+    break;
+  }
+
+  if (!ready) {
+    network->set_power(false);
+    state = ModemPowerState::OFF;
+  } else if (need_registration || state != ModemPowerState::AIRPLANE) {
+    state = ModemPowerState::ACTIVE;
+  }
+  printk("Modem acquired from %s in %lldms, %s\n", state_name(from), k_uptime_get() - now,
+    ready ? "ready" : "failed");
+  k_mutex_unlock(&power_lock);
+  return ready;
+}
+
+bool modem_power_acquire(bool need_registration, int64_t timeout) {
+  return acquire(need_registration, true, timeout);
+}
+
+void modem_power_release(void) {
+  k_mutex_lock(&power_lock, K_FOREVER);
+  if (users > 0) users--;
+  last_release_time = k_uptime_get();
+  if (users == 0) k_work_reschedule(&policy_work, K_NO_WAIT);
+  k_mutex_unlock(&power_lock);
+}
+
+void modem_power_idle(void) {
+  last_release_time = k_uptime_get();
+  k_work_reschedule(&policy_work, K_NO_WAIT);
+}
+
+void modem_power_expect_use(int64_t in_ms) {
+  hinted_use_time = k_uptime_get() + in_ms;
+}
+
+static int wake_job_fn(void* user_data) {
+  bool ready = acquire(false, false, MODEM_REG_TIMEOUT_MS);
+  // Keeps it on until the use comes, the policy would step straight back down otherwise
+  modem_power_expect_use(wake_use_in_ms);
+  modem_power_release();
+  return ready ? 0 : -EIO;
+}
+
+void modem_power_wake(int64_t use_in_ms) {
+  if (!wake_job.fn) modem_job_init(&wake_job, "wake", ModemJobPriority::PROVISIONING, wake_job_fn, NULL);
+  if (state != ModemPowerState::OFF && network->is_powered_on_cached()) {
+    modem_power_expect_use(use_in_ms);
+    return;
+  }
+  wake_use_in_ms = use_in_ms;
+  if (modem_arbiter_submit(&wake_job) == 0) printk("Waking the modem\n");
+}
+
+ModemPowerState modem_power_state(void) {
+  return state;
+}
+
+#ifdef CONFIG_HUB_MODEM_PREWARM
+static int prewarm_job_fn(void* user_data) {
+  if (prewarm_aborted) return -ECANCELED;
+  prewarm_woke = state < ModemPowerState::SLEEP;
+  bool ready = acquire(true, false, MODEM_REG_TIMEOUT_MS);
+  if (ready) prewarm_ready_time = k_uptime_get();
+  // Keeps it registered for the flush, unless the sensor went away while registering
+  if (!prewarm_aborted) modem_power_expect_use(PREWARM_USE_HINT_MS);
+  modem_power_release();
+  return ready ? 0 : -ENETUNREACH;
+}
+
+void modem_power_prewarm(void) {
+  prewarm_aborted = false;
+  prewarm_ready_time = 0;
+  if (!prewarm_job.fn) modem_job_init(&prewarm_job, "prewarm", ModemJobPriority::EVENT, prewarm_job_fn, NULL);
+  // Nothing to send without a token, and a low battery powers off right after anyway
+  if (!network->has_token() || last_batt_reading.percent < CONFIG_HUB_MODEM_STANDBY_MIN_BATTERY) return;
+  if (state >= ModemPowerState::SLEEP && network->is_powered_on_cached()) {
+    prewarm_woke = false;
+    prewarm_ready_time = k_uptime_get();
+    return;
+  }
+  if (modem_arbiter_submit(&prewarm_job) == 0) printk("Pre-warming the modem\n");
+}
+
+void modem_power_prewarm_abort(void) {
+  prewarm_aborted = true;
+  if (!prewarm_job.fn || modem_arbiter_cancel(&prewarm_job)) return;
+  if (prewarm_job.busy || !prewarm_woke) return;
+  // Already woken for nothing, forget the promised use so the policy can step down right away
+  printk("Pre-warm not needed, modem back to the idle policy\n");
+  hinted_use_time = 0;
+  modem_power_idle();
+}
+
+int64_t modem_power_prewarm_ready_time(void) {
+  return prewarm_ready_time;
+}
+#endif
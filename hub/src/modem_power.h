@@ -0,0 +1,98 @@
+#ifndef HUB_MODEM_POWER_H
+#define HUB_MODEM_POWER_H
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Ordered from lowest power to ready to send, the idle policy only ever steps down
+enum class ModemPowerState : uint8_t {
+  // MOSFET off, ~6s boot plus registration to use
+  OFF,
+  // AT+CFUN=4, radio off but booted, needs registration to use
+  AIRPLANE,
+  // Registered with eDRX paging and AT+CSCLK=2, sleeps while the UART is idle.
+  // Woken with AT, data can be sent right away
+  SLEEP,
+  // Registered and in use
+  ACTIVE,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * @brief Setup pointers needed to control the modem
+   * @param net Pointer to network instance
+   */
+  void modem_power_init(Network* net);
+
+  /**
+   * @brief Blocks until the modem is ready for use, waking it from whatever standby
+   * state it was left in. Every call must be followed by modem_power_release
+   * @param need_registration false if only AT access is needed, e.g. for GPS
+   * @param timeout ms allowed for powering on and registering together
+   * @return True if the modem is ready
+   */
+  bool modem_power_acquire(bool need_registration = true, int64_t timeout = MODEM_REG_TIMEOUT_MS);
+
+  /**
+   * @brief Hands the modem back, once no one else holds it the idle policy picks
+   * a standby state from the expected time until the next use and the battery level
+   */
+  void modem_power_release(void);
+
+  /**
+   * @brief Lets the idle policy run even though nothing was acquired, e.g. when
+   * BLE stops advertising after waking the modem early. Doesn't block
+   */
+  void modem_power_idle(void);
+
+  /**
+   * @brief Tells the idle policy when the modem is known to be needed next,
+   * used instead of the learned request interval if sooner
+   * @param in_ms ms from now
+   */
+  void modem_power_expect_use(int64_t in_ms);
+
+  /**
+   * @brief Powers the modem on in the background as a modem job, without registering,
+   * for a use that probably follows, e.g. a login while BLE advertises. Doesn't block
+   * @param use_in_ms ms from now the use is expected by, see modem_power_expect_use
+   */
+  void modem_power_wake(int64_t use_in_ms);
+
+  /**
+   * @return The state the modem was last put in
+   */
+  ModemPowerState modem_power_state(void);
+
+#ifdef CONFIG_HUB_MODEM_PREWARM
+  /**
+   * @brief Starts powering on and registering the modem in the background because a
+   * request is about to follow, e.g. when a known sensor was just found. Doesn't block
+   */
+  void modem_power_prewarm(void);
+
+  /**
+   * @brief Takes back modem_power_prewarm when the request won't come after all. A pre-warm
+   * still queued is dropped, a modem it already woke is left to the idle policy again
+   */
+  void modem_power_prewarm_abort(void);
+
+  /**
+   * @return Uptime the last pre-warm found the modem ready, 0 if it hasn't yet or failed
+   */
+  int64_t modem_power_prewarm_ready_time(void);
+#else
+  static inline void modem_power_prewarm(void) {}
+  static inline void modem_power_prewarm_abort(void) {}
+  static inline int64_t modem_power_prewarm_ready_time(void) { return 0; }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
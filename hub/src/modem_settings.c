@@ -0,0 +1,88 @@
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/kernel.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "modem_settings.h"
+
+static struct k_work save_work;
+static struct k_work save_hints_work;
+
+modem_settings_t modem_settings;
+modem_reg_hints_t modem_reg_hints;
+
+static int modem_settings_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+  const char* next;
+  int rc;
+  if (settings_name_steq(name, "cfg", &next) && !next) {
+    if (len != sizeof(modem_settings)) {
+      printk("modem/cfg size %d is not compatible with the application len %d\n", sizeof(modem_settings), len);
+      return -EINVAL;
+    }
+    rc = read_cb(cb_arg, &modem_settings, sizeof(modem_settings));
+    if (rc >= 0) {
+      return 0;
+    }
+    return rc;
+  }
+  if (settings_name_steq(name, "reg", &next) && !next) {
+    if (len != sizeof(modem_reg_hints)) {
+      printk("modem/reg size %d is not compatible with the application len %d\n", sizeof(modem_reg_hints), len);
+      return -EINVAL;
+    }
+    rc = read_cb(cb_arg, &modem_reg_hints, sizeof(modem_reg_hints));
+    if (rc >= 0) {
+      return 0;
+    }
+    return rc;
+  }
+  return -ENOENT;
+}
+
+static struct settings_handler modem_conf = {
+    .name = "modem",
+    .h_set = modem_settings_set,
+};
+
+static void save_modem_settings_work(struct k_work* work_item) {
+  int ret = settings_save_one("modem/cfg", &modem_settings, sizeof(modem_settings));
+  printk("Saved modem/cfg baud %u, flow control %u in NVS, status=%d\n",
+    modem_settings.baud, modem_settings.flow_control, ret);
+}
+
+void modem_settings_save(void) {
+  k_work_submit(&save_work);
+}
+
+static void save_reg_hints_work(struct k_work* work_item) {
+  int ret = settings_save_one("modem/reg", &modem_reg_hints, sizeof(modem_reg_hints));
+  printk("Saved modem/reg operator %s, act %u, band %u in NVS, status=%d\n",
+    modem_reg_hints.oper, modem_reg_hints.act, modem_reg_hints.band, ret);
+}
+
+void modem_reg_hints_save(void) {
+  k_work_submit(&save_hints_work);
+}
+
+void modem_settings_init(void) {
+  memset(&modem_settings, 0, sizeof(modem_settings));
+  memset(&modem_reg_hints, 0, sizeof(modem_reg_hints));
+  k_work_init(&save_work, save_modem_settings_work);
+  k_work_init(&save_hints_work, save_reg_hints_work);
+  if (IS_ENABLED(CONFIG_SETTINGS)) {
+    settings_subsys_init();
+    settings_register(&modem_conf);
+    settings_load_subtree("modem");
+    if (modem_settings.baud) {
+      printk("\tSaved modem baud: %u, flow control: %u\n", modem_settings.baud, modem_settings.flow_control);
+    } else printk("\tNo saved modem baud\n");
+    if (modem_reg_hints.oper[0]) {
+      printk("\tLast registered on operator %s, act %u, band %u, cell %u\n", modem_reg_hints.oper,
+        modem_reg_hints.act, modem_reg_hints.band, modem_reg_hints.cell_id);
+    }
+  } else {
+    printk("\tCONFIG_SETTINGS not enabled\n");
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef MODEM_SETTINGS_H
+#define MODEM_SETTINGS_H
+
+#include <zephyr/kernel.h>
+
+typedef struct {
+  // Baud rate last agreed with the SIM7000, 0 if never negotiated
+  uint32_t baud;
+  // If RTS/CTS was enabled on the SIM7000 with AT+IFC
+  bool flow_control;
+} modem_settings_t;
+
+/**
+ * Where the modem last registered, applied before the next attach so it doesn't
+ * have to scan every operator and RAT. Saved separately from modem_settings_t so
+ * either can change without invalidating the other
+ */
+typedef struct {
+  // Numeric operator, e.g. "310260", empty until the first registration
+  char oper[7];
+  // AT+COPS access technology, 0 GSM, 7 LTE CAT-M, 9 LTE NB-IoT
+  uint8_t act;
+  // LTE band of the serving cell, 0 for GSM
+  uint8_t band;
+  // Tracking (LTE) or location (GSM) area code and id of the serving cell
+  uint16_t area;
+  uint32_t cell_id;
+} modem_reg_hints_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * Modem parameters that need to survive a reboot
+  **/
+  extern modem_settings_t modem_settings;
+
+  /**
+   * @brief Initializes settings and loads the modem subtree into modem_settings
+   * Needs to happen before the SIM module is powered so the saved baud rate can be applied
+   */
+  void modem_settings_init(void);
+
+  // Saves modem_settings to NVS from the system work queue
+  void modem_settings_save(void);
+
+  /**
+   * Where the modem last registered, see modem_reg_hints_t
+  **/
+  extern modem_reg_hints_t modem_reg_hints;
+
+  // Saves modem_reg_hints to NVS from the system work queue
+  void modem_reg_hints_save(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
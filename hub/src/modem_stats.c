@@ -0,0 +1,106 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/byteorder.h>
+#include <sys/errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "modem_stats.h"
+
+/* Upper bounds of every bucket but the last, covers a fast reused session up to the 40s AT timeouts */
+static const uint16_t BUCKET_MS[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 20000, 40000 };
+#define BUCKETS           (ARRAY_SIZE(BUCKET_MS) + 1)
+
+static const char* const CLASS_NAMES[] = { "power on", "registration", "pdp", "tls", "server", "read", "queue wait" };
+BUILD_ASSERT(ARRAY_SIZE(CLASS_NAMES) == MODEM_STAT_COUNT);
+
+struct stat_histogram_t {
+  uint16_t ok;
+  uint16_t failed;
+  uint32_t max_ms;
+  uint16_t counts[BUCKETS];
+};
+
+static struct stat_histogram_t histograms[MODEM_STAT_COUNT];
+static struct k_spinlock stats_lock;
+
+static void inc_saturating(uint16_t* counter) {
+  if (*counter < UINT16_MAX) (*counter)++;
+}
+
+void modem_stats_record(enum modem_stat_class cls, int64_t ms, bool success) {
+  if (cls >= MODEM_STAT_COUNT) return;
+  uint32_t value = (uint32_t)CLAMP(ms, 0, UINT32_MAX);
+  size_t bucket = 0;
+  while (bucket < ARRAY_SIZE(BUCKET_MS) && value > BUCKET_MS[bucket]) bucket++;
+
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  struct stat_histogram_t* histogram = &histograms[cls];
+  inc_saturating(success ? &histogram->ok : &histogram->failed);
+  inc_saturating(&histogram->counts[bucket]);
+  histogram->max_ms = MAX(histogram->max_ms, value);
+  k_spin_unlock(&stats_lock, key);
+}
+
+/*
+ * Copies the histograms so they can be written out without holding the lock
+ */
+static void snapshot(struct stat_histogram_t* out) {
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  memcpy(out, histograms, sizeof(histograms));
+  k_spin_unlock(&stats_lock, key);
+}
+
+size_t modem_stats_encode(uint8_t* buf, size_t size) {
+  size_t needed = 3 + 2 * ARRAY_SIZE(BUCKET_MS) + MODEM_STAT_COUNT * (8 + 2 * BUCKETS);
+  if (size < needed) return 0;
+  struct stat_histogram_t copy[MODEM_STAT_COUNT];
+  snapshot(copy);
+
+  uint8_t* p = buf;
+  *p++ = MODEM_STATS_VERSION;
+  *p++ = MODEM_STAT_COUNT;
+  *p++ = BUCKETS;
+  for (size_t i = 0; i < ARRAY_SIZE(BUCKET_MS); i++, p += 2) sys_put_le16(BUCKET_MS[i], p);
+  for (size_t cls = 0; cls < MODEM_STAT_COUNT; cls++) {
+    sys_put_le16(copy[cls].ok, p);
+    sys_put_le16(copy[cls].failed, p + 2);
+    sys_put_le32(copy[cls].max_ms, p + 4);
+    p += 8;
+    for (size_t i = 0; i < BUCKETS; i++, p += 2) sys_put_le16(copy[cls].counts[i], p);
+  }
+  return p - buf;
+}
+
+int modem_stats_format(char* buf, size_t size) {
+  struct stat_histogram_t copy[MODEM_STAT_COUNT];
+  snapshot(copy);
+
+  size_t len = 0;
+  for (size_t cls = 0; cls < MODEM_STAT_COUNT; cls++) {
+    int n = snprintf(buf + len, size - len, "%s%u/%u/%u ", cls ? ";" : "",
+      copy[cls].ok, copy[cls].failed, copy[cls].max_ms);
+    if (n < 0 || (size_t)n >= size - len) return -ENOMEM;
+    len += n;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      n = snprintf(buf + len, size - len, i ? ",%u" : "%u", copy[cls].counts[i]);
+      if (n < 0 || (size_t)n >= size - len) return -ENOMEM;
+      len += n;
+    }
+  }
+  return len;
+}
+
+void modem_stats_print(void) {
+  struct stat_histogram_t copy[MODEM_STAT_COUNT];
+  snapshot(copy);
+
+  printk("Modem latency, bucket bounds");
+  for (size_t i = 0; i < ARRAY_SIZE(BUCKET_MS); i++) printk(" %u", BUCKET_MS[i]);
+  printk("ms\n");
+  for (size_t cls = 0; cls < MODEM_STAT_COUNT; cls++) {
+    printk("\t%s: ok %u, failed %u, max %ums:", CLASS_NAMES[cls], copy[cls].ok, copy[cls].failed, copy[cls].max_ms);
+    for (size_t i = 0; i < BUCKETS; i++) printk(" %u", copy[cls].counts[i]);
+    printk("\n");
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef MODEM_STATS_H
+#define MODEM_STATS_H
+
+#include <zephyr/kernel.h>
+
+/*
+ * Latency histograms of the slow parts of a request, counted since boot.
+ * modem_stats_encode packs them for the hub_svc stats characteristic as, little endian:
+ *   [version:1][classes:1][buckets:1][bucket upper bounds in ms:2 each, buckets - 1 of them]
+ *   then per class in enum order [ok:2][failed:2][max_ms:4][count:2 per bucket]
+ * The last bucket has no upper bound. Counters saturate instead of wrapping.
+ */
+#define MODEM_STATS_VERSION   1
+// Longest text modem_stats_format can write, with every counter saturated, plus the terminator
+#define MODEM_STATS_FORMAT_MAX  640
+
+enum modem_stat_class {
+  // set_power(true) until the modem reported being ready
+  MODEM_STAT_POWER_ON,
+  // Until +CREG reported registration
+  MODEM_STAT_REGISTRATION,
+  // AT+CNACT, PDP context activation
+  MODEM_STAT_PDP,
+  // AT+SHCONN, TCP connect and TLS handshake
+  MODEM_STAT_TLS,
+  // AT+SHREQ until +SHREQ, waiting on the server
+  MODEM_STAT_SERVER,
+  // AT+SHREAD, reading the response
+  MODEM_STAT_READ,
+  // Time a job waited for the modem arbiter, failed if it was dropped for waiting too long
+  MODEM_STAT_QUEUE_WAIT,
+  MODEM_STAT_COUNT,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_HUB_MODEM_STATS
+  /**
+   * @brief Counts one timing of cls
+   * @param ms Time it took, or was given before failing
+   * @param success False if it failed or timed out
+   */
+  void modem_stats_record(enum modem_stat_class cls, int64_t ms, bool success);
+
+  /**
+   * @brief Packs the histograms as described above
+   * @return Bytes written, 0 if buf is too small
+   */
+  size_t modem_stats_encode(uint8_t* buf, size_t size);
+
+  /**
+   * @brief Writes the histograms as text for uploading, one class per ;-separated
+   * group of ok/failed/max then the bucket counts, e.g. "12/0/6310 0,0,0,1,9,2,0,0,0,0;..."
+   * @return Length written, -ENOMEM if buf is too small
+   */
+  int modem_stats_format(char* buf, size_t size);
+
+  /**
+   * @brief Prints the histograms to the console
+   */
+  void modem_stats_print(void);
+#else
+  static inline void modem_stats_record(enum modem_stat_class cls, int64_t ms, bool success) {}
+  static inline size_t modem_stats_encode(uint8_t* buf, size_t size) { return 0; }
+  static inline int modem_stats_format(char* buf, size_t size) { return -ENOTSUP; }
+  static inline void modem_stats_print(void) {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/kernel.h>
+#include <sys/errno.h>
+#include <string.h>
+
+#include "modem_trace.h"
+
+// Bytes printed per console line by modem_trace_dump
+#define DUMP_LINE_BYTES   32
+
+/* records stored as a byte ring, a record may wrap around the end */
+static uint8_t trace_ring[CONFIG_HUB_MODEM_TRACE_SIZE];
+static uint16_t trace_head;
+static uint16_t trace_tail;
+static uint16_t trace_used;
+// Bytes ever recorded, trace_head is always this modulo the ring size
+static uint64_t trace_written;
+static struct k_spinlock trace_lock;
+
+#ifdef CONFIG_HUB_MODEM_TRACE_PERSIST
+/* newest records copied out by modem_trace_persist, written to NVS from the work queue */
+static uint8_t persist_buf[CONFIG_HUB_MODEM_TRACE_PERSIST_SIZE];
+static size_t persist_len;
+static struct k_work persist_work;
+// Uptime of the last save, 0 if nothing was saved since boot
+static int64_t last_persist_time;
+#endif
+
+static uint8_t trace_peek(uint16_t offset) {
+  return trace_ring[(trace_tail + offset) % sizeof(trace_ring)];
+}
+
+static void trace_put(const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    trace_ring[trace_head] = data[i];
+    trace_head = (trace_head + 1) % sizeof(trace_ring);
+  }
+  trace_used += len;
+  trace_written += len;
+}
+
+static void trace_drop_oldest(void) {
+  uint16_t record_len = MODEM_TRACE_HEADER_SIZE + trace_peek(MODEM_TRACE_HEADER_SIZE - 1);
+  trace_tail = (trace_tail + record_len) % sizeof(trace_ring);
+  trace_used -= record_len;
+}
+
+/*
+ * Finds the value of an AT+SHAHEAD header or the body of AT+SHBOD, sent or echoed
+ * back, as data[*start, *end). They carry the access token and the uploads.
+ * @return False if data has nothing to hide
+ */
+static bool find_secret(const uint8_t* data, size_t len, size_t* start, size_t* end) {
+  static const char SHAHEAD[] = "AT+SHAHEAD=";
+  static const char SHBOD[] = "AT+SHBOD=";
+  if (len > sizeof(SHAHEAD) - 1 && memcmp(data, SHAHEAD, sizeof(SHAHEAD) - 1) == 0) {
+    // AT+SHAHEAD="authorization","Bearer ...", the header name stays
+    const uint8_t* comma = memchr(data, ',', len);
+    if (!comma) return false;
+    *start = comma + 1 - data;
+    *end = len;
+    while (*end > *start && (data[*end - 1] == '\r' || data[*end - 1] == '\n')) (*end)--;
+    return true;
+  }
+  if (len > sizeof(SHBOD) - 1 && memcmp(data, SHBOD, sizeof(SHBOD) - 1) == 0) {
+    // AT+SHBOD="{...}",73, the length stays
+    *start = sizeof(SHBOD) - 1;
+    *end = len;
+    while (*end > *start && data[*end - 1] != ',') (*end)--;
+    *end = *end > *start ? *end - 1 : len;
+    return true;
+  }
+  return false;
+}
+
+void modem_trace_record(uint8_t type, const void* data, size_t len) {
+  static const char REDACTED[] = "\"<redacted>\"";
+  const uint8_t* bytes = data;
+  size_t start = len;
+  size_t end = len;
+  bool redact = type != MODEM_TRACE_BULK && find_secret(bytes, len, &start, &end);
+  // Recorded as the part before the secret, the marker and the part after it
+  const uint8_t* parts[] = { bytes, (const uint8_t*)REDACTED, bytes + end };
+  size_t parts_len[] = { start, redact ? sizeof(REDACTED) - 1 : 0, len - end };
+  size_t total = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(parts); i++) {
+    parts_len[i] = MIN(parts_len[i], UINT8_MAX - total);
+    total += parts_len[i];
+  }
+
+  uint8_t header[MODEM_TRACE_HEADER_SIZE];
+  sys_put_le32((uint32_t)k_ticks_to_us_floor64(k_uptime_ticks()), header);
+  header[4] = type;
+  header[5] = total;
+
+  k_spinlock_key_t key = k_spin_lock(&trace_lock);
+  while (trace_used + sizeof(header) + total > sizeof(trace_ring)) {
+    trace_drop_oldest();
+  }
+  trace_put(header, sizeof(header));
+  for (size_t i = 0; i < ARRAY_SIZE(parts); i++) {
+    trace_put(parts[i], parts_len[i]);
+  }
+  k_spin_unlock(&trace_lock, key);
+}
+
+static void trace_print_line(const uint8_t* data, size_t len) {
+  printk("MTRACE ");
+  for (size_t i = 0; i < len; i++) {
+    printk("%02x", data[i]);
+  }
+  printk("\n");
+}
+
+void modem_trace_dump(void) {
+  uint8_t line[DUMP_LINE_BYTES];
+  // Only the records there now, the modem traffic caused by printing over USB comes after them
+  k_spinlock_key_t key = k_spin_lock(&trace_lock);
+  uint64_t pos = trace_written - trace_used;
+  uint64_t end = trace_written;
+  k_spin_unlock(&trace_lock, key);
+
+  printk("MTRACE BEGIN ram %u\n", (uint32_t)(end - pos));
+  while (pos < end) {
+    size_t len = MIN(end - pos, sizeof(line));
+    key = k_spin_lock(&trace_lock);
+    // Dropped to make room while printing, the rest can't be trusted
+    bool overwritten = pos < trace_written - trace_used;
+    for (size_t i = 0; i < len && !overwritten; i++) {
+      line[i] = trace_ring[(pos + i) % sizeof(trace_ring)];
+    }
+    k_spin_unlock(&trace_lock, key);
+    if (overwritten) {
+      printk("Modem trace overwritten while dumping, cut short\n");
+      break;
+    }
+    trace_print_line(line, len);
+    pos += len;
+  }
+  printk("MTRACE END ram\n");
+}
+
+#ifdef CONFIG_HUB_MODEM_TRACE_PERSIST
+/*
+ * Copies the newest whole records that fit into out_buf, oldest first
+ * @return The number of bytes copied
+ */
+static size_t trace_copy_newest(uint8_t* out_buf, size_t out_size) {
+  k_spinlock_key_t key = k_spin_lock(&trace_lock);
+  uint16_t offset = 0;
+  while (trace_used - offset > out_size) {
+    offset += MODEM_TRACE_HEADER_SIZE + trace_peek(offset + MODEM_TRACE_HEADER_SIZE - 1);
+  }
+  size_t len = trace_used - offset;
+  for (size_t i = 0; i < len; i++) {
+    out_buf[i] = trace_peek(offset + i);
+  }
+  k_spin_unlock(&trace_lock, key);
+  return len;
+}
+
+static void trace_print(const char* name, const uint8_t* data, size_t len) {
+  printk("MTRACE BEGIN %s %u\n", name, len);
+  for (size_t i = 0; i < len; i += DUMP_LINE_BYTES) {
+    trace_print_line(data + i, MIN(len - i, DUMP_LINE_BYTES));
+  }
+  printk("MTRACE END %s\n", name);
+}
+
+static int modem_trace_settings_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+  const char* next;
+  if (settings_name_steq(name, "last", &next) && !next) {
+    int rc = read_cb(cb_arg, persist_buf, MIN(len, sizeof(persist_buf)));
+    if (rc < 0) {
+      return rc;
+    }
+    persist_len = rc;
+    return 0;
+  }
+  return -ENOENT;
+}
+
+static struct settings_handler modem_trace_conf = {
+    .name = "mtrace",
+    .h_set = modem_trace_settings_set,
+};
+
+static void save_modem_trace_work(struct k_work* work_item) {
+  int ret = settings_save_one("mtrace/last", persist_buf, persist_len);
+  printk("Saved mtrace/last of size %d in NVS, status=%d\n", persist_len, ret);
+}
+#endif
+
+void modem_trace_persist(void) {
+#ifdef CONFIG_HUB_MODEM_TRACE_PERSIST
+  // A save still in progress keeps the trace it already copied
+  if (k_work_busy_get(&persist_work)) return;
+  int64_t now = k_uptime_get();
+  if (last_persist_time && now - last_persist_time < CONFIG_HUB_MODEM_TRACE_PERSIST_INTERVAL_MIN * 60 * 1000LL) {
+    return;
+  }
+  last_persist_time = now;
+  persist_len = trace_copy_newest(persist_buf, sizeof(persist_buf));
+  k_work_submit(&persist_work);
+#endif
+}
+
+void modem_trace_init(void) {
+#ifdef CONFIG_HUB_MODEM_TRACE_PERSIST
+  k_work_init(&persist_work, save_modem_trace_work);
+  settings_register(&modem_trace_conf);
+  settings_load_subtree("mtrace");
+  if (persist_len) {
+    printk("\tTrace of the last failed AT script:\n");
+    trace_print("nvs", persist_buf, persist_len);
+  }
+#endif
+}
@@ -0,0 +1,60 @@
+#ifndef MODEM_TRACE_H
+#define MODEM_TRACE_H
+
+#include <zephyr/kernel.h>
+
+/*
+ * Trace records are stored back to back as [time_us:4][type:1][len:1][data:len],
+ * little endian. time_us is the low 32 bits of the uptime in microseconds.
+ */
+#define MODEM_TRACE_HEADER_SIZE   6
+// AT command queued for the SIM7000
+#define MODEM_TRACE_TX            'T'
+// Line received from the SIM7000
+#define MODEM_TRACE_RX            'R'
+// Chunk of a length-delimited payload, see serial_bulk_arm
+#define MODEM_TRACE_BULK          'B'
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_HUB_MODEM_TRACE
+  /**
+   * @brief Loads the trace persisted by the last failed AT script and prints it
+   * Needs settings to be initialized first
+   */
+  void modem_trace_init(void);
+
+  /**
+   * @brief Appends a record, dropping the oldest records if the ring is full. Header
+   * values of AT+SHAHEAD and the body of AT+SHBOD are recorded as "<redacted>"
+   * @param type one of MODEM_TRACE_TX, MODEM_TRACE_RX or MODEM_TRACE_BULK
+   * @param data the bytes to record, truncated to 255
+   * @param len number of bytes in data
+   */
+  void modem_trace_record(uint8_t type, const void* data, size_t len);
+
+  /**
+   * @brief Prints the whole RAM trace to the console as hex, see hub/tools/modem_trace.py
+   */
+  void modem_trace_dump(void);
+
+  /**
+   * @brief Saves the newest records to NVS from the system work queue so they
+   * survive a reboot. Does nothing unless CONFIG_HUB_MODEM_TRACE_PERSIST is set, or
+   * if the last save was less than CONFIG_HUB_MODEM_TRACE_PERSIST_INTERVAL_MIN ago
+   */
+  void modem_trace_persist(void);
+#else
+  static inline void modem_trace_init(void) {}
+  static inline void modem_trace_record(uint8_t type, const void* data, size_t len) {}
+  static inline void modem_trace_dump(void) {}
+  static inline void modem_trace_persist(void) {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,26 +2,76 @@
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/sys/printk.h>
-#include <cJSON.h>
+#include <zephyr/sys/timeutil.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "network.h"
+#include "json_path.h"
 #include "token_settings.h"
+#include "modem_settings.h"
+#include "modem_trace.h"
+#include "modem_stats.h"
+#include "modem_power.h"
 #include "utilities.h"
 #include "serial.h"
 #include "ble.h"
+#include "diagnostic.h"
+#include "rat_select.h"
+#include "known_sensors.h"
 #include "conf.cpp"
 
 #define MAX_NETWORK_ATTEMPTS    1
 
-uint8_t AT_CNACT_IDX = 0;
-uint8_t AT_SNI_IDX = 4;
-uint8_t AT_SHREQ_IDX = 18;
+// Rates tried by configure_modem, fastest first. 115200 is what the SIM7000 ships with
+static const uint32_t NEGOTIATED_BAUD_RATES[] = { 921600, 460800, 230400, 115200 };
+// Rates tried when the modem doesn't answer at the saved rate, SIM7000 autobaud syncs on "AT"
+static const uint32_t DETECT_BAUD_RATES[] = { 921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600 };
+// uart1 rate from the devicetree, used until a rate was agreed with the modem
+#define MODEM_DEFAULT_BAUD      DT_PROP(DT_NODELABEL(uart1), current_speed)
+
+// Shared between the AT+SHREQ and AT+SHREAD steps of a request
+struct request_ctx_t {
+  uint16_t response_len;
+};
+
+// Feeds the timing of a step into the mode selection, if it ran
+static void record_step(RatPhase phase, const AtStepResult& result) {
+  if (result.attempts) rat_select_record(phase, result.duration_ms, result.success);
+}
+
+// Counts the timing of a step in its latency histogram, if it ran
+static void record_latency(enum modem_stat_class cls, const AtStepResult& result) {
+  if (result.attempts) modem_stats_record(cls, result.duration_ms, result.success);
+}
 
+/*
+ * AT+COPS with an act outside of the AT+CNMP mode is rejected, e.g. GSM hints
+ * after the mode selection moved to LTE only
+ */
+static bool mode_allows_act(PreferredMode mode, uint8_t act) {
+  if (mode == PreferredMode::GSM) return act == 0;
+  if (mode == PreferredMode::LTE) return act != 0;
+  return true;
+}
 
 static const struct gpio_dt_spec mosfet_sim = GPIO_DT_SPEC_GET(DT_NODELABEL(mosfet_sim), gpios);
 static const struct device* uart1 = DEVICE_DT_GET(DT_NODELABEL(uart1));
 
+// +SHREQ: "POST",200,593
+static bool parse_shreq(const char* line, void* ctx) {
+  const char* len_str = strrchr(line, ',');
+  if (!len_str) return false;
+  ((request_ctx_t*)ctx)->response_len = strtoul(len_str + 1, NULL, 10);
+  return true;
+}
+
+// AT+SHREAD=0,593
+static void build_shread(char* out, size_t out_size, void* ctx) {
+  snprintk(out, out_size, "AT+SHREAD=0,%u\r", ((request_ctx_t*)ctx)->response_len);
+}
+
 int Network::init(void) {
   if (!device_is_ready(uart1)) {
     printk("UART device not ready\n");
@@ -33,17 +83,72 @@ int Network::init(void) {
   }
 
   if (gpio_pin_configure_dt(&mosfet_sim, GPIO_OUTPUT_INACTIVE) == 0) printk("\tMOSFET_SIM pin online\n");
+  k_event_init(&events);
+  k_mutex_init(&session_lock);
+  session_idle_work.network = this;
+  k_work_init_delayable(&session_idle_work.work, session_idle_work_handler);
+  modem_job_init(&session_idle_job, "session idle", ModemJobPriority::BACKGROUND, session_idle_job_fn, this);
+  serial_urc_register("+CREG: ", on_creg_urc, this);
+  serial_urc_register("SMS Ready", on_power_urc, this);
+  serial_urc_register("NORMAL POWER DOWN", on_power_urc, this);
+  serial_urc_register("UNDER-VOLTAGE POWER DOWN", on_power_urc, this);
+  serial_urc_register("+APP PDP", on_pdp_urc, this);
+  serial_urc_register("+SHSTATE: ", on_shstate_urc, this);
   serial_init();
+
+  // The modem keeps its rate across power cycles, start out at the last agreed one
+  modem_settings_init();
+  modem_trace_init();
+  rat_select_init();
+  if (modem_settings.baud) {
+    serial_set_baudrate(modem_settings.baud, modem_settings.flow_control);
+  }
   return 0;
 }
 
-int Network::unescaped_len(char* str) {
-  int count = 0;
-  for (int idx = 0; idx < (int)strlen(str); idx++) {
-    if (str[idx] == '\\') idx++;
-    count++;
+void Network::on_creg_urc(const char* line, void* user_data) {
+  Network* self = (Network*)user_data;
+  // Solicited: "+CREG: <n>,<stat>[,...]", unsolicited: "+CREG: <stat>[,"<lac>",...]"
+  const char* params = line + strlen("+CREG: ");
+  char* end;
+  int8_t status = strtol(params, &end, 10);
+  if (end[0] == ',' && end[1] >= '0' && end[1] <= '9') {
+    status = strtol(end + 1, NULL, 10);
+  }
+  self->update_reg_status(status);
+}
+
+void Network::on_power_urc(const char* line, void* user_data) {
+  Network* self = (Network*)user_data;
+  if (strncmp(line, "SMS Ready", 9) == 0) {
+    k_event_post(&self->events, NETWORK_EVT_POWERED_ON);
+    return;
+  }
+  printk("Modem reported power down: %s\n", line);
+  k_event_clear(&self->events, NETWORK_EVT_POWERED_ON | NETWORK_EVT_REGISTERED |
+    NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
+  self->last_status = -1;
+}
+
+void Network::on_pdp_urc(const char* line, void* user_data) {
+  Network* self = (Network*)user_data;
+  // "+APP PDP:ACTIVE" or "+APP PDP: DEACTIVE"
+  if (strstr(line, "DEACTIVE")) {
+    printk("PDP context deactivated\n");
+    k_event_clear(&self->events, NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
+  } else {
+    k_event_post(&self->events, NETWORK_EVT_PDP_ACTIVE);
+  }
+}
+
+void Network::on_shstate_urc(const char* line, void* user_data) {
+  Network* self = (Network*)user_data;
+  // "+SHSTATE: 1" connected, "+SHSTATE: 0" disconnected
+  if (line[strlen("+SHSTATE: ")] == '1') {
+    k_event_post(&self->events, NETWORK_EVT_HTTP_CONNECTED);
+  } else {
+    k_event_clear(&self->events, NETWORK_EVT_HTTP_CONNECTED);
   }
-  return count;
 }
 
 int Network::initialize_access_token(void) {
@@ -52,28 +157,16 @@ int Network::initialize_access_token(void) {
 
 void Network::set_access_token(const char new_access_token[100]) {
   save_token(new_access_token);
+  // The open session still carries the old authorization header
+  session_headers_set = false;
 }
 
 bool Network::has_token() {
   return token_data.is_valid;
 }
 
-cJSON* Network::send_request(char* query, char* out_result_msg) {
-  Utilities::write_rgb(0, 0, 60);
-  // leave off line break to catch mistakes
-  printk("Sending request:\n%s\nOf size: %d\n", query, strlen(query));
-
-  serial_purge();
-  size_t command_size = 55 + strlen(token_data.access_token);
-  char auth_command[command_size]{};
-  if (token_data.is_valid) {
-    snprintk(auth_command, command_size,
-      "AT+SHAHEAD=\"authorization\",\"Bearer %s\"\r", token_data.access_token);
-  } else {
-    strcpy(auth_command, "AT+SHAHEAD=\"authorization\",\"\"\r");
-  }
-
-  command_size = 25 + strlen(API_URL);
+bool Network::open_session(void) {
+  size_t command_size = 25 + strlen(API_URL);
   char sni_command[command_size]{};
   snprintk(sni_command, command_size, "AT+CSSLCFG=\"sni\",1,\"%s\"\r", API_URL);
 
@@ -81,145 +174,253 @@ cJSON* Network::send_request(char* query, char* out_result_msg) {
   char url_command[command_size]{};
   snprintk(url_command, command_size, "AT+SHCONF=\"URL\",\"https://%s\"\r", API_URL);
 
-  command_size = 18 + strlen(query);
-  char body_command[command_size]{};
-  snprintk(body_command, command_size, "AT+SHBOD=\"%s\",%d\r", query, unescaped_len(query));
-
-  const char* const commands[] = {
-    "AT+CNACT=1,\"hologram\"\r",
-    "AT+CNACT?\r",
-    "AT+CSSLCFG=\"sslversion\",1,3\r",
-    "AT+CSSLCFG=\"ignorertctime\",1,1\r",
-    sni_command,
-    "AT+SHSSL=1,\"\"\r",
-    "AT+SHCONF=\"BODYLEN\",1024\r",
-    "AT+SHCONF=\"HEADERLEN\",350\r",
-    url_command,
-    "AT+SHCONN\r",
-    "AT+SHCHEAD\r",
-    "AT+SHAHEAD=\"User-Agent\",\"curl/7.47.0\"\r",
-    "AT+SHAHEAD=\"Cache-control\",\"no-cache\"\r",
-    "AT+SHAHEAD=\"Connection\",\"keep-alive\"\r",
-    "AT+SHAHEAD=\"Content-type\",\"application/json\"\r",
-    "AT+SHAHEAD=\"Accept\",\"*/*\"\r",
-    auth_command,
-    body_command,
-    "AT+SHREQ=\"/\",3\r",
-    "AT+SHDISC\r",
+  // The PDP context outlives the session, only activate it if the modem dropped it
+  bool pdp_active = k_event_wait(&events, NETWORK_EVT_PDP_ACTIVE, false, K_NO_WAIT) != 0;
+  const AtStep steps[] = {
+    // AT+CNACT=1,"hologram"
+    // OK
+    // +APP PDP:ACTIVE
+    { .command = "AT+CNACT=1,\"hologram\"\r", .intermediate = "OK", .expect = "+APP PDP:", .timeout_ms = 40000LL, .retries = 1, .skip = pdp_active },
+    { .command = "AT+CNACT?\r" },
+    { .command = "AT+CSSLCFG=\"sslversion\",1,3\r" },
+    { .command = "AT+CSSLCFG=\"ignorertctime\",1,1\r" },
+    { .command = sni_command, .skip = !USE_SNI },
+    { .command = "AT+SHSSL=1,\"\"\r" },
+    { .command = "AT+SHCONF=\"BODYLEN\",1024\r" },
+    { .command = "AT+SHCONF=\"HEADERLEN\",350\r" },
+    { .command = url_command },
+    { .command = "AT+SHCONN\r", .timeout_ms = 40000LL, .retries = 1 },
+  };
+  AtStepResult results[ARRAY_SIZE(steps)];
+
+  session_headers_set = false;
+  bool success = at.run(steps, ARRAY_SIZE(steps), NULL, results);
+  record_step(RatPhase::PDP, results[0]);
+  record_step(RatPhase::TLS, results[ARRAY_SIZE(steps) - 1]);
+  record_latency(MODEM_STAT_PDP, results[0]);
+  record_latency(MODEM_STAT_TLS, results[ARRAY_SIZE(steps) - 1]);
+  if (!success) {
+    // Don't leave a half open connection behind for the next attempt
+    close_session();
+    return false;
+  }
+  k_event_post(&events, NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
+  return true;
+}
+
+void Network::close_session(void) {
+  const AtStep steps[] = {
+    { .command = "AT+SHDISC\r", .on_fail = AtOnFail::CONTINUE },
   };
+  cancel_session_idle();
+  at.run(steps, ARRAY_SIZE(steps));
+  k_event_clear(&events, NETWORK_EVT_HTTP_CONNECTED);
+  session_headers_set = false;
+}
 
-  uint16_t commands_len = sizeof(commands) / sizeof(*commands);
-  int64_t timeout = 40000LL;
-  cJSON* doc;
+void Network::session_idle_work_handler(struct k_work* work_item) {
+  struct network_work_t* item = CONTAINER_OF(k_work_delayable_from_work(work_item), struct network_work_t, work);
+  // AT+SHDISC needs the modem, wait for whatever job is using it
+  modem_arbiter_submit(&item->network->session_idle_job);
+}
 
-  printk("Commands to iterate through: %u\n", commands_len);
+int Network::session_idle_job_fn(void* user_data) {
+  Network* self = (Network*)user_data;
+  // A request is using the session, it reschedules the timeout when done
+  if (k_mutex_lock(&self->session_lock, K_NO_WAIT) != 0) return -EBUSY;
+  if (k_event_wait(&self->events, NETWORK_EVT_HTTP_CONNECTED, false, K_NO_WAIT)) {
+    printk("HTTPS session idle, disconnecting\n");
+    // The policy may have put it to sleep already, AT+SHDISC would only wake it up
+    bool asleep = modem_power_state() == ModemPowerState::SLEEP;
+    if (asleep) self->set_slow_clock(false);
+    self->close_session();
+    if (asleep) self->set_slow_clock(true);
+  }
+  k_mutex_unlock(&self->session_lock);
+  return 0;
+}
+
+void Network::cancel_session_idle(void) {
+  k_work_cancel_delayable(&session_idle_work.work);
+  modem_arbiter_cancel(&session_idle_job);
+}
+
+bool Network::run_request(const char* body_command, bool reused) {
+  char auth_command[45 + sizeof(token_data.access_token)]{};
+  if (token_data.is_valid) {
+    snprintk(auth_command, sizeof(auth_command),
+      "AT+SHAHEAD=\"authorization\",\"Bearer %s\"\r", token_data.access_token);
+  } else {
+    strcpy(auth_command, "AT+SHAHEAD=\"authorization\",\"\"\r");
+  }
+
+  // Headers stay on the connection, only the body changes between requests
+  bool headers_set = session_headers_set;
+  request_ctx_t ctx = {};
+  const AtStep steps[] = {
+    // AT+SHSTATE?
+    // +SHSTATE: 1
+    // OK
+    // Local check that the server didn't close a reused connection, times out on "+SHSTATE: 0"
+    { .command = "AT+SHSTATE?\r", .intermediate = "+SHSTATE: 1", .timeout_ms = 1000LL, .skip = !reused },
+    { .command = "AT+SHCHEAD\r", .skip = headers_set },
+    { .command = "AT+SHAHEAD=\"User-Agent\",\"curl/7.47.0\"\r", .skip = headers_set },
+    { .command = "AT+SHAHEAD=\"Cache-control\",\"no-cache\"\r", .skip = headers_set },
+    { .command = "AT+SHAHEAD=\"Connection\",\"keep-alive\"\r", .skip = headers_set },
+    { .command = "AT+SHAHEAD=\"Content-type\",\"application/json\"\r", .skip = headers_set },
+    { .command = "AT+SHAHEAD=\"Accept\",\"*/*\"\r", .skip = headers_set },
+    { .command = auth_command, .skip = headers_set },
+    { .command = body_command, .timeout_ms = 10000LL },
+    // AT+SHREQ="/",3
+    // OK
+    // +SHREQ: "POST",200,593
+    // This is where we wait for the server response
+    { .command = "AT+SHREQ=\"/\",3\r", .intermediate = "OK", .expect = "+SHREQ: ", .timeout_ms = 40000LL, .on_match = parse_shreq },
+    // AT+SHREAD=0,593
+    // OK
+    // +SHREAD: 593
+    // {"errors":[{"mess
+    // The body can be longer than a line and contain line breaks, so read it raw
+    { .build_command = build_shread, .expect = "+SHREAD: ", .timeout_ms = 10000LL,
+      .bulk_header = "+SHREAD: ", .bulk_buf = buffer, .bulk_size = RESPONSE_SIZE },
+  };
+  AtStepResult results[ARRAY_SIZE(steps)];
+
+  memset(buffer, 0, RESPONSE_SIZE);
+  bool success = at.run(steps, ARRAY_SIZE(steps), &ctx, results);
+  // AT+SHREQ and AT+SHREAD together are the round trip to the server
+  AtStepResult round_trip = results[ARRAY_SIZE(steps) - 2];
+  round_trip.duration_ms += results[ARRAY_SIZE(steps) - 1].duration_ms;
+  round_trip.success = round_trip.success && results[ARRAY_SIZE(steps) - 1].success;
+  record_step(RatPhase::REQUEST, round_trip);
+  record_latency(MODEM_STAT_SERVER, results[ARRAY_SIZE(steps) - 2]);
+  record_latency(MODEM_STAT_READ, results[ARRAY_SIZE(steps) - 1]);
+  // Headers can only be trusted after a request that got through
+  session_headers_set = success;
+  return success;
+}
+
+int Network::send_request(const Graphql::Writer& body, response_handler_t on_data, void* user_data, char* out_result_msg,
+  bool partial_data) {
+  if (!body.ok()) {
+    printk("Request body incomplete, not sending\n");
+    return -EINVAL;
+  }
+  Utilities::write_rgb(0, 0, 60);
+  // leave off line break to catch mistakes
+  printk("Sending request:\n%s\nOf size: %u\n", body.c_str(), body.sent_length());
+  const char* body_command = body.c_str();
+
+  int ret = -EIO;
+  k_mutex_lock(&session_lock, K_FOREVER);
+  cancel_session_idle();
+
+  bool sent = false;
   for (uint8_t attempt = 0; attempt < MAX_NETWORK_ATTEMPTS; attempt++) {
     serial_purge();
-    memset(buffer, 0, RESPONSE_SIZE);
-    uint16_t response_len = 0;
-    for (uint8_t i = 0; i < commands_len; i++) {
-      if(i == AT_SNI_IDX && !USE_SNI) continue;
-      serial_print_uart(commands[i]);
-      bool success = false;
-
-      if (i == AT_CNACT_IDX) {
-        // AT+CNACT=1,"hologram"
-        // OK
-        // +APP PDP:ACTIVE
-        success = serial_did_return_str("+APP PDP:", timeout);
-      } else if (i == AT_SHREQ_IDX) {
-        // AT+SHREQ="https://site.com",3
-        // OK
-        // +SHREQ: "POST",200,593
-        if (serial_did_return_ok(timeout)) {
-          char response[30]{};
-          // This is where we wait for the server response
-          serial_read_queue(response, timeout);
-          if (strlen(response) > 19) {
-            response_len = strtoumax(response + 19, NULL, 10);
-            success = true;
-          }
-        }
-        // Since AT+SHREAD requires the length from previous response, need special case
-        if (success) {
-          success = false;
-          command_size = 30;
-          char read_command[command_size]{};
-          snprintk(read_command, command_size, "AT+SHREAD=0,%d\r", response_len);
-          serial_print_uart(read_command);
-          // AT+SHREAD=0,593
-          // OK
-          // +SHREAD: 593
-          // {"errors":[{"mess
-          if (serial_did_return_str("+SHREAD", timeout)) {
-            success = serial_read_queue(buffer, timeout);
-          } else {
-            printk("DOWNLOAD failed\n");
-          }
-        }
-      } else {
-        // AT+BOOFAR=LEET
-        // OK
-        success = serial_did_return_ok(timeout);
-      }
-      if (!success) {
-        Utilities::write_rgb(70, 5, 0);
-        printk(">>Network Request Timeout<<\n");
-        timeout = 1000LL;
-      }
+    bool reused = k_event_wait(&events, NETWORK_EVT_HTTP_CONNECTED, false, K_NO_WAIT) != 0;
+    printk("%s HTTPS session\n", reused ? "Reusing" : "Opening");
+    sent = (reused || open_session()) && run_request(body_command, reused);
+    if (!sent && reused) {
+      // The server or network dropped the idle connection, start over with a fresh one
+      printk("Reused HTTPS session failed, reconnecting\n");
+      close_session();
+      sent = open_session() && run_request(body_command, false);
     }
     printk("Request complete\nResponse is: %s\n", buffer);
+    serial_print_wait_stats();
 
-    const char* error_msg = NULL;
-    doc = cJSON_ParseWithOpts(buffer, &error_msg, true);
-    if (strlen(error_msg) || !doc) {
-      printk("parseWithOpts() failed: %s\n", error_msg);
+    size_t len = strlen(buffer);
+    if (json_validate(buffer, len) != 0) {
+      printk("Invalid JSON response\n");
       if(out_result_msg) {
-        strncpy(out_result_msg, error_msg, 199);
+        strncpy(out_result_msg, "Invalid JSON response", 199);
       }
       if (attempt < MAX_NETWORK_ATTEMPTS - 1) {
         printk("Retrying. Attempt %d\n", attempt + 2);
       } else {
         printk("All attempts failed\n");
-        cJSON_Delete(doc);
-        return NULL;
       }
     } else {
       Utilities::write_rgb(0, 25, 0);
-      cJSON* errors = cJSON_GetObjectItem(doc, "errors");
+      struct json_value_t errors;
 
-      if (errors) {
+      if (json_path_find(buffer, len, "errors", &errors) == 0) {
         printk("Access errors returned\n");
-        cJSON* error0 = cJSON_GetArrayItem(errors, 0);
-        cJSON* extensions = cJSON_GetObjectItem(error0, "extensions");
-        char* code = cJSON_GetObjectItem(extensions, "code")->valuestring;
+        char code[32]{};
         if(out_result_msg) {
           strncpy(out_result_msg, buffer, 199);
         }
 
-        if (strcmp(code, "UNAUTHENTICATED") == 0) {
+        if (json_path_get_string(buffer, len, "errors[0].extensions.code", code, sizeof(code)) < 0) {
+          printk("Error has no extensions.code\n");
+          ret = -EBADMSG;
+        } else if (strcmp(code, "UNAUTHENTICATED") == 0) {
           printk("Unauthenticated: Clearing access_token\n");
           set_access_token("");
-          printk("Clearing %u known sensor address(es)\n", known_sensor_addrs_len);
-          memset(known_sensor_addrs, 0, sizeof(known_sensor_addrs));
-          known_sensor_addrs_len = 0;
-          printk("access_token and known_sensor_addrs cleared\n");
+          printk("Clearing %u known sensor address(es)\n", known_sensors_count());
+          known_sensors_clear();
+          printk("access_token and known sensors cleared\n");
+          ret = -EACCES;
+        } else {
+          printk("Error code: %s\n", code);
+          ret = -EBADMSG;
         }
-        cJSON_Delete(doc);
-        return NULL;
+        if (ret == -EBADMSG && partial_data && on_data) on_data(buffer, len, user_data);
+      } else {
+        // Still holding session_lock, so the buffer can't be overwritten by another request
+        if (on_data) on_data(buffer, len, user_data);
+        ret = 0;
       }
       break;
     }
   }
-  return doc;
+
+  // Keep the connection for back to back requests, e.g. an event followed by a battery update
+  if (sent && CONFIG_HUB_HTTP_SESSION_IDLE_MS > 0) {
+    k_work_schedule(&session_idle_work.work, K_MSEC(CONFIG_HUB_HTTP_SESSION_IDLE_MS));
+  } else {
+    close_session();
+  }
+  k_mutex_unlock(&session_lock);
+  return ret;
 }
 
-void Network::set_fun_mode(bool full_functionality) {
+bool Network::set_fun_mode(bool full_functionality) {
   char command[11]{};
   snprintk(command, 11, "AT+CFUN=%d\r", full_functionality ? 1 : 4);
   serial_print_uart(command);
-  bool success = serial_did_return_ok(2000LL);
+  // Can take a few seconds while the modem detaches from the network
+  bool success = serial_did_return_ok(10000LL);
   if (!success) printk("Error setting fun mode\n");
+  if (success && !full_functionality) {
+    // Detaching drops registration and the data connection without waiting for URCs
+    cancel_session_idle();
+    session_headers_set = false;
+    last_status = -1;
+    k_event_clear(&events, NETWORK_EVT_REGISTERED | NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
+  }
+  return success;
+}
+
+bool Network::set_edrx(bool enable) {
+  const AtStep steps[] = {
+    // PSM can only be left with PWRKEY, which isn't wired, so stay reachable over UART
+    { .command = "AT+CPSMS=0\r" },
+    // LTE-M paging cycle of 81.92s, AT+CEDRXS=<mode>,<AcT-type>,<value>
+    { .command = enable ? "AT+CEDRXS=1,4,\"0101\"\r" : "AT+CEDRXS=0\r" },
+  };
+  return at.run(steps, ARRAY_SIZE(steps));
+}
+
+bool Network::set_slow_clock(bool enable) {
+  // Asleep, the characters that wake the modem up are lost
+  for (uint8_t attempt = 0; !enable && attempt < 3; attempt++) {
+    serial_purge();
+    if (is_powered_on()) break;
+  }
+  serial_print_uart(enable ? "AT+CSCLK=2\r" : "AT+CSCLK=0\r");
+  return serial_did_return_ok(1000LL);
 }
 
 bool Network::get_imei() {
@@ -242,39 +443,183 @@ bool Network::get_imei() {
 
 bool Network::configure_modem(void) {
   if (!is_powered_on()) return false;
-  serial_print_uart("AT+IPR=115200\r");
-  bool ret = serial_did_return_ok(2000LL);
+  bool ret = negotiate_baud();
   if (!ret) printk("Unable to configure IPR\n");
+
+  // Let the network set the modem's clock so uploads can be timestamped, see sync_clock
+  serial_print_uart("AT+CLTS=1\r");
+  if (!serial_did_return_ok(1000LL)) printk("Unable to enable network time\n");
   return ret;
 }
 
-bool Network::wait_for_power_on(void) {
+bool Network::sync_clock(void) {
+  char buf[128]{};
+  serial_purge();
+  serial_print_uart("AT+CCLK?\r");
+  if (!serial_read_raw_until("+CCLK: ", buf, 2000LL)) return false;
+  serial_did_return_ok(500LL, false);
+
+  // +CCLK: "23/10/17,12:34:56+08", the zone is in quarter hours
+  const char* cclk = strstr(buf, "+CCLK: \"");
+  struct tm time = {};
+  int zone = 0;
+  if (!cclk || sscanf(cclk, "+CCLK: \"%d/%d/%d,%d:%d:%d%d", &time.tm_year, &time.tm_mon, &time.tm_mday,
+    &time.tm_hour, &time.tm_min, &time.tm_sec, &zone) < 6) return false;
+  // The modem starts out at a date in 1980 or 2004 until the network sends the time
+  if (time.tm_year < 23) return false;
+  time.tm_year += 100;
+  time.tm_mon -= 1;
+
+  int64_t epoch_ms = (timeutil_timegm64(&time) - zone * 15 * 60) * 1000LL;
+  epoch_offset_ms = epoch_ms - k_uptime_get();
+  printk("\tClock synced from network: %lld\n", epoch_ms / 1000);
+  return true;
+}
+
+int64_t Network::epoch_time(void) {
+  if (!epoch_offset_ms) return 0;
+  return (k_uptime_get() + epoch_offset_ms) / 1000;
+}
+
+void Network::save_baud(uint32_t baud, bool flow_control) {
+  if (modem_settings.baud == baud && modem_settings.flow_control == flow_control) return;
+  modem_settings.baud = baud;
+  modem_settings.flow_control = flow_control;
+  modem_settings_save();
+}
+
+bool Network::negotiate_baud(void) {
+  // Flow control has to be on at both ends before going faster
+  serial_print_uart(flow_control ? "AT+IFC=2,2\r" : "AT+IFC=0,0\r");
+  if (!serial_did_return_ok(2000LL)) return false;
+  if (!sync_baud(serial_get_baudrate(), flow_control)) {
+    printk("\tNo response after changing flow control\n");
+    // Most likely CTS isn't wired and uart1 can't send anything with RTS/CTS on
+    bool recovered = flow_control && disable_flow_control();
+    if (!recovered && !detect_baud()) return false;
+  }
+
+  for (uint32_t baud : NEGOTIATED_BAUD_RATES) {
+    if (baud > CONFIG_HUB_MODEM_BAUD_MAX) continue;
+    if (baud == serial_get_baudrate()) break;
+
+    char command[20];
+    snprintk(command, sizeof(command), "AT+IPR=%u\r", baud);
+    serial_print_uart(command);
+    // Still talking at the old rate if the modem refused
+    if (!serial_did_return_ok(2000LL)) continue;
+
+    // The modem took the rate, the first AT after the switch can be lost while it settles
+    k_msleep(50);
+    if (sync_baud(baud, flow_control)) break;
+
+    // Modem switched but the link doesn't work at this rate, find it and try slower
+    printk("\tNo response at %u baud\n", baud);
+    if (!detect_baud(baud)) return false;
+    // Answered at the new rate once it had time to settle
+    if (serial_get_baudrate() == baud) break;
+  }
+
+  uint32_t agreed_baud = serial_get_baudrate();
+  // Keep the rate in the modem's profile so it comes back up at it
+  serial_print_uart("AT&W\r");
+  serial_did_return_ok(2000LL);
+  save_baud(agreed_baud, flow_control);
+  printk("\tModem baud agreed at %u\n", agreed_baud);
+  return true;
+}
+
+bool Network::sync_baud(uint32_t baud, bool flow_control) {
+  serial_set_baudrate(baud, flow_control);
+  for (uint8_t attempt = 0; attempt < 3; attempt++) {
+    serial_purge();
+    if (is_powered_on()) return true;
+  }
+  return false;
+}
+
+bool Network::disable_flow_control(void) {
+  printk("\tTurning flow control off\n");
+  flow_control = false;
+  serial_set_baudrate(serial_get_baudrate(), false);
+  // The modem may not get its OK out while it still waits for RTS, sync_baud tells
+  serial_print_uart("AT+IFC=0,0\r");
+  serial_did_return_ok(2000LL);
+  return sync_baud(serial_get_baudrate(), false);
+}
+
+uint32_t Network::find_baud(uint32_t first_baud, bool with_flow_control) {
+  // Where the modem most likely is, which may not be one of the usual rates
+  if (sync_baud(first_baud, with_flow_control)) return first_baud;
+  for (uint32_t baud : DETECT_BAUD_RATES) {
+    if (baud == first_baud) continue;
+    if (sync_baud(baud, with_flow_control)) return baud;
+  }
+  return 0;
+}
+
+bool Network::detect_baud(uint32_t first_baud) {
+  printk("Detecting modem baud rate...\n");
+  uint32_t baud = find_baud(first_baud, flow_control);
+  if (!baud && flow_control) {
+    printk("\tNo response with flow control, retrying without\n");
+    baud = find_baud(first_baud, false);
+    if (baud && !disable_flow_control()) baud = 0;
+  }
+  if (!baud) {
+    printk("\tModem not found at any baud rate\n");
+    // Don't leave uart1 at the last rate tried, go back to where the modem should come up
+    if (modem_settings.baud) serial_set_baudrate(modem_settings.baud, modem_settings.flow_control);
+    else serial_set_baudrate(MODEM_DEFAULT_BAUD, false);
+    return false;
+  }
+  printk("\tModem found at %u baud\n", baud);
+  save_baud(baud, flow_control);
+  return true;
+}
+
+bool Network::wait_for_power_on(int64_t timeout) {
+  Deadline deadline(timeout);
   if (is_powered_on()) {
     printk("\tAlready powered on\n");
     return true;
   }
   int64_t startTime = k_uptime_get();
-  // Usually takes around 6 seconds from cold boot
-  if (!serial_did_return_str("SMS Ready", 20000LL)) return false;
+  // Posted by the SMS Ready URC
+  if (!k_event_wait(&events, NETWORK_EVT_POWERED_ON, false, deadline.remaining())) {
+    // SMS Ready never shows up when the modem is at another rate or autobauding
+    if (!detect_baud()) {
+      modem_stats_record(MODEM_STAT_POWER_ON, k_uptime_get() - power_on_time, false);
+      return false;
+    }
+  }
+  modem_stats_record(MODEM_STAT_POWER_ON, k_uptime_get() - power_on_time, true);
 
   printk("\tPowered On! Took %llims\n", k_uptime_get() - startTime);
   return true;
 }
 
-int8_t Network::get_reg_status() {
+int8_t Network::get_reg_status(int64_t timeout) {
+  Deadline deadline(timeout);
   char resp[5]{};
   serial_purge();
 
-  char tx_buf[MSG_SIZE];
   serial_print_uart("AT+CREG?\r");
 
-  if (!serial_did_return_str("AT+CREG?", 1000LL, false)) return -1;
-  if (!serial_read_queue(tx_buf, 2000LL, false)) return -1;
-  // tx_buf should have "+CREG: 0,5"
-  strncpy(resp, tx_buf + 7, 5);
-  if (!serial_did_return_ok(500LL, false)) return -1;
+  if (!serial_did_return_str("AT+CREG?", deadline.clamp_ms(1000LL), false)) return -1;
+  const char* line = serial_line_borrow(K_MSEC(deadline.clamp_ms(2000LL)));
+  if (!line) return -1;
+  // line should have "+CREG: 0,5"
+  strncpy(resp, line + 7, 5);
+  serial_line_release(line);
+  if (!serial_did_return_ok(deadline.remaining_ms(), false)) return -1;
 
   int8_t status = resp[2] - '0';
+  update_reg_status(status);
+  return status;
+}
+
+void Network::update_reg_status(int8_t status) {
   if (status != last_status) {
     char details[35];
     // Only print status if it has changed
@@ -286,54 +631,72 @@ int8_t Network::get_reg_status() {
     else if (status == 5) strcpy(details, "Registered, roaming");
     else strcpy(details, "ERROR");
     last_status = status;
+    if (status == 1 || status == 5) k_event_post(&events, NETWORK_EVT_REGISTERED);
+    else k_event_clear(&events, NETWORK_EVT_REGISTERED);
 
     if (strcmp(details, "ERROR") == 0) {
       printk("Registration status unknown\n");
     } else printk("\nRegistration Status: %s\n", details);
   }
-  return status;
 }
 
-int8_t Network::get_acc_tech(void) {
-  if (last_status != 1 && last_status != 5) return -1;
-  char resp[30]{};
-  char tx_buf[MSG_SIZE]{};
+bool Network::read_serving_cell(void) {
+  char buf[160]{};
   serial_purge();
-  serial_print_uart("AT+CREG=2\r");
-  if (!serial_did_return_ok(2000LL)) return -1;
-
-  serial_print_uart("AT+CREG?\r");
-
-  if (!serial_did_return_str("AT+CREG?", 1000LL)) return -1;
-  if (!serial_read_queue(tx_buf, 2000LL)) return -1;
-  // tx_buf should have "+CREG: 0,5,...."
-  strncpy(resp, tx_buf + 7, 30);
-  if (!serial_did_return_ok(500LL)) return -1;
-
-  int8_t status = resp[2] - '0';
-  int8_t accTech = -1;
-
-  if (status == 1 || status == 5) {
-    char details[30]{};
-    // We're registered, print access technology
-    accTech = resp[strlen(resp) - 1] - '0';
-    if (accTech == 0) strcpy(details, "GSM");
-    else if (accTech == 2) strcpy(details, "UTRAN");
-    else if (accTech == 3) strcpy(details, "GSM w/EGPRS");
-    else if (accTech == 4) strcpy(details, "UTRAN w/HSDPA");
-    else if (accTech == 5) strcpy(details, "UTRAN w/HSUPA");
-    else if (accTech == 6) strcpy(details, "UTRAN w/HSDPA and w/HSUPA");
-    else if (accTech == 7) strcpy(details, "E-UTRAN");
-    else strcpy(details, "ERROR");
-
-    if (strcmp(details, "ERROR") == 0) {
-      printk("Registration network unknown\n");
-    } else printk("Registration on network: %s\n", details);
+  serial_print_uart("AT+CPSI?\r");
+  if (!serial_read_raw_until("+CPSI: ", buf, 2000LL)) return false;
+  serial_did_return_ok(500LL, false);
+
+  // LTE: +CPSI: LTE CAT-M1,Online,310-260,0x00C3,1234567,123,EUTRAN-BAND12,5110,...
+  // GSM: +CPSI: GSM,Online,310-260,0x1234,5678,20,-80,...
+  const char* cpsi = strstr(buf, "+CPSI: ");
+  char mode[16]{};
+  char mcc[4]{};
+  char mnc[4]{};
+  unsigned int area = 0;
+  unsigned int cell_id = 0;
+  if (!cpsi || sscanf(cpsi, "+CPSI: %15[^,],%*[^,],%3[0-9]-%3[0-9],%x,%u", mode, mcc, mnc, &area, &cell_id) < 3) {
+    printk("\tUnable to parse serving cell: %s\n", cpsi ? cpsi : buf);
+    return false;
   }
+  printk("\tSIM7000 says: %s\n", cpsi);
+
+  modem_reg_hints_t hints = {};
+  snprintk(hints.oper, sizeof(hints.oper), "%s%s", mcc, mnc);
+  if (strstr(mode, "NB-IOT")) hints.act = 9;
+  else if (strstr(mode, "LTE")) hints.act = 7;
+  else hints.act = 0;
+  const char* band = strstr(cpsi, "BAND");
+  if (band) hints.band = strtol(band + 4, NULL, 10);
+  hints.area = area;
+  hints.cell_id = cell_id;
+
+  if (hints.cell_id == modem_reg_hints.cell_id && hints.area == modem_reg_hints.area) {
+    printk("\tSame cell as the last registration\n");
+  }
+  bool changed = strcmp(hints.oper, modem_reg_hints.oper) != 0 || hints.act != modem_reg_hints.act ||
+    hints.band != modem_reg_hints.band;
+  modem_reg_hints = hints;
+  // The cell changes often while moving, only spend a flash write when the hints do
+  if (changed) modem_reg_hints_save();
+  return true;
+}
 
-  serial_print_uart("AT+CREG=0\r");
-  if (!serial_did_return_ok(2000LL)) return -1;
-  return accTech;
+bool Network::apply_reg_hints(int64_t timeout) {
+  if (!modem_reg_hints.oper[0] || diagnostic_running) return false;
+  PreferredMode mode;
+  if (rat_select_get_current(&mode) && !mode_allows_act(mode, modem_reg_hints.act)) {
+    printk("\tLast operator was on act %u, not used in mode %u\n", modem_reg_hints.act, (uint8_t)mode);
+    return false;
+  }
+  char command[32]{};
+  // Mode 4 is manual with automatic fallback, the modem tries the hinted operator and RAT
+  // first and only scans everything if that fails
+  snprintk(command, sizeof(command), "AT+COPS=4,2,\"%s\",%u\r", modem_reg_hints.oper, modem_reg_hints.act);
+  printk("\tTrying last operator %s, act %u first\n", modem_reg_hints.oper, modem_reg_hints.act);
+  serial_print_uart(command);
+  // Only answers once it registered or gave up on the hinted operator
+  return serial_did_return_ok(timeout);
 }
 
 void Network::set_power(bool on) {
@@ -342,116 +705,135 @@ void Network::set_power(bool on) {
   if (on) {
     printk("Powering on SIM module...\n");
     last_status = -1;
+    power_on_time = k_uptime_get();
+    reg_hints_pending = true;
   } else {
     printk("Powering off SIM module...\n");
+    cancel_session_idle();
+    session_headers_set = false;
+    k_event_clear(&events, NETWORK_EVT_POWERED_ON | NETWORK_EVT_REGISTERED |
+      NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
   }
 }
 
 bool Network::is_powered_on(void) {
   serial_print_uart("AT\r");
-  return serial_did_return_ok(100LL);
+  bool powered = serial_did_return_ok(100LL);
+  if (powered) k_event_post(&events, NETWORK_EVT_POWERED_ON);
+  return powered;
+}
+
+bool Network::is_powered_on_cached(void) {
+  return k_event_wait(&events, NETWORK_EVT_POWERED_ON, false, K_NO_WAIT) != 0;
 }
 
-bool Network::set_power_on_and_wait_for_reg(void) {
+bool Network::set_power_on_and_wait_for_reg(int64_t timeout) {
   int64_t start_time = k_uptime_get();
+  Deadline reg_deadline(timeout);
   set_power(true);
-  if (!wait_for_power_on()) {
+  if (!wait_for_power_on(reg_deadline.clamp_ms(MODEM_POWER_ON_TIMEOUT_MS))) {
     printk("\tWait for power on failed\n");
     set_power(false);
     return false;
   }
-
-  serial_print_uart("AT+CNMP?\r");
-  if (!serial_did_return_str("+CNMP: ", 4000LL)) return false;
-
-  int8_t regStatus = -1;
-  while (k_uptime_get() < start_time + 60000LL) {
-    regStatus = get_reg_status();
-    if (regStatus == 5 || regStatus == 1) {
-      printk("\tRegistered!\n");
-      break;
-    }
-    k_msleep(50);
-  }
-  if (regStatus != 5 && regStatus != 1) {
-    printk("\tRegStatus %i not valid\n", regStatus);
+  if (!wait_for_reg(reg_deadline.remaining_ms())) {
     set_power(false);
     return false;
   }
-  int8_t accTech = get_acc_tech();
-  if (accTech == -1) {
-    printk("\tAccess tech %i not valid\n", accTech);
-    set_power(false);
+  printk("Registered! Total Boot up time(ms): %lld\n", k_uptime_get() - start_time);
+  return true;
+}
+
+bool Network::wait_for_reg(int64_t timeout) {
+  // Still registered from earlier, e.g. waking from eDRX sleep
+  if (k_event_wait(&events, NETWORK_EVT_REGISTERED, false, K_NO_WAIT)) return true;
+
+  Deadline reg_deadline(timeout);
+  // The first attach after power on counts from power on, later ones e.g. after airplane mode from now
+  int64_t start_time = reg_hints_pending ? power_on_time : k_uptime_get();
+  // Have registration changes reported as +CREG URCs instead of polling for them
+  serial_print_uart("AT+CREG=1\r");
+  if (!serial_did_return_ok(reg_deadline.clamp_ms(2000LL))) return false;
+
+  int8_t regStatus = get_reg_status(reg_deadline.clamp_ms(3500LL));
+  bool hinted = false;
+  if (regStatus != 5 && regStatus != 1 && reg_hints_pending) {
+    reg_hints_pending = false;
+    // The diagnostic sets each mode itself
+    PreferredMode mode;
+    if (!diagnostic_running && rat_select_choose(&mode)) set_preferred_mode(mode, reg_deadline.clamp_ms(8000LL));
+    hinted = apply_reg_hints(reg_deadline.clamp_ms(CONFIG_HUB_MODEM_REG_HINT_TIMEOUT_S * 1000LL));
+  }
+  if (!k_event_wait(&events, NETWORK_EVT_REGISTERED, false, reg_deadline.remaining())) {
+    // Catch a URC that was missed while the modem was busy with AT+COPS, a last
+    // look once the budget is spent so it gets its own timeout
+    get_reg_status();
+  }
+  regStatus = last_status;
+
+  int64_t reg_time = k_uptime_get() - start_time;
+  // The diagnostic's attaches count too, they are timed the same way
+  rat_select_record(RatPhase::ATTACH, reg_time, regStatus == 5 || regStatus == 1);
+  modem_stats_record(MODEM_STAT_REGISTRATION, reg_time, regStatus == 5 || regStatus == 1);
+  if (regStatus != 5 && regStatus != 1) {
+    printk("\tRegStatus %i not valid, gave up after %lldms\n", regStatus, reg_time);
     return false;
   }
-  
-  serial_print_uart("AT+CSQ\r");
-  if (!serial_did_return_str("+CSQ: ", 4000LL)) return false;
+  printk("\tRegistered! Time to registered: %lldms, %s\n", reg_time,
+    hinted ? "with last operator" : "without hints");
+  read_serving_cell();
 
-  printk("Registered! Total Boot up time(ms): %lld\n", k_uptime_get() - start_time);
+  if (!epoch_offset_ms) sync_clock();
   return true;
 }
 
-bool Network::set_preferred_mode(PreferredMode mode) {
+bool Network::set_preferred_mode(PreferredMode mode, int64_t timeout) {
+  Deadline deadline(timeout);
   serial_purge();
   serial_print_uart("AT+CNMP?\r");
-  if (!serial_did_return_str("+CNMP: ", 4000LL)) return false;
+  if (!serial_did_return_str("+CNMP: ", deadline.clamp_ms(4000LL))) return false;
   // tx_buf should have "+CNMP: 2" or some other mode
   char command[12]{};
   snprintk(command, 12, "AT+CNMP=%u\r", (uint8_t) mode);
   serial_print_uart(command);
-  return serial_did_return_ok(4000LL);
+  if (!serial_did_return_ok(deadline.remaining_ms())) return false;
+  rat_select_set_current(mode);
+  return true;
 }
 
 bool Network::send_test_request(void) {
+  // The test connects to httpbin.org, so the API session has to go
+  k_mutex_lock(&session_lock, K_FOREVER);
+  if (k_event_wait(&events, NETWORK_EVT_HTTP_CONNECTED, false, K_NO_WAIT)) close_session();
   serial_purge();
 
-  const char* const commands[] = {
-    "AT+CNACT=1,\"hologram\"\r", // +APP PDP
-    "AT+CNACT?\r",
-    "AT+CSSLCFG=\"sslversion\",1,3\r",
-    "AT+CSSLCFG=\"ignorertctime\",1,1\r",
-    "AT+CSSLCFG=\"sni\",1,\"httpbin.org\"\r",
-    "AT+SHSSL=1,\"\"\r",
-    "AT+SHCONF=\"BODYLEN\",1024\r",
-    "AT+SHCONF=\"HEADERLEN\",350\r",
-    "AT+SHCONF=\"URL\",\"https://httpbin.org\"\r",
-    "AT+SHCONN\r",
-    "AT+SHCHEAD\r",
-    "AT+SHAHEAD=\"User-Agent\",\"curl/7.47.0\"\r",
-    "AT+SHAHEAD=\"Cache-control\",\"no-cache\"\r",
-    "AT+SHAHEAD=\"Connection\",\"keep-alive\"\r",
-    "AT+SHAHEAD=\"Accept\",\"*/*\"\r",
-    "AT+SHREQ=\"/get?user=jack&password=123\", 1\r", // +SHREQ
-    "AT+SHREAD=0,250\r", // +SHREAD
-    "AT+SHDISC\r",
-    "AT+CNACT=0\r"
+  const AtStep steps[] = {
+    { .command = "AT+CNACT=1,\"hologram\"\r", .intermediate = "OK", .expect = "+APP PDP", .timeout_ms = 40000LL },
+    { .command = "AT+CNACT?\r" },
+    { .command = "AT+CSSLCFG=\"sslversion\",1,3\r" },
+    { .command = "AT+CSSLCFG=\"ignorertctime\",1,1\r" },
+    { .command = "AT+CSSLCFG=\"sni\",1,\"httpbin.org\"\r" },
+    { .command = "AT+SHSSL=1,\"\"\r" },
+    { .command = "AT+SHCONF=\"BODYLEN\",1024\r" },
+    { .command = "AT+SHCONF=\"HEADERLEN\",350\r" },
+    { .command = "AT+SHCONF=\"URL\",\"https://httpbin.org\"\r" },
+    { .command = "AT+SHCONN\r", .timeout_ms = 40000LL },
+    { .command = "AT+SHCHEAD\r" },
+    { .command = "AT+SHAHEAD=\"User-Agent\",\"curl/7.47.0\"\r" },
+    { .command = "AT+SHAHEAD=\"Cache-control\",\"no-cache\"\r" },
+    { .command = "AT+SHAHEAD=\"Connection\",\"keep-alive\"\r" },
+    { .command = "AT+SHAHEAD=\"Accept\",\"*/*\"\r" },
+    { .command = "AT+SHREQ=\"/get?user=jack&password=123\", 1\r", .intermediate = "OK", .expect = "+SHREQ", .timeout_ms = 40000LL },
+    // Payload isn't used, read it raw so it doesn't end up as lines
+    { .command = "AT+SHREAD=0,250\r", .expect = "+SHREAD", .timeout_ms = 10000LL,
+      .bulk_header = "+SHREAD: ", .bulk_buf = buffer, .bulk_size = RESPONSE_SIZE },
+    { .command = "AT+SHDISC\r", .on_fail = AtOnFail::CONTINUE, .cleanup = true },
+    { .command = "AT+CNACT=0\r", .on_fail = AtOnFail::CONTINUE, .cleanup = true },
   };
-  
-  uint16_t commands_len = sizeof(commands) / sizeof(*commands);
-  int64_t timeout = 40000LL;
-  bool success = false;
-  for (uint8_t i = 0; i < commands_len; i++) {
-    serial_print_uart(commands[i]);
-
-    if(i == 0) {
-      success = serial_did_return_str("+APP PDP", timeout);
-    } else if(i == 15) {
-      success = serial_did_return_str("+SHREQ", timeout);
-    } else if(i == 16) {
-      success = serial_did_return_str("+SHREAD", timeout);
-      k_msleep(50);
-      serial_purge();
-    } else {
-      success = serial_did_return_ok(timeout);
-    }
-
-    if (!success) {
-      Utilities::write_rgb(70, 5, 0);
-      printk(">>Network Request Timeout<<\n");
-      timeout = 1000LL;
-    }
-  }
+  AtStepResult results[ARRAY_SIZE(steps)];
+  bool success = at.run(steps, ARRAY_SIZE(steps), NULL, results);
+  k_event_clear(&events, NETWORK_EVT_PDP_ACTIVE | NETWORK_EVT_HTTP_CONNECTED);
+  k_mutex_unlock(&session_lock);
   return success;
 }
 // IMEI example
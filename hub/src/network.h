@@ -1,14 +1,41 @@
 #ifndef HUB_NETWORK_H
 #define HUB_NETWORK_H
 
+#include <zephyr/kernel.h>
 #include <zephyr/settings/settings.h>
-#include <cJSON.h>
 #include <stdint.h>
 
+#include "at_engine.h"
+#include "json_path.h"
+#include "graphql.h"
+#include "modem_arbiter.h"
+
 #define IMEI_LEN    20
+// Usually takes around 6 seconds from cold boot
+#define MODEM_POWER_ON_TIMEOUT_MS   20000LL
+// Time allowed for registration, including the power on when the modem was off
+#define MODEM_REG_TIMEOUT_MS        60000LL
 // Needs to be large enough for error messages
 const uint16_t RESPONSE_SIZE = 2000;
 
+// Modem state reported through URCs, posted to Network::events
+#define NETWORK_EVT_POWERED_ON        BIT(0)
+#define NETWORK_EVT_REGISTERED        BIT(1)
+#define NETWORK_EVT_PDP_ACTIVE        BIT(2)
+#define NETWORK_EVT_HTTP_CONNECTED    BIT(3)
+
+/**
+ * Called with the body of a successful response, read it with the json_path functions.
+ * json is only valid until the handler returns
+ */
+typedef void (*response_handler_t)(const char* json, size_t len, void* user_data);
+
+// Delayable work item that knows which Network it belongs to
+struct network_work_t {
+  struct k_work_delayable work;
+  class Network* network;
+};
+
 enum class PreferredMode: uint8_t {
   AUTOMATIC = 2,
   GSM = 13,
@@ -23,15 +50,140 @@ private:
   **/
   char buffer[RESPONSE_SIZE]{};
 
+  /**
+   * Runs the AT command scripts for requests
+   */
+  AtEngine at;
+
   /**
    * Network registration status
    */
-  int8_t last_status = -1;
+  volatile int8_t last_status = -1;
 
   /**
-   * @return The length of str after unescaping
-  */
-  int unescaped_len(char* str);
+   * NETWORK_EVT_* bits, kept up to date by the URC handlers
+   */
+  struct k_event events;
+
+  /**
+   * Held while a request uses the HTTPS session so the idle timeout can't close it underneath
+   */
+  struct k_mutex session_lock;
+
+  /**
+   * Closes the HTTPS session after CONFIG_HUB_HTTP_SESSION_IDLE_MS without requests
+   */
+  struct network_work_t session_idle_work;
+
+  /**
+   * Submitted by session_idle_work, AT+SHDISC goes through the arbiter like any other modem use
+   */
+  struct modem_job_t session_idle_job;
+
+  /**
+   * Set once the static and authorization headers were added to the open session,
+   * cleared when the session closes or the access token changes
+   */
+  bool session_headers_set = false;
+
+  /**
+   * RTS/CTS on uart1, cleared if the modem can't be reached with it, e.g. CTS isn't wired
+   */
+  bool flow_control = IS_ENABLED(CONFIG_HUB_MODEM_FLOW_CONTROL);
+
+  /**
+   * @brief Activates the PDP context if needed and connects to API_URL with AT+SHCONN
+   * Call with session_lock held
+   * @return True if connected
+   */
+  bool open_session(void);
+
+  /**
+   * @brief Disconnects the HTTPS session, the PDP context is kept. Call with session_lock held
+   */
+  void close_session(void);
+
+  /**
+   * @brief Sends the headers if needed and body_command, then reads the response into buffer
+   * @param body_command the AT+SHBOD command for this request
+   * @param reused whether the session was already open before this request
+   * @return True if the response was read
+   */
+  bool run_request(const char* body_command, bool reused);
+
+  static void session_idle_work_handler(struct k_work* work_item);
+  static int session_idle_job_fn(void* user_data);
+
+  /**
+   * @brief Stops a pending idle timeout, whether it is still waiting or already queued as a job
+   */
+  void cancel_session_idle(void);
+
+  /**
+   * @brief Stores a new registration status, printing it and posting
+   * NETWORK_EVT_REGISTERED if it changed
+   */
+  void update_reg_status(int8_t status);
+
+  /**
+   * @brief Steps AT+IPR down from CONFIG_HUB_MODEM_BAUD_MAX until the modem answers at the new rate
+   * @return True if the modem is reachable at the agreed rate
+   */
+  bool negotiate_baud(void);
+
+  /**
+   * @brief Cycles uart1 through the supported rates sending AT until the modem answers
+   * @param first_baud tried before the others, e.g. the rate AT+IPR just set
+   * @return True if the modem was found
+   */
+  bool detect_baud(uint32_t first_baud = CONFIG_HUB_MODEM_BAUD_MAX);
+
+  /**
+   * @brief Tries first_baud and then the usual rates with sync_baud
+   * @return The rate the modem answered at, 0 if none
+   */
+  uint32_t find_baud(uint32_t first_baud, bool with_flow_control);
+
+  /**
+   * @brief Switches uart1 to baud and sends AT a few times
+   * @return True if the modem answered
+   */
+  bool sync_baud(uint32_t baud, bool flow_control);
+
+  /**
+   * @brief Turns RTS/CTS off on uart1 at the current rate and sends AT+IFC=0,0
+   * @return True if the modem answers without flow control
+   */
+  bool disable_flow_control(void);
+
+  /**
+   * @brief Persists the agreed baud rate if it changed
+   */
+  void save_baud(uint32_t baud, bool flow_control);
+
+  // URC handlers registered in init, user_data is the Network instance
+  static void on_creg_urc(const char* line, void* user_data);
+  static void on_power_urc(const char* line, void* user_data);
+  static void on_pdp_urc(const char* line, void* user_data);
+  static void on_shstate_urc(const char* line, void* user_data);
+
+  /**
+   * Add to k_uptime_get to get ms since the unix epoch, 0 until the clock was synced
+   */
+  int64_t epoch_offset_ms = 0;
+
+  // When the modem was last powered on
+  int64_t power_on_time = 0;
+  // Set at power on, cleared once the registration hints were tried
+  bool reg_hints_pending = false;
+
+  /**
+   * @brief Asks the modem to try the operator and RAT it last registered on before
+   * scanning, see modem_reg_hints_t. Skipped while the diagnostic tests each mode
+   * @param timeout ms to wait for the modem to answer
+   * @return True if the hints were applied and the modem answered OK
+   */
+  bool apply_reg_hints(int64_t timeout);
 
 public:
 
@@ -51,18 +203,43 @@ public:
   bool has_token();
 
   /**
-   * Sends a request containing query to API_URL, returns a json document with
-   * response in the "data" field if no errors, otherwise errors will be in "errors"
-   * @param query The query to send to the API
+   * Sends a request containing query to API_URL and hands the response to on_data if it
+   * has no "errors". Nothing is parsed or allocated besides what on_data picks out.
+   * The HTTPS session stays open for CONFIG_HUB_HTTP_SESSION_IDLE_MS so the next
+   * request only needs to send its body
+   * @param body The AT+SHBOD command carrying the query, see Graphql::Request
+   * @param on_data Optional handler for the response, e.g. to read "data.createSensor.id"
+   * @param user_data Passed to on_data
    * @param out_result_msg Optional buffer to store error message in
-   * @return The json document returned from the API, or nullptr if there was an error
+   * @param partial_data Also pass a response with GraphQL errors other than UNAUTHENTICATED to on_data,
+   * for batches of aliased mutations where the ones that succeeded are still in "data"
+   * @return 0 on success, -EACCES if errors[0].extensions.code is UNAUTHENTICATED,
+   * -EBADMSG for other GraphQL errors, -EIO if no valid response was received,
+   * -EINVAL if body didn't fit its arguments
   **/
-  cJSON* send_request(char* query, char* out_result_msg = nullptr);
+  int send_request(const Graphql::Writer& body, response_handler_t on_data = nullptr, void* user_data = nullptr,
+    char* out_result_msg = nullptr, bool partial_data = false);
 
   /**
    * Utility function to set AT+CFUN=1 or 4 (1 = full, 4 = airplane mode)
+   * Airplane mode drops the registration and any open HTTPS session
+   * @return True if the modem accepted the mode
+   */
+  bool set_fun_mode(bool full_functionality);
+
+  /**
+   * @brief Enables or disables eDRX paging so the modem sleeps between pages while
+   * staying registered. PSM is disabled since waking from it needs PWRKEY
+   * @return True if the modem accepted the settings
    */
-  void set_fun_mode(bool full_functionality);
+  bool set_edrx(bool enable);
+
+  /**
+   * @brief Lets the modem sleep whenever the UART is idle with AT+CSCLK=2, DTR isn't wired
+   * so AT+CSCLK=1 can't be used. Disabling first wakes it with AT until it answers
+   * @return True if the modem accepted the setting
+   */
+  bool set_slow_clock(bool enable);
 
   /**
    * @brief IMEI string from the SIM module and stores it into class's device_imei buffer
@@ -82,35 +259,43 @@ public:
    * -1 - Failed to retrieve status
    *
    * https://docs.eseye.com/Content/ELS61/ATCommands/ELS61CREG.htm
+   *
+   * @param timeout ms allowed for the query and its response
    */
-  int8_t get_reg_status(void);
+  int8_t get_reg_status(int64_t timeout = 3500LL);
 
   /**
-   * Can be called after get_reg_status returns 1 or 5 to read the access tech
-   * 0 - GSM
-   * 2 - UTRAN
-   * 3 - GSM w/EGPRS
-   * 4 - UTRAN w/HSDPA
-   * 5 - UTRAN w/HSUPA
-   * 6 - UTRAN w/HSDPA and w/HSUPA
-   * 7 - E-UTRAN
-   *
-   * -1 - Failed to retrieve status or not registered
-   *
+   * @brief Reads the serving cell with AT+CPSI? and keeps it as the hints for the next
+   * attach, saving them to settings if the operator, RAT or band changed
+   * @return True if the cell could be read
+   */
+  bool read_serving_cell(void);
+
+  /**
+   * @brief Reads the network time from the modem with AT+CCLK?, done once after registering
+   * @return True if the modem had a valid time
+   */
+  bool sync_clock(void);
+
+  /**
+   * @return Seconds since the unix epoch, 0 if the time isn't known yet
    */
-  int8_t get_acc_tech(void);
+  int64_t epoch_time(void);
 
   /**
-   * @brief Configure SIM7000 with any long-term settings like baud rate
+   * @brief Configure SIM7000 with any long-term settings like baud rate and flow control.
+   * Negotiates the fastest rate up to CONFIG_HUB_MODEM_BAUD_MAX and saves it in settings
    * @return True if configured without problems
    */
   bool configure_modem(void);
 
   /**
-   * Wait until receiving the power on messages from the sim module
+   * Wait until receiving the power on messages from the sim module, falls back to
+   * autobaud detection if they never arrive
+   * @param timeout ms to wait for the power on messages
    * Returns true if powered on, false if timed out
    */
-  bool wait_for_power_on(void);
+  bool wait_for_power_on(int64_t timeout = MODEM_POWER_ON_TIMEOUT_MS);
 
   /**
    * Set the power on or off for the SIMCOM module
@@ -124,16 +309,36 @@ public:
   bool is_powered_on(void);
 
   /**
-   * Shorthand for calling set_power(true), wait_for_power_on, and get_reg_status until registered
+   * Unlike is_powered_on this doesn't talk to the modem, it relies on the power on and
+   * power down URCs seen since the last set_power
+   * @return True if the modem reported being powered on and hasn't reported powering down
+   */
+  bool is_powered_on_cached(void);
+
+  /**
+   * Shorthand for calling set_power(true), wait_for_power_on, and wait_for_reg,
+   * powers the modem back off if any of them fail
+   * @param timeout ms both waits share
+   */
+  bool set_power_on_and_wait_for_reg(int64_t timeout = MODEM_REG_TIMEOUT_MS);
+
+  /**
+   * @brief Enables +CREG URCs and waits for one reporting registration, returns right
+   * away if already registered. The first attach after power on tries the saved
+   * registration hints first, the time it took is printed for every attempt
+   * @param timeout ms to wait for registration, the AT commands on the way count against it.
+   * Reading the serving cell and the clock once registered doesn't
+   * @return True if registered
    */
-  bool set_power_on_and_wait_for_reg(void);
+  bool wait_for_reg(int64_t timeout);
 
   /**
    * @brief Set the current preferred cellular mode of the SIM7000
    * @param mode The PreferredMode to set
+   * @param timeout ms allowed for reading and setting the mode
    * @return True if the mode was set successfully
    */
-  bool set_preferred_mode(PreferredMode mode);
+  bool set_preferred_mode(PreferredMode mode, int64_t timeout = 8000LL);
 
   /**
    * @brief Send a test request to the httpbin.org to check if the network is working
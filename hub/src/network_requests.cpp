@@ -2,142 +2,171 @@
 #include "stdint.h"
 #include "stddef.h"
 #include "string.h"
+#include "stdlib.h"
 
 #include "network_requests.h"
+#include "json_path.h"
+#include "modem_power.h"
+#include "modem_arbiter.h"
+#include "outbox.h"
 #include "version.h"
 
+// Fields picked out of the loginAndFetchHub response
+struct login_result_t {
+  char token[100];
+  int32_t hub_id;
+  bool has_token;
+  bool has_hub_id;
+};
+
+static void parse_login(const char* json, size_t len, void* user_data) {
+  login_result_t* result = (login_result_t*)user_data;
+  result->has_token = json_path_get_string(json, len, "data.loginAndFetchHub.token",
+    result->token, sizeof(result->token)) > 0;
+  result->has_hub_id = json_path_get_int(json, len, "data.loginAndFetchHub.hub.id", &result->hub_id) == 0;
+}
+
+static void parse_sensor_id(const char* json, size_t len, void* user_data) {
+  json_path_get_int(json, len, "data.createSensor.id", (int32_t*)user_data);
+}
+
+// Arguments of a request run as a modem job, see NetworkRequests::run_login and run_add_sensor
+struct login_job_t {
+  NetworkRequests* self;
+  char* user_id;
+  char* hub_addr;
+  uint16_t* out_hub_id;
+  char* out_result_msg;
+};
+
+struct add_sensor_job_t {
+  NetworkRequests* self;
+  char* sensor_addr;
+  sensor_details_t* sensor_details;
+  uint8_t door_column;
+  uint8_t door_row;
+  char* out_result_msg;
+};
+
+int NetworkRequests::login_job(void* user_data) {
+  login_job_t* job = (login_job_t*)user_data;
+  return job->self->run_login(job->user_id, job->hub_addr, job->out_hub_id, job->out_result_msg);
+}
+
+int NetworkRequests::add_sensor_job(void* user_data) {
+  add_sensor_job_t* job = (add_sensor_job_t*)user_data;
+  return job->self->run_add_sensor(job->sensor_addr, job->sensor_details, job->door_column, job->door_row,
+    job->out_result_msg);
+}
+
 void NetworkRequests::init(Network* network_ptr) {
   network = network_ptr;
 }
 
 int NetworkRequests::handle_get_token_and_hub_id(char* user_id, char* hub_addr, uint16_t* out_hub_id, char* out_result_msg) {
+  login_job_t job = { this, user_id, hub_addr, out_hub_id, out_result_msg };
+  return modem_arbiter_run(ModemJobPriority::PROVISIONING, "login", login_job, &job) ? -1 : 0;
+}
+
+int NetworkRequests::run_login(char* user_id, char* hub_addr, uint16_t* out_hub_id, char* out_result_msg) {
   printk("Preparing to login as Hub....\n");
   int ret = -1;
-  if (network->set_power_on_and_wait_for_reg()) {
-    size_t len = 200 + strlen(user_id) + strlen(hub_addr) + strlen(network->device_imei);
-    char mutation[len];
-    snprintk(mutation, len, "{\\\"query\\\":\\\"mutation loginAndFetchHub{loginAndFetchHub(userId:%s,serial:\\\\\"%s\\\\\",imei:\\\\\"%s\\\\\",version:\\\\\"%s\\\\\"){hub{id},token}}\\\",\\\"variables\\\":{}}", user_id, hub_addr, network->device_imei, VERSION);
-    cJSON* doc = network->send_request(mutation, out_result_msg);
-    cJSON* resp = cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "loginAndFetchHub");
-    cJSON* token = cJSON_GetObjectItem(resp, "token");
-    cJSON* id = cJSON_GetObjectItem(cJSON_GetObjectItem(resp, "hub"), "id");
-    if (token) {
-      const char* token_str = (const char*)(token->valuestring);
-      printk("loginAsHub token is: %s\nAnd strlen: %u\n", token_str, strlen(token_str));
-      network->set_access_token(token_str);
+  if (modem_power_acquire()) {
+    // userId is sent as an Int
+    Graphql::Request request(GRAPHQL_TEXT("mutation loginAndFetchHub{loginAndFetchHub(userId:"),
+      Graphql::Uint<uint32_t>{(uint32_t)strtoul(user_id, NULL, 10)},
+      GRAPHQL_TEXT(",serial:"), Graphql::Str<OUTBOX_SERIAL_LEN - 1>{hub_addr},
+      GRAPHQL_TEXT(",imei:"), Graphql::Str<IMEI_LEN - 1>{network->device_imei},
+      GRAPHQL_TEXT(",version:\"" VERSION "\"){hub{id},token}}"));
+    login_result_t result = {};
+    network->send_request(request, parse_login, &result, out_result_msg);
+    if (result.has_token) {
+      printk("loginAsHub token is: %s\nAnd strlen: %u\n", result.token, strlen(result.token));
+      network->set_access_token(result.token);
       // TODO check if token is different from existing token in flash storage, if so replace it
       ret = 0;
     } else {
       printk("doc->token not valid\n");
     }
-    if(id) {
-      const uint16_t id_int = (const uint16_t)(id->valueint);
+    if (result.has_hub_id) {
+      const uint16_t id_int = (const uint16_t)result.hub_id;
       printk("loginAndFetchHub hub->id: %u\n", id_int);
       *out_hub_id = id_int;
       ret = 0;
     } else {
       printk("doc->hub->id not\n");
     }
-    cJSON_Delete(doc);
+    // The modem is up anyway, send whatever is waiting along with it
+    if (outbox_pending()) outbox_flush();
   } else {
     printk("Unable to get network connection\n");
   }
-  network->set_power(false);
+  modem_power_release();
   return ret;
 }
 
-int NetworkRequests::handle_send_event(char* sensor_addr, sensor_details_t* sensor_details) {
-  printk("Preparing to send event...\n");
-  int ret = -1;
-  if (network->set_power_on_and_wait_for_reg()) {
-    size_t len = 160 + strlen(sensor_addr);
-    char mutation[len];
-    snprintk(mutation, len, "{\\\"query\\\":\\\"mutation CreateEvent{createEvent(serial:\\\\\"%s\\\\\",batteryLevel:%u,batteryVolts:%u,version:\\\\\"%s\\\\\"){ id }}\\\",\\\"variables\\\":{}}", sensor_addr, sensor_details->battery_level, sensor_details->battery_volts, sensor_details->firmware_version);
-    cJSON* doc = network->send_request(mutation);
-    cJSON* id = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "createEvent"), "id");
-    if (id) {
-      const uint16_t id_int = (const uint16_t)(id->valueint);
-      printk("created event id: %u for sensor: %s\n", id_int, sensor_addr);
-      ret = 0;
-    } else {
-      printk("doc->id not valid\n");
-    }
-    cJSON_Delete(doc);
-  } else {
-    printk("Unable to get network connection\n");
-  }
-  network->set_power(false);
-  return ret;
+int NetworkRequests::handle_send_event(char* sensor_addr, sensor_details_t* sensor_details, outbox_done_cb_t on_done) {
+  printk("Queueing event...\n");
+  outbox_record_t record = {};
+  record.kind = OutboxKind::EVENT;
+  strncpy(record.event.serial, sensor_addr, sizeof(record.event.serial) - 1);
+  record.event.battery_level = sensor_details->battery_level;
+  record.event.battery_volts = sensor_details->battery_volts;
+  strncpy(record.event.firmware_version, sensor_details->firmware_version, sizeof(record.event.firmware_version) - 1);
+  return outbox_add(&record, on_done) ? -1 : 0;
 }
 
 int NetworkRequests::handle_add_new_sensor(char* sensor_addr, sensor_details_t* sensor_details, uint8_t door_column, uint8_t door_row, char* out_result_msg) {
+  add_sensor_job_t job = { this, sensor_addr, sensor_details, door_column, door_row, out_result_msg };
+  return modem_arbiter_run(ModemJobPriority::PROVISIONING, "add sensor", add_sensor_job, &job) ? -1 : 0;
+}
+
+int NetworkRequests::run_add_sensor(char* sensor_addr, sensor_details_t* sensor_details, uint8_t door_column, uint8_t door_row, char* out_result_msg) {
   printk("Preparing to add new sensor....\n");
   int ret = -1;
-  if (network->set_power_on_and_wait_for_reg()) {
-    size_t len = 190 + strlen(sensor_addr);
-    char mutation[len];
-    snprintk(mutation, len, "{\\\"query\\\":\\\"mutation CreateSensor{createSensor(doorColumn:%u,doorRow:%u,serial:\\\\\"%s\\\\\",batteryLevel:%u,batteryVolts:%u,version:\\\\\"%s\\\\\"){id}}\\\",\\\"variables\\\":{}}", door_column, door_row, sensor_addr, sensor_details->battery_level, sensor_details->battery_volts, sensor_details->firmware_version);
-    cJSON* doc = network->send_request(mutation, out_result_msg);
-    cJSON* id = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "createSensor"), "id");
-    if (id) {
-      const uint16_t id_int = (const uint16_t)(id->valueint);
-      printk("createSensor id: %u\nSensor addr: %s\n", id_int, sensor_addr);
+  if (modem_power_acquire()) {
+    Graphql::Request request(GRAPHQL_TEXT("mutation CreateSensor{createSensor(doorColumn:"),
+      Graphql::Uint<uint8_t>{door_column}, GRAPHQL_TEXT(",doorRow:"), Graphql::Uint<uint8_t>{door_row},
+      GRAPHQL_TEXT(",serial:"), Graphql::Str<OUTBOX_SERIAL_LEN - 1>{sensor_addr},
+      GRAPHQL_TEXT(",batteryLevel:"), Graphql::Uint<uint8_t>{sensor_details->battery_level},
+      GRAPHQL_TEXT(",batteryVolts:"), Graphql::Uint<uint16_t>{sensor_details->battery_volts},
+      GRAPHQL_TEXT(",version:"), Graphql::Str<sizeof(sensor_details->firmware_version) - 1>{sensor_details->firmware_version},
+      GRAPHQL_TEXT("){id}}"));
+    int32_t id = -1;
+    network->send_request(request, parse_sensor_id, &id, out_result_msg);
+    if (id >= 0) {
+      printk("createSensor id: %u\nSensor addr: %s\n", (uint16_t)id, sensor_addr);
       ret = 0;
     } else {
       printk("doc->id not valid\n");
     }
-    cJSON_Delete(doc);
+    // The modem is up anyway, send whatever is waiting along with it
+    if (outbox_pending()) outbox_flush();
   } else {
     printk("Unable to get network connection\n");
   }
-  network->set_power(false);
+  modem_power_release();
   return ret;
 }
 
 int NetworkRequests::handle_update_battery_level(int real_mV, uint8_t percent) {
-  printk("Preparing to update battery level...\n");
-  int ret = -1;
-  if (network->set_power_on_and_wait_for_reg()) {
-    size_t len = 150;
-    char mutation[len];
-    snprintk(mutation, len, "{\\\"query\\\":\\\"mutation UpdateHubBatteryLevel{updateHubBatteryLevel(volts:%.5f,percent:%d,version:\\\\\"%s\\\\\"){id}}\\\",\\\"variables\\\":{}}", (float)real_mV / 1000.0, percent, VERSION);
-    cJSON* doc = network->send_request(mutation);
-    cJSON* id = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "updateHubBatteryLevel"), "id");
-    if (id) {
-      const uint16_t id_int = (const uint16_t)(id->valueint);
-      printk("updateHubBatteryLevel hub id: %u\n", id_int);
-      ret = 0;
-    } else {
-      printk("doc->id not valid\n");
-    }
-    cJSON_Delete(doc);
-  } else {
-    printk("Unable to get network connection\n");
-  }
-  network->set_power(false);
-  return ret;
+  printk("Queueing battery level update...\n");
+  outbox_record_t record = {};
+  record.kind = OutboxKind::BATTERY;
+  record.battery.real_mV = real_mV;
+  record.battery.percent = percent;
+  return outbox_add(&record) ? -1 : 0;
 }
 
 int NetworkRequests::handle_update_gps_loc(float lat, float lng, float hdop, float speed, float course, int real_mV, uint8_t percent) {
-  printk("Preparing to update gps location...\n");
-  int ret = -1;
-  if (network->set_power_on_and_wait_for_reg()) {
-    size_t len = 230;
-    char mutation[len];
-    snprintk(mutation, len, "{\\\"query\\\":\\\"mutation CreateLocation{createLocation(lat:%.5f,lng:%.5f,hdop:%.2f,speed:%.2f,course:%.2f,age:0){ id },updateHubBatteryLevel(volts:%.5f,percent:%d,version:\\\\\"%s\\\\\"){id}}\\\",\\\"variables\\\":{}}", lat, lng, hdop, speed, course, (float)real_mV / 1000.0, percent, VERSION);
-    cJSON* doc = network->send_request(mutation);
-    cJSON* id = cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(doc, "data"), "createLocation"), "id");
-    if (id) {
-      const uint16_t id_int = (const uint16_t)(id->valueint);
-      printk("createLocation id: %u\n", id_int);
-      ret = 0;
-    } else {
-      printk("doc->id not valid\n");
-    }
-    cJSON_Delete(doc);
-  } else {
-    printk("Unable to get network connection\n");
-  }
-  network->set_power(false);
-  return ret;
+  printk("Queueing gps location update...\n");
+  outbox_record_t record = {};
+  record.kind = OutboxKind::LOCATION;
+  record.location.lat = lat;
+  record.location.lng = lng;
+  record.location.hdop = hdop;
+  record.location.speed = speed;
+  record.location.course = course;
+  if (outbox_add(&record)) return -1;
+  return handle_update_battery_level(real_mV, percent);
 }
@@ -2,6 +2,7 @@
 #define HUB_NETWORK_REQUESTS_H
 
 #include "network.h"
+#include "outbox.h"
 
 struct sensor_details_t {
   uint8_t battery_level;
@@ -14,6 +15,12 @@ class NetworkRequests
 private:
   Network* network;
 
+  // Bodies of the handlers below that need the modem, run as modem arbiter jobs
+  int run_login(char* user_id, char* hub_addr, uint16_t* out_hub_id, char* out_result_msg);
+  int run_add_sensor(char* sensor_addr, sensor_details_t* sensor_details, uint8_t door_column, uint8_t door_row, char* out_result_msg);
+  static int login_job(void* user_data);
+  static int add_sensor_job(void* user_data);
+
 public:
 
   /**
@@ -23,7 +30,8 @@ public:
   void init(Network* network);
 
   /**
-   * @brief Callback for when a phone is trying to register this hub
+   * @brief Callback for when a phone is trying to register this hub, blocks while it
+   * waits for the modem as a provisioning job
   * @param user_id the user id sent from the phone during connection
   * @param hub_addr the MAC of the hub to be used by the phone to find the hub
   * @param out_hub_id a pointer to the location to store the hub_id on success
@@ -32,15 +40,18 @@ public:
   */
   int handle_get_token_and_hub_id(char* user_id, char* hub_addr, uint16_t* out_hub_id, char* out_result_msg);
   /**
-   * @brief Callback for when an event should be sent
+   * @brief Callback for when an event should be sent, queues it in the outbox and returns
+   * right away, the upload happens in the background
    * @param sensor_addr MAC address of sensor responsible for event
    * @param sensor_details the details of the sensor responsible for the event
-   * @return 0 on success, -1 if failed to send
+   * @param on_done Optional, called once the event was sent or dropped
+   * @return 0 on success, -1 if the outbox is full
    */
-  int handle_send_event(char* sensor_addr, sensor_details_t* sensor_details);
+  int handle_send_event(char* sensor_addr, sensor_details_t* sensor_details, outbox_done_cb_t on_done = nullptr);
 
   /**
-   * @brief Callback for adding new sensor
+   * @brief Callback for adding new sensor, blocks while it waits for the modem as a
+   * provisioning job
    * @param sensor_addr MAC address of sensor to add
    * @param sensor_details the details of the sensor to add
    * @param door_column the column of the door the sensor is on
@@ -51,15 +62,16 @@ public:
   int handle_add_new_sensor(char* sensor_addr, sensor_details_t* sensor_details, uint8_t door_column, uint8_t door_row, char* out_result_msg);
 
   /**
-   * @brief Callback for notifying the server of the current battery level
+   * @brief Callback for notifying the server of the current battery level, queues it in the outbox
    * @param real_mV the millivolts of the battery (double the measured millivolts)
    * @param percent the estimated percentage remaining (0 - 100)
-   * @return 0 on success, -1 if failed to send
+   * @return 0 on success, -1 if the outbox is full
    */
   int handle_update_battery_level(int real_mV, uint8_t percent);
 
   /**
-   * @brief Callback for notifying the server of the current gps location data
+   * @brief Callback for notifying the server of the current gps location data,
+   * queues it in the outbox along with the battery level
    * @param lat Latitude as 45.1234
    * @param lng Longitude as 105.1234
    * @param hdop Horizontal Dilution of Precision as [0,99.9]
@@ -67,7 +79,7 @@ public:
    * @param course Course Over Ground as [0,360.00]
    * @param real_mV the millivolts of the battery (double the measured millivolts)
    * @param percent the estimated percentage remaining (0 - 100)
-   * @return 0 on success, -1 if failed to send
+   * @return 0 on success, -1 if the outbox is full
    */
   int handle_update_gps_loc(float lat, float lng, float hdop, float speed, float course, int real_mV, uint8_t percent);
 };
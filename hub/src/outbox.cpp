@@ -0,0 +1,451 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <errno.h>
+#include <string.h>
+
+#include "outbox.h"
+#include "outbox_store.h"
+#include "graphql.h"
+#include "modem_power.h"
+#include "modem_arbiter.h"
+#include "modem_stats.h"
+#include "version.h"
+#include "json_path.h"
+
+// Matches AT+SHCONF="BODYLEN"
+#define BODY_SIZE             1024
+
+
+static Network* network;
+
+/* FIFO of pending records, only flushes remove them, from the head */
+static struct outbox_record_t records[CONFIG_HUB_OUTBOX_SIZE];
+// Completion callbacks by slot, kept out of the records since those go to flash
+static struct {
+  outbox_done_cb_t fn;
+  void* user_data;
+} callbacks[CONFIG_HUB_OUTBOX_SIZE];
+// Sent but still behind an unsent record, skipped by batches and popped once it reaches the head
+static bool delivered[CONFIG_HUB_OUTBOX_SIZE];
+static uint8_t records_head;
+static uint8_t records_len;
+static uint32_t next_seq;
+// Flushes in a row that failed, sets the retry backoff
+static uint8_t retry_failures;
+static K_MUTEX_DEFINE(records_lock);
+// Flushes only run as this job, so records sent by one aren't sent again by another
+static struct modem_job_t flush_job;
+
+// Escaping makes the AT+SHBOD command longer than the body it sends
+static Graphql::Buffer<2 * BODY_SIZE> body;
+#ifdef CONFIG_HUB_MODEM_STATS_UPLOAD
+static char stats_text[MODEM_STATS_FORMAT_MAX];
+#endif
+
+static struct k_work_delayable flush_work;
+static struct k_work_q outbox_work_q;
+K_THREAD_STACK_DEFINE(outbox_stack_area, 4096);
+const k_work_queue_config outbox_work_q_config = {
+  .name = "outbox_work_q",
+};
+
+#define SLOT(i)               ((records_head + (i)) % CONFIG_HUB_OUTBOX_SIZE)
+
+/*
+ * @return Seconds since record was captured, using network time if it was known then
+ * and is now, as records reloaded after a reboot only have that
+ */
+static int64_t record_age(const outbox_record_t* record) {
+  int64_t now_epoch = network->epoch_time();
+  if (record->capture_epoch && now_epoch) return MAX(now_epoch - record->capture_epoch, 0);
+  if (record->capture_time) return (k_uptime_get() - record->capture_time) / 1000;
+  return 0;
+}
+
+/*
+ * Saves every pending record that isn't in flash yet so a reboot while offline
+ * doesn't lose them. Must be called with records_lock held.
+ */
+static void persist_pending(void) {
+  for (uint8_t i = 0; i < records_len; i++) {
+    outbox_record_t* record = &records[SLOT(i)];
+    if (record->persisted || delivered[SLOT(i)]) continue;
+    record->persisted = true;
+    int err = outbox_store_write(SLOT(i), record, sizeof(*record));
+    if (err) {
+      record->persisted = false;
+      // Out of budget or no storage, the rest wouldn't fit either
+      if (err != -ENOTSUP) printk("Outbox unable to save record (err %d)\n", err);
+      break;
+    }
+  }
+}
+
+/*
+ * Removes the oldest record, and its copy in flash, and reports result to its callback.
+ * Must be called with records_lock held.
+ */
+static void pop_record(int result) {
+  if (callbacks[records_head].fn) {
+    callbacks[records_head].fn(&records[records_head], result, callbacks[records_head].user_data);
+    callbacks[records_head].fn = NULL;
+  }
+  if (records[records_head].persisted) outbox_store_delete(records_head);
+  delivered[records_head] = false;
+  records_head = SLOT(1);
+  records_len--;
+}
+
+/*
+ * Reports the record i from the head as delivered and forgets its copy in flash, so it
+ * isn't sent again even if a reboot comes before it can be popped. Must be called with records_lock held.
+ */
+static void deliver_record(uint8_t i) {
+  uint8_t slot = SLOT(i);
+  if (callbacks[slot].fn) {
+    callbacks[slot].fn(&records[slot], 0, callbacks[slot].user_data);
+    callbacks[slot].fn = NULL;
+  }
+  if (records[slot].persisted) {
+    outbox_store_delete(slot);
+    records[slot].persisted = false;
+  }
+  delivered[slot] = true;
+}
+
+// First letter of the alias append_mutation gives a record of kind
+static char alias_letter(OutboxKind kind) {
+  switch (kind) {
+  case OutboxKind::EVENT: return 'e';
+  case OutboxKind::BATTERY: return 'b';
+  default: return 'l';
+  }
+}
+
+/*
+ * Appends record as a mutation aliased by its index, e.g. e0:createEvent(...){id}
+ * @return False if it didn't fit, body is left as it was
+ */
+static bool append_mutation(const outbox_record_t* record, uint8_t idx) {
+  size_t mark = body.mark();
+  if (idx > 0) body.append(GRAPHQL_TEXT(","));
+  switch (record->kind) {
+  case OutboxKind::EVENT:
+    body.append(GRAPHQL_TEXT("e"));
+    body.append(Graphql::Uint<uint8_t>{idx});
+    body.append(GRAPHQL_TEXT(":createEvent(serial:"));
+    body.append(Graphql::Str<OUTBOX_SERIAL_LEN - 1>{record->event.serial});
+    body.append(GRAPHQL_TEXT(",batteryLevel:"));
+    body.append(Graphql::Uint<uint8_t>{record->event.battery_level});
+    body.append(GRAPHQL_TEXT(",batteryVolts:"));
+    body.append(Graphql::Uint<uint16_t>{record->event.battery_volts});
+    body.append(GRAPHQL_TEXT(",version:"));
+    body.append(Graphql::Str<sizeof(record->event.firmware_version) - 1>{record->event.firmware_version});
+    body.append(GRAPHQL_TEXT("){id}"));
+    break;
+  case OutboxKind::BATTERY:
+    body.append(GRAPHQL_TEXT("b"));
+    body.append(Graphql::Uint<uint8_t>{idx});
+    body.append(GRAPHQL_TEXT(":updateHubBatteryLevel(volts:"));
+    body.append(Graphql::Fixed<2, 5>{(float)record->battery.real_mV / 1000.0f});
+    body.append(GRAPHQL_TEXT(",percent:"));
+    body.append(Graphql::Uint<uint8_t>{record->battery.percent});
+#ifdef CONFIG_HUB_MODEM_STATS_UPLOAD
+    // Current at the time of sending rather than capture, the server keeps the latest
+    if (modem_stats_format(stats_text, sizeof(stats_text)) > 0) {
+      body.append(GRAPHQL_TEXT(",modemLatency:"));
+      body.append(Graphql::Str<MODEM_STATS_FORMAT_MAX - 1>{stats_text});
+    }
+#endif
+    body.append(GRAPHQL_TEXT(",version:\"" VERSION "\"){id}"));
+    break;
+  case OutboxKind::LOCATION:
+    body.append(GRAPHQL_TEXT("l"));
+    body.append(Graphql::Uint<uint8_t>{idx});
+    body.append(GRAPHQL_TEXT(":createLocation(lat:"));
+    body.append(Graphql::Fixed<3, 5>{record->location.lat});
+    body.append(GRAPHQL_TEXT(",lng:"));
+    body.append(Graphql::Fixed<3, 5>{record->location.lng});
+    body.append(GRAPHQL_TEXT(",hdop:"));
+    body.append(Graphql::Fixed<3, 2>{record->location.hdop});
+    body.append(GRAPHQL_TEXT(",speed:"));
+    body.append(Graphql::Fixed<4, 2>{record->location.speed});
+    body.append(GRAPHQL_TEXT(",course:"));
+    body.append(Graphql::Fixed<3, 2>{record->location.course});
+    // age is how long ago the fix was taken in seconds
+    body.append(GRAPHQL_TEXT(",age:"));
+    body.append(Graphql::Int<int64_t>{record_age(record)});
+    body.append(GRAPHQL_TEXT("){id}"));
+    break;
+  }
+  // Leave room for closing the document
+  if (!body.ok() || body.sent_length() + 1 + Graphql::BODY_END_SENT > BODY_SIZE) {
+    body.rewind(mark);
+    return false;
+  }
+  return true;
+}
+
+/* Records sent together in one request */
+struct batch_t {
+  uint8_t n;
+  // Index of each alias' record from the head, delivered records in between are skipped
+  uint8_t index[CONFIG_HUB_OUTBOX_BATCH_MAX];
+  OutboxKind kind[CONFIG_HUB_OUTBOX_BATCH_MAX];
+  // Set from the response, a mutation that failed is null in "data" with its error in "errors"
+  bool accepted[CONFIG_HUB_OUTBOX_BATCH_MAX];
+};
+
+static void read_batch_results(const char* json, size_t len, void* user_data) {
+  struct batch_t* batch = (struct batch_t*)user_data;
+  struct json_value_t value;
+  char path[12];
+  for (uint8_t i = 0; i < batch->n; i++) {
+    snprintk(path, sizeof(path), "data.%c%u", alias_letter(batch->kind[i]), i);
+    batch->accepted[i] = json_path_find(json, len, path, &value) == 0 && *value.start == '{';
+  }
+}
+
+/*
+ * Removes the records of batch the server accepted. If any weren't, saves everything
+ * pending to flash, and if the modem got as far as sending counts a failed attempt against
+ * each of them and drops the records that ran out of attempts. Being out of coverage
+ * doesn't count, so those records wait for as long as it takes.
+ * @return True if every record was accepted
+ */
+static bool finish_batch(const struct batch_t* batch, bool attempted) {
+  bool all_accepted = true;
+  k_mutex_lock(&records_lock, K_FOREVER);
+  for (uint8_t i = 0; i < batch->n; i++) {
+    if (batch->accepted[i]) {
+      deliver_record(batch->index[i]);
+    } else {
+      all_accepted = false;
+      if (attempted) records[SLOT(batch->index[i])].attempts++;
+    }
+  }
+  while (records_len > 0) {
+    if (delivered[records_head]) {
+      pop_record(0);
+    } else if (records[records_head].attempts >= CONFIG_HUB_OUTBOX_MAX_ATTEMPTS) {
+      printk("Outbox dropping record of kind %u after %u attempts\n",
+        (uint8_t)records[records_head].kind, records[records_head].attempts);
+      pop_record(-ETIMEDOUT);
+    } else {
+      break;
+    }
+  }
+  if (!all_accepted) persist_pending();
+  k_mutex_unlock(&records_lock);
+  return all_accepted;
+}
+
+/*
+ * Sends the oldest records that fit in one request as aliased mutations, the ones
+ * the server accepted are removed even if others in the batch failed
+ * @return 0 if all of them were accepted by the server, -ENETUNREACH if the modem couldn't
+ * register, -EIO if the request or some of the mutations failed
+ */
+static int send_batch(void) {
+  struct batch_t batch = {};
+  bool unsendable = false;
+  uint8_t total;
+  body.begin();
+  body.append(GRAPHQL_TEXT("mutation Outbox{"));
+
+  k_mutex_lock(&records_lock, K_FOREVER);
+  for (uint8_t i = 0; i < records_len && batch.n < CONFIG_HUB_OUTBOX_BATCH_MAX; i++) {
+    if (delivered[SLOT(i)]) continue;
+    if (!append_mutation(&records[SLOT(i)], batch.n)) {
+      unsendable = batch.n == 0;
+      break;
+    }
+    batch.index[batch.n] = i;
+    batch.kind[batch.n] = records[SLOT(i)].kind;
+    batch.n++;
+  }
+  total = records_len;
+  k_mutex_unlock(&records_lock);
+  if (unsendable) {
+    // Would block the whole outbox otherwise, the head is never a delivered record
+    printk("Outbox record too large to send, dropping it\n");
+    k_mutex_lock(&records_lock, K_FOREVER);
+    pop_record(-E2BIG);
+    k_mutex_unlock(&records_lock);
+  }
+  if (batch.n == 0) return 0;
+  body.append(GRAPHQL_TEXT("}"));
+  body.end();
+
+  printk("Outbox sending %u of %u record(s)\n", batch.n, total);
+  bool registered = modem_power_acquire();
+  if (registered) {
+    network->send_request(body, read_batch_results, &batch, nullptr, true);
+  }
+  modem_power_release();
+
+  if (finish_batch(&batch, registered)) return 0;
+  return registered ? -EIO : -ENETUNREACH;
+}
+
+/*
+ * @return True if a door event is waiting, the flush then goes ahead of background modem jobs
+ */
+static bool has_events(void) {
+  bool found = false;
+  k_mutex_lock(&records_lock, K_FOREVER);
+  for (uint8_t i = 0; i < records_len && !found; i++) {
+    found = records[SLOT(i)].kind == OutboxKind::EVENT && !delivered[SLOT(i)];
+  }
+  k_mutex_unlock(&records_lock);
+  return found;
+}
+
+static int flush_job_fn(void* user_data) {
+  int ret = 0;
+  while (outbox_pending() > 0) {
+    // Stop between batches, the rest goes once e.g. a sensor was added
+    if (modem_arbiter_should_yield()) {
+      ret = -EAGAIN;
+      break;
+    }
+    if (send_batch() != 0) {
+      ret = -EIO;
+      break;
+    }
+  }
+  if (ret == 0) retry_failures = 0;
+  return ret;
+}
+
+static void outbox_flush_work(struct k_work* work_item) {
+  int err = outbox_flush();
+  if (err == -EAGAIN) {
+    // Not a failure, queue up again behind the more urgent job
+    k_work_schedule_for_queue(&outbox_work_q, &flush_work, K_NO_WAIT);
+  } else if (err != 0) {
+    // Doubles with every failure so a long outage doesn't keep waking the modem
+    int64_t delay_s = MIN((int64_t)CONFIG_HUB_OUTBOX_RETRY_MIN_S << MIN(retry_failures, 16),
+      CONFIG_HUB_OUTBOX_RETRY_MAX_S);
+    if (retry_failures < UINT8_MAX) retry_failures++;
+    printk("Outbox retrying %u record(s) in %llds\n", outbox_pending(), delay_s);
+    k_work_schedule_for_queue(&outbox_work_q, &flush_work, K_SECONDS(delay_s));
+  }
+}
+
+/*
+ * Moves the flush earlier if it isn't already scheduled within delay_ms
+ */
+static void schedule_flush(int64_t delay_ms) {
+  k_timeout_t delay = K_MSEC(delay_ms);
+  if (!k_work_delayable_is_pending(&flush_work) ||
+    k_work_delayable_remaining_get(&flush_work) > (k_ticks_t)delay.ticks) {
+    k_work_reschedule_for_queue(&outbox_work_q, &flush_work, delay);
+  }
+}
+
+/*
+ * Reloads the records saved before the last reboot in the order they were added.
+ * They are moved to the start of the FIFO, rewriting the ones whose slot changed.
+ */
+static void load_records(void) {
+  outbox_record_t record;
+  uint8_t from[CONFIG_HUB_OUTBOX_SIZE];
+  bool stored[CONFIG_HUB_OUTBOX_SIZE];
+  uint8_t n = 0;
+
+  for (uint8_t slot = 0; slot < CONFIG_HUB_OUTBOX_SIZE; slot++) {
+    ssize_t len = outbox_store_read(slot, &record, sizeof(record));
+    stored[slot] = len > 0;
+    // Saved by a firmware with a different record layout
+    if (len != sizeof(record)) continue;
+    uint8_t i = n++;
+    while (i > 0 && records[i - 1].seq > record.seq) {
+      records[i] = records[i - 1];
+      from[i] = from[i - 1];
+      i--;
+    }
+    records[i] = record;
+    from[i] = slot;
+  }
+
+  for (uint8_t i = 0; i < n; i++) {
+    // Uptime restarted, the age now comes from capture_epoch if there is one
+    records[i].capture_time = 0;
+    if (from[i] == i) continue;
+    records[i].persisted = outbox_store_write(i, &records[i], sizeof(records[i])) == 0;
+    stored[i] = true;
+  }
+  for (uint8_t slot = n; slot < CONFIG_HUB_OUTBOX_SIZE; slot++) {
+    if (stored[slot]) outbox_store_delete(slot);
+  }
+
+  records_head = 0;
+  records_len = n;
+  if (n > 0) {
+    next_seq = records[n - 1].seq + 1;
+    printk("\tOutbox reloaded %u unsent record(s)\n", n);
+  }
+}
+
+void outbox_init(Network* net) {
+  network = net;
+  if (outbox_store_init() == 0) load_records();
+  k_work_queue_start(&outbox_work_q, outbox_stack_area,
+    K_THREAD_STACK_SIZEOF(outbox_stack_area),
+    CONFIG_SYSTEM_WORKQUEUE_PRIORITY + 1, &outbox_work_q_config);
+  k_work_init_delayable(&flush_work, outbox_flush_work);
+  modem_job_init(&flush_job, "outbox", ModemJobPriority::BACKGROUND, flush_job_fn, NULL);
+  if (records_len > 0) schedule_flush(CONFIG_HUB_OUTBOX_RETRY_MIN_S * 1000LL);
+}
+
+int outbox_add(const outbox_record_t* record, outbox_done_cb_t on_done, void* user_data) {
+  k_mutex_lock(&records_lock, K_FOREVER);
+  if (records_len == CONFIG_HUB_OUTBOX_SIZE) {
+    k_mutex_unlock(&records_lock);
+    printk("Outbox full, dropping record of kind %u\n", (uint8_t)record->kind);
+    return -ENOMEM;
+  }
+  callbacks[SLOT(records_len)].fn = on_done;
+  callbacks[SLOT(records_len)].user_data = user_data;
+  outbox_record_t* slot = &records[SLOT(records_len)];
+  *slot = *record;
+  slot->attempts = 0;
+  slot->persisted = false;
+  slot->seq = next_seq++;
+  if (!slot->capture_time) slot->capture_time = k_uptime_get();
+  if (!slot->capture_epoch) slot->capture_epoch = network->epoch_time();
+  records_len++;
+  bool backing_off = retry_failures > 0;
+  // Still offline as far as we know, keep it safe until the retry gets through
+  if (backing_off) persist_pending();
+  k_mutex_unlock(&records_lock);
+
+  // A flush already waiting for the modem behind background work takes the event along
+  if (record->kind == OutboxKind::EVENT) modem_arbiter_raise(&flush_job, ModemJobPriority::EVENT);
+
+  // Sending is cheap while registered, otherwise wait for more records to share the wake up
+  int64_t delay_ms;
+  if (modem_power_state() >= ModemPowerState::SLEEP) delay_ms = 0;
+  // The pending retry sends it, don't wake the modem any sooner
+  else if (backing_off) return 0;
+  else if (record->kind == OutboxKind::EVENT) delay_ms = CONFIG_HUB_OUTBOX_EVENT_DELAY_MS;
+  else delay_ms = CONFIG_HUB_OUTBOX_MAX_DELAY_S * 1000LL;
+  schedule_flush(delay_ms);
+  return 0;
+}
+
+int outbox_flush(void) {
+  // Piggybacking from another job, which already has the modem
+  if (modem_arbiter_is_owner()) return flush_job_fn(NULL);
+  // Only the outbox work queue submits the job, it can't be queued at this point
+  flush_job.priority = has_events() ? ModemJobPriority::EVENT : ModemJobPriority::BACKGROUND;
+  return modem_arbiter_run_job(&flush_job);
+}
+
+uint8_t outbox_pending(void) {
+  k_mutex_lock(&records_lock, K_FOREVER);
+  uint8_t len = records_len;
+  k_mutex_unlock(&records_lock);
+  return len;
+}
@@ -0,0 +1,102 @@
+#ifndef HUB_OUTBOX_H
+#define HUB_OUTBOX_H
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Bytes of a sensor MAC address string including the terminator
+#define OUTBOX_SERIAL_LEN     18
+
+enum class OutboxKind : uint8_t {
+  EVENT,
+  BATTERY,
+  LOCATION,
+};
+
+/**
+ * A single upload waiting to be sent, fixed size so it can be copied around freely
+ * and saved to flash as is
+ */
+struct outbox_record_t {
+  OutboxKind kind;
+  // Number of flushes that reached the modem with this record and failed
+  uint8_t attempts;
+  // Whether a copy is saved in the outbox_storage partition
+  bool persisted;
+  // Order records were added in, keeps the FIFO order across reboots
+  uint32_t seq;
+  // k_uptime_get when the data was captured, 0 if captured before the last reboot
+  int64_t capture_time;
+  // Seconds since the unix epoch when the data was captured, 0 if the time wasn't known
+  int64_t capture_epoch;
+  union {
+    struct {
+      char serial[OUTBOX_SERIAL_LEN];
+      uint8_t battery_level;
+      uint16_t battery_volts;
+      char firmware_version[10];
+    } event;
+    struct {
+      int real_mV;
+      uint8_t percent;
+    } battery;
+    struct {
+      float lat;
+      float lng;
+      float hdop;
+      float speed;
+      float course;
+    } location;
+  };
+};
+
+/**
+ * Called once a record left the outbox, from the modem arbiter thread with the outbox
+ * locked so it mustn't call outbox functions
+ * @param result 0 if it was sent, -ETIMEDOUT if it ran out of attempts, -E2BIG if it
+ * could never fit in a request
+ */
+typedef void (*outbox_done_cb_t)(const outbox_record_t* record, int result, void* user_data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * @brief Setup pointers needed for network requests, reload records left unsent
+   * before the last reboot and start the flush work queue
+   * @param net Pointer to network instance
+   */
+  void outbox_init(Network* net);
+
+  /**
+   * @brief Queues a record to be sent with the next flush. The flush happens once the
+   * record's kind reaches its deadline, or right away if the modem is already registered
+   * @param record the record to copy into the outbox, capture_time and capture_epoch are set if 0
+   * @param on_done Optional, called once the record was sent or dropped. Not called for
+   * records reloaded after a reboot
+   * @param user_data Passed to on_done
+   * @return 0 on success, -ENOMEM if the outbox is full
+   */
+  int outbox_add(const outbox_record_t* record, outbox_done_cb_t on_done = nullptr, void* user_data = nullptr);
+
+  /**
+   * @brief Sends everything pending in batches of aliased mutations, blocking until done.
+   * Runs as a modem job, an event one if any door events are pending. Meant for
+   * piggybacking on a modem that is already up for another job
+   * @return 0 if the outbox is empty afterwards, -EAGAIN if it stopped early for a more
+   * urgent modem job, -EIO otherwise
+   */
+  int outbox_flush(void);
+
+  /**
+   * @return Number of records waiting to be sent
+   */
+  uint8_t outbox_pending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
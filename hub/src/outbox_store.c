@@ -0,0 +1,90 @@
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/sys/printk.h>
+#include <pm_config.h>
+#include <errno.h>
+
+#include "outbox_store.h"
+
+// NVS ids 0 and 0xFFFF are avoided, slot n is saved under id n + 1
+#define SLOT_ID(slot)       ((uint16_t)(slot) + 1)
+// Window the flash write budget applies to
+#define BUDGET_WINDOW_MS    (24 * 60 * 60 * 1000LL)
+// Bytes NVS adds to every entry it writes (allocation table entry)
+#define NVS_ENTRY_OVERHEAD  8
+
+static struct nvs_fs fs;
+static bool mounted;
+
+/* bytes written during the current budget window */
+static int64_t budget_window_start;
+static uint32_t budget_used;
+static bool budget_warned;
+
+/*
+ * Charges len bytes against the daily budget so a long outage with lots of
+ * events can't wear out the partition
+ * @return False if the write has to be skipped
+ */
+static bool budget_take(size_t len) {
+  int64_t now = k_uptime_get();
+  if (now - budget_window_start > BUDGET_WINDOW_MS) {
+    budget_window_start = now;
+    budget_used = 0;
+    budget_warned = false;
+  }
+  if (budget_used + len > CONFIG_HUB_OUTBOX_FLASH_BUDGET) {
+    if (!budget_warned) printk("Outbox flash budget used up, keeping records in RAM only\n");
+    budget_warned = true;
+    return false;
+  }
+  budget_used += len;
+  return true;
+}
+
+int outbox_store_init(void) {
+  const struct flash_area* fa;
+  struct flash_pages_info info;
+  int rc = flash_area_open(PM_OUTBOX_STORAGE_ID, &fa);
+  if (rc) {
+    printk("Unable to open outbox_storage (err %d)\n", rc);
+    return rc;
+  }
+  fs.flash_device = flash_area_get_device(fa);
+  fs.offset = fa->fa_off;
+  rc = flash_get_page_info_by_offs(fs.flash_device, fs.offset, &info);
+  if (rc == 0) {
+    fs.sector_size = info.size;
+    fs.sector_count = fa->fa_size / info.size;
+    rc = nvs_mount(&fs);
+  }
+  flash_area_close(fa);
+  if (rc) {
+    printk("Unable to mount outbox_storage (err %d)\n", rc);
+    return rc;
+  }
+  mounted = true;
+  printk("\tOutbox storage ready, %u bytes free\n", nvs_calc_free_space(&fs));
+  return 0;
+}
+
+int outbox_store_write(uint8_t slot, const void* data, size_t len) {
+  if (!mounted) return -ENODEV;
+  if (!budget_take(len + NVS_ENTRY_OVERHEAD)) return -ENOSPC;
+  ssize_t rc = nvs_write(&fs, SLOT_ID(slot), data, len);
+  return rc < 0 ? rc : 0;
+}
+
+int outbox_store_delete(uint8_t slot) {
+  if (!mounted) return -ENODEV;
+  // A deletion is an entry of its own
+  budget_take(NVS_ENTRY_OVERHEAD);
+  return nvs_delete(&fs, SLOT_ID(slot));
+}
+
+ssize_t outbox_store_read(uint8_t slot, void* data, size_t len) {
+  if (!mounted) return -ENODEV;
+  return nvs_read(&fs, SLOT_ID(slot), data, len);
+}
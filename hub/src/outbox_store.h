@@ -0,0 +1,49 @@
+#ifndef HUB_OUTBOX_STORE_H
+#define HUB_OUTBOX_STORE_H
+
+#include <zephyr/kernel.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_HUB_OUTBOX_PERSIST
+  /**
+   * @brief Mounts NVS on the outbox_storage partition
+   * @return 0 on success, negative errno otherwise
+   */
+  int outbox_store_init(void);
+
+  /**
+   * @brief Saves the record held in an outbox slot
+   * @param slot index of the record in the outbox
+   * @param data the record to save
+   * @param len size of data
+   * @return 0 on success, -ENOSPC if the daily flash write budget is used up
+   */
+  int outbox_store_write(uint8_t slot, const void* data, size_t len);
+
+  /**
+   * @brief Removes the record saved for slot, if any
+   * @return 0 on success, negative errno otherwise
+   */
+  int outbox_store_delete(uint8_t slot);
+
+  /**
+   * @brief Reads the record saved for slot
+   * @return Number of bytes read, -ENOENT if nothing is saved for slot
+   */
+  ssize_t outbox_store_read(uint8_t slot, void* data, size_t len);
+#else
+  static inline int outbox_store_init(void) { return -ENOTSUP; }
+  static inline int outbox_store_write(uint8_t slot, const void* data, size_t len) { return -ENOTSUP; }
+  static inline int outbox_store_delete(uint8_t slot) { return -ENOTSUP; }
+  static inline ssize_t outbox_store_read(uint8_t slot, void* data, size_t len) { return -ENOENT; }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
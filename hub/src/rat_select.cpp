@@ -0,0 +1,194 @@
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/printk.h>
+#include <string.h>
+
+#include "rat_select.h"
+#include "battery.h"
+
+// A new timing weighs 1/4 against the average, so a mode recovers within a few requests
+#define EWMA_SHIFT        2
+// Added to the time a failed phase took, a failure costs at least as much as a retry later
+#define FAIL_PENALTY_MS   60000U
+// Timings recorded before the stats are saved again, each save is a flash write
+#define SAVE_EVERY        8
+// Failed attaches in a row after which another mode is tried no matter the averages
+#define MAX_FAILS_IN_ROW  2
+
+static const PreferredMode MODES[] = {
+  PreferredMode::AUTOMATIC,
+  PreferredMode::GSM,
+  PreferredMode::LTE,
+  PreferredMode::BOTH,
+};
+#define MODE_COUNT        ARRAY_SIZE(MODES)
+#define PHASE_COUNT       ((size_t)RatPhase::COUNT)
+
+static const char* const PHASE_NAMES[] = { "attach", "pdp", "tls", "request" };
+
+typedef struct {
+  // Average of each RatPhase in ms, 0 until it was timed in this mode
+  uint32_t avg_ms[PHASE_COUNT];
+  uint16_t samples;
+  // Attaches that failed since the last one that succeeded
+  uint8_t fails_in_row;
+} rat_mode_stats_t;
+
+typedef struct {
+  rat_mode_stats_t modes[MODE_COUNT];
+  // AT+CNMP value last set, 0 until the hub set one
+  uint8_t current;
+} rat_stats_t;
+
+static rat_stats_t stats;
+static rat_stats_t save_buf;
+static struct k_spinlock stats_lock;
+static uint8_t unsaved;
+static struct k_work save_work;
+
+static int mode_index(uint8_t mode) {
+  for (size_t i = 0; i < MODE_COUNT; i++) {
+    if ((uint8_t)MODES[i] == mode) return i;
+  }
+  return -1;
+}
+
+/*
+ * Expected ms from power on to a response in mode i. A phase not timed in this
+ * mode yet, e.g. after the diagnostic only attached in it, is taken as the
+ * slowest any mode needed so it can't look better than it is
+ */
+static uint32_t expected_cost(int i) {
+  uint32_t cost = 0;
+  for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+    uint32_t avg = stats.modes[i].avg_ms[phase];
+    if (!avg) {
+      for (size_t j = 0; j < MODE_COUNT; j++) avg = MAX(avg, stats.modes[j].avg_ms[phase]);
+    }
+    cost += avg;
+  }
+  return cost;
+}
+
+static int rat_settings_set(const char* name, size_t len, settings_read_cb read_cb, void* cb_arg)
+{
+  const char* next;
+  int rc;
+  if (settings_name_steq(name, "stats", &next) && !next) {
+    if (len != sizeof(stats)) {
+      printk("rat/stats size %d is not compatible with the application len %d\n", sizeof(stats), len);
+      return -EINVAL;
+    }
+    rc = read_cb(cb_arg, &stats, sizeof(stats));
+    if (rc >= 0) {
+      return 0;
+    }
+    return rc;
+  }
+  return -ENOENT;
+}
+
+static struct settings_handler rat_conf = {
+    .name = "rat",
+    .h_set = rat_settings_set,
+};
+
+static void save_stats_work(struct k_work* work_item) {
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  save_buf = stats;
+  k_spin_unlock(&stats_lock, key);
+  int ret = settings_save_one("rat/stats", &save_buf, sizeof(save_buf));
+  if (ret) printk("Saving RAT stats failed: %d\n", ret);
+}
+
+void rat_select_init(void) {
+  memset(&stats, 0, sizeof(stats));
+  k_work_init(&save_work, save_stats_work);
+  settings_register(&rat_conf);
+  settings_load_subtree("rat");
+  for (size_t i = 0; i < MODE_COUNT; i++) {
+    const rat_mode_stats_t* mode = &stats.modes[i];
+    if (!mode->samples) continue;
+    printk("\tRAT mode %u: attach %ums, pdp %ums, tls %ums, request %ums over %u timings\n",
+      (uint8_t)MODES[i], mode->avg_ms[0], mode->avg_ms[1], mode->avg_ms[2], mode->avg_ms[3], mode->samples);
+  }
+}
+
+void rat_select_record(RatPhase phase, int64_t ms, bool success) {
+  uint32_t sample = (uint32_t)CLAMP(ms, 1, UINT32_MAX - FAIL_PENALTY_MS) + (success ? 0 : FAIL_PENALTY_MS);
+
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  int i = mode_index(stats.current);
+  if (i < 0) {
+    k_spin_unlock(&stats_lock, key);
+    return;
+  }
+  rat_mode_stats_t* mode = &stats.modes[i];
+  uint32_t* avg = &mode->avg_ms[(size_t)phase];
+  *avg = *avg ? *avg - (*avg >> EWMA_SHIFT) + (sample >> EWMA_SHIFT) : sample;
+  uint32_t new_avg = *avg;
+  if (mode->samples < UINT16_MAX) mode->samples++;
+  if (phase == RatPhase::ATTACH) {
+    mode->fails_in_row = success ? 0 : MIN(mode->fails_in_row + 1, UINT8_MAX);
+  }
+  // A failed attach decides the next choice, don't lose it to a reset
+  bool save = ++unsaved >= SAVE_EVERY || (phase == RatPhase::ATTACH && !success);
+  if (save) unsaved = 0;
+  k_spin_unlock(&stats_lock, key);
+
+  printk("\tRAT mode %u %s %s in %lldms, average %ums\n", stats.current, PHASE_NAMES[(size_t)phase],
+    success ? "done" : "failed", ms, new_avg);
+  if (save) k_work_submit(&save_work);
+}
+
+void rat_select_set_current(PreferredMode mode) {
+  if (stats.current == (uint8_t)mode) return;
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  stats.current = (uint8_t)mode;
+  k_spin_unlock(&stats_lock, key);
+  k_work_submit(&save_work);
+}
+
+bool rat_select_get_current(PreferredMode* mode) {
+  if (mode_index(stats.current) < 0) return false;
+  *mode = (PreferredMode)stats.current;
+  return true;
+}
+
+bool rat_select_choose(PreferredMode* mode) {
+  k_spinlock_key_t key = k_spin_lock(&stats_lock);
+  int current = mode_index(stats.current);
+  int best = -1;
+  uint32_t best_cost = 0;
+  for (size_t i = 0; i < MODE_COUNT; i++) {
+    // Modes that never attached are only ever reached by exploring
+    if (!stats.modes[i].avg_ms[(size_t)RatPhase::ATTACH]) continue;
+    uint32_t cost = expected_cost(i);
+    if (best < 0 || cost < best_cost) {
+      best = i;
+      best_cost = cost;
+    }
+  }
+  bool stuck = current >= 0 && stats.modes[current].fails_in_row >= MAX_FAILS_IN_ROW;
+  k_spin_unlock(&stats_lock, key);
+
+  if (current < 0) {
+    // Timings can only be told apart once the hub set the mode, start from the SIM7000 default
+    *mode = PreferredMode::AUTOMATIC;
+    return true;
+  }
+  int pick = best < 0 ? current : best;
+  // Exploring costs a slower attach now and then, not worth it on a low battery
+  bool explore = sys_rand32_get() % 100 < CONFIG_HUB_RAT_EXPLORE_PERCENT &&
+    last_batt_reading.percent > CONFIG_HUB_MODEM_STANDBY_MIN_BATTERY;
+  if (explore || (stuck && pick == current)) {
+    pick = (pick + 1 + sys_rand32_get() % (MODE_COUNT - 1)) % MODE_COUNT;
+    printk("\tRAT select: trying mode %u, best is %u at %ums\n", (uint8_t)MODES[pick],
+      best < 0 ? 0 : (uint8_t)MODES[best], best_cost);
+  } else {
+    printk("\tRAT select: mode %u, expecting %ums\n", (uint8_t)MODES[pick], best_cost);
+  }
+  *mode = MODES[pick];
+  return pick != current;
+}
@@ -0,0 +1,73 @@
+#ifndef HUB_RAT_SELECT_H
+#define HUB_RAT_SELECT_H
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Parts of a request that are timed separately, attach only happens after power on or airplane mode
+enum class RatPhase : uint8_t {
+  // Power on or AT+CFUN=1 until registered
+  ATTACH,
+  // AT+CNACT, only when the PDP context had to be activated
+  PDP,
+  // AT+SHCONN, the TLS handshake
+  TLS,
+  // AT+SHREQ and AT+SHREAD, the round trip to the server
+  REQUEST,
+  COUNT,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_HUB_RAT_SELECT
+
+  /**
+   * @brief Loads the timings saved under rat/stats, call after modem_settings_init
+   */
+  void rat_select_init(void);
+
+  /**
+   * @brief Adds a timing of phase in the mode the modem is set to
+   * @param ms Time the phase took, or was given before failing
+   * @param success False if the phase failed, it then counts as ms plus a penalty
+   */
+  void rat_select_record(RatPhase phase, int64_t ms, bool success);
+
+  /**
+   * @brief Notes the mode AT+CNMP was set to, the following timings count for it
+   */
+  void rat_select_set_current(PreferredMode mode);
+
+  /**
+   * @param mode Set to the mode AT+CNMP was last set to
+   * @return False if it was never set by the hub
+   */
+  bool rat_select_get_current(PreferredMode* mode);
+
+  /**
+   * @brief Picks the mode for the next attach. Mostly the one with the lowest
+   * expected time for an attach and a request, sometimes another one so the
+   * timings of the others stay current as coverage changes
+   * @param mode Set to the mode to attach in
+   * @return True if mode differs from the current one and has to be set with AT+CNMP
+   */
+  bool rat_select_choose(PreferredMode* mode);
+
+#else
+
+  static inline void rat_select_init(void) {}
+  static inline void rat_select_record(RatPhase phase, int64_t ms, bool success) {}
+  static inline void rat_select_set_current(PreferredMode mode) {}
+  static inline bool rat_select_get_current(PreferredMode* mode) { return false; }
+  static inline bool rat_select_choose(PreferredMode* mode) { return false; }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,51 +1,355 @@
 #include <zephyr/kernel.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/sys/printk.h>
+#include <zephyr/sys/ring_buffer.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "serial.h"
+#include "modem_trace.h"
+#include "utilities.h"
 
-/* receive buffer used in UART ISR callback */
+// Size of each EasyDMA buffer, the driver alternates between two of them
+#define RX_DMA_BUF_SIZE       64
+// Idle time on the line before a partially filled DMA buffer is handed over
+#define RX_TIMEOUT_US         1000
+// Bytes buffered between the UART ISR and the line splitter
+#define RX_RING_SIZE          2048
+// Bytes of AT commands waiting to be sent by EasyDMA
+#define TX_RING_SIZE          1024
+// Bytes of received lines waiting to be read, each line costs its length + 2
+#define LINE_RING_SIZE        1024
+// A zero length byte tells the reader the next line starts back at offset 0
+#define LINE_WRAP_MARKER      0
+// Max number of URC prefixes that can be registered
+#define URC_HANDLERS_MAX      8
+// URC lines are truncated to this when handed to their handler
+#define URC_LINE_SIZE         64
+
+#define TX_EVT_IDLE           BIT(0)
+#define TX_EVT_PROGRESS       BIT(1)
+
+/* DMA buffers handed to the UARTE, double buffered so reception never stalls */
+static uint8_t rx_dma_bufs[2][RX_DMA_BUF_SIZE];
+static uint8_t rx_dma_next;
+
+/* raw bytes from the ISR waiting to be split into lines */
+RING_BUF_DECLARE(rx_ring, RX_RING_SIZE);
+static struct k_spinlock rx_ring_lock;
+static uint32_t rx_overruns;
+// Set while RX is stopped to change the UART configuration
+static volatile bool rx_reconfiguring;
+K_SEM_DEFINE(rx_disabled_sem, 0, 1);
+
+/* AT commands queued for transmission, drained by uart_tx one contiguous chunk at a time */
+RING_BUF_DECLARE(tx_ring, TX_RING_SIZE);
+static struct k_spinlock tx_lock;
+static bool tx_busy;
+// TX_EVT_IDLE is set while nothing is queued, TX_EVT_PROGRESS each time a chunk completes
+K_EVENT_DEFINE(tx_events);
+
+/* line being assembled by the splitter */
 static char rx_buf[MSG_SIZE];
 static uint8_t rx_buf_pos;
 
-// queue to store up to 10 messages (aligned to 4-byte boundary)
-K_MSGQ_DEFINE(uart_msgq, MSG_SIZE, 10, 4);
+/*
+ * Received lines stored back to back as [len][chars][NUL] records so a 2 byte
+ * "OK" only costs 4 bytes. Records never wrap, readers borrow them in place.
+ */
+static uint8_t line_ring[LINE_RING_SIZE];
+static uint16_t line_head;
+static uint16_t line_tail;
+static uint16_t line_used;
+// The record at line_tail is borrowed, it stays in place until released
+static bool line_borrowed;
+static struct k_spinlock line_lock;
+// Counts complete lines in line_ring
+K_SEM_DEFINE(line_sem, 0, K_SEM_MAX_LIMIT);
+static uint32_t line_drops;
+
+/*
+ * Raw read set up by serial_bulk_arm. Once a line starting with header is
+ * received, the next expected bytes skip the line splitter and go straight to out_buf.
+ */
+static struct {
+  const char* header;
+  char* out_buf;
+  size_t out_size;
+  size_t expected;
+  size_t received;
+  // Waiting for the header line
+  bool armed;
+  // Streaming payload bytes into out_buf
+  bool active;
+  // Header ended with \r so the \n that follows isn't part of the payload
+  bool skip_lf;
+} bulk;
+static struct k_spinlock bulk_lock;
+K_SEM_DEFINE(bulk_sem, 0, 1);
+
+/* prefix handlers for unsolicited result codes, run on the system work queue */
+struct urc_handler_t {
+  const char* prefix;
+  serial_urc_handler_t handler;
+  void* user_data;
+};
+struct urc_msg_t {
+  uint8_t handler_idx;
+  char line[URC_LINE_SIZE];
+};
+static struct urc_handler_t urc_handlers[URC_HANDLERS_MAX];
+static uint8_t urc_handlers_len;
+K_MSGQ_DEFINE(urc_msgq, sizeof(struct urc_msg_t), 8, 4);
+static struct k_work urc_work;
+
+static struct k_work rx_work;
+static struct k_work_q serial_work_q;
+K_THREAD_STACK_DEFINE(serial_stack_area, 1024);
+const k_work_queue_config serial_work_q_config = {
+  .name = "serial_work_q",
+};
+
+static struct serial_wait_stats wait_stats;
 
 static const struct device* uart0_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_shell_uart));
 
 static const struct device* uart1_dev = DEVICE_DT_GET(DT_NODELABEL(uart1));
 
 /*
- * Read characters from UART until line end is detected. Afterwards push the
- * data to the message queue.
+ * Copies a line into line_ring as a single contiguous record.
+ * Called only from serial_work_q, readers are woken through line_sem.
+ * @return False if there wasn't room and the line was dropped
  */
-static void serial_cb(const struct device* dev, void* user_data)
-{
-  uint8_t c;
+static bool serial_line_put(const char* line, uint8_t len) {
+  uint16_t needed = len + 2;
+  k_spinlock_key_t key = k_spin_lock(&line_lock);
 
-  if (!uart_irq_update(uart1_dev)) {
-    return;
+  if (line_used == 0) {
+    line_head = 0;
+    line_tail = 0;
+  }
+  uint16_t end_space = line_head >= line_tail && (line_head != line_tail || line_used == 0)
+    ? LINE_RING_SIZE - line_head
+    : line_tail - line_head;
+
+  if (needed > end_space) {
+    // Only able to wrap if the record fits in front of the reader
+    bool can_wrap = line_head > line_tail && needed <= line_tail;
+    if (!can_wrap) {
+      line_drops++;
+      k_spin_unlock(&line_lock, key);
+      return false;
+    }
+    if (line_head < LINE_RING_SIZE) line_ring[line_head] = LINE_WRAP_MARKER;
+    line_used += LINE_RING_SIZE - line_head;
+    line_head = 0;
+  }
+
+  line_ring[line_head] = len;
+  memcpy(&line_ring[line_head + 1], line, len);
+  line_ring[line_head + 1 + len] = '\0';
+  line_head += needed;
+  line_used += needed;
+  k_spin_unlock(&line_lock, key);
+
+  k_sem_give(&line_sem);
+  return true;
+}
+
+/*
+ * Switches to raw mode if line is the header serial_bulk_arm is waiting for
+ */
+static void serial_bulk_check_header(const char* line, bool ended_by_cr) {
+  k_spinlock_key_t key = k_spin_lock(&bulk_lock);
+  size_t header_len = bulk.armed ? strlen(bulk.header) : 0;
+  if (bulk.armed && strncmp(line, bulk.header, header_len) == 0) {
+    bulk.armed = false;
+    bulk.expected = strtoul(line + header_len, NULL, 10);
+    bulk.received = 0;
+    bulk.skip_lf = ended_by_cr;
+    bulk.active = bulk.expected > 0;
+    if (!bulk.active) {
+      bulk.out_buf[0] = '\0';
+      k_sem_give(&bulk_sem);
+    }
+  }
+  k_spin_unlock(&bulk_lock, key);
+}
+
+/*
+ * Copies payload bytes of an active bulk read into the caller's buffer.
+ * Bytes past out_size are counted but discarded so they don't end up as lines.
+ * @return The number of bytes of data that belonged to the payload
+ */
+static uint32_t serial_bulk_consume(const uint8_t* data, uint32_t len) {
+  uint32_t consumed = 0;
+  k_spinlock_key_t key = k_spin_lock(&bulk_lock);
+  if (!bulk.active) {
+    k_spin_unlock(&bulk_lock, key);
+    return 0;
+  }
+  if (bulk.skip_lf) {
+    bulk.skip_lf = false;
+    if (data[0] == '\n') consumed++;
+  }
+  size_t count = MIN(len - consumed, bulk.expected - bulk.received);
+  if (bulk.received < bulk.out_size - 1) {
+    size_t copy_len = MIN(count, bulk.out_size - 1 - bulk.received);
+    memcpy(bulk.out_buf + bulk.received, data + consumed, copy_len);
+  }
+  bulk.received += count;
+  consumed += count;
+  modem_trace_record(MODEM_TRACE_BULK, data + consumed - count, count);
+  if (bulk.received == bulk.expected) {
+    bulk.out_buf[MIN(bulk.received, bulk.out_size - 1)] = '\0';
+    bulk.active = false;
+    k_sem_give(&bulk_sem);
   }
+  k_spin_unlock(&bulk_lock, key);
+  return consumed;
+}
+
+/*
+ * Hands line to every URC handler whose prefix it starts with. The line is also
+ * kept in line_ring since URCs like +APP PDP are part of some command responses.
+ */
+static void serial_urc_dispatch(const char* line) {
+  for (uint8_t i = 0; i < urc_handlers_len; i++) {
+    if (strncmp(line, urc_handlers[i].prefix, strlen(urc_handlers[i].prefix)) != 0) continue;
+
+    struct urc_msg_t msg;
+    msg.handler_idx = i;
+    strncpy(msg.line, line, sizeof(msg.line) - 1);
+    msg.line[sizeof(msg.line) - 1] = '\0';
+    if (k_msgq_put(&urc_msgq, &msg, K_NO_WAIT) != 0) {
+      printk("URC queue full, dropped: %s\n", line);
+    }
+    k_work_submit(&urc_work);
+  }
+}
+
+static void serial_urc_work_handler(struct k_work* work_item) {
+  struct urc_msg_t msg;
+  while (k_msgq_get(&urc_msgq, &msg, K_NO_WAIT) == 0) {
+    struct urc_handler_t* entry = &urc_handlers[msg.handler_idx];
+    entry->handler(msg.line, entry->user_data);
+  }
+}
+
+/*
+ * Adds a single character to the current line. Once a line end is detected
+ * the line is copied into line_ring.
+ */
+static void serial_rx_char(uint8_t c) {
+  bool is_break = c == '\n' || c == '\r';
+
+  if (rx_buf_pos == 0 && is_break) return;
+
+  if (!is_break) rx_buf[rx_buf_pos++] = c;
+
+  if ((rx_buf_pos == sizeof(rx_buf) - 1) || is_break) {
+    rx_buf[rx_buf_pos] = '\0';
+    modem_trace_record(MODEM_TRACE_RX, rx_buf, rx_buf_pos);
 
-  while (uart_irq_rx_ready(uart1_dev)) {
+    if (!serial_line_put(rx_buf, rx_buf_pos)) {
+      printk("Line ring full, dropped: %s\n", rx_buf);
+    }
+    serial_bulk_check_header(rx_buf, c == '\r');
+    serial_urc_dispatch(rx_buf);
 
-    uart_fifo_read(uart1_dev, &c, 1);
-    bool is_break = c == '\n' || c == '\r';
+    /* reset the buffer (it was copied to line_ring) */
+    rx_buf_pos = 0;
+  }
+}
 
-    if (rx_buf_pos == 0 && is_break) continue;
+/*
+ * Drains the ring buffer filled by the UART ISR and splits it into lines.
+ * Runs on serial_work_q so the ISR only has to copy bytes.
+ */
+static void serial_rx_work_handler(struct k_work* work_item) {
+  uint8_t chunk[32];
+  uint32_t len;
 
-    if (!is_break) rx_buf[rx_buf_pos++] = c;
+  do {
+    k_spinlock_key_t key = k_spin_lock(&rx_ring_lock);
+    len = ring_buf_get(&rx_ring, chunk, sizeof(chunk));
+    k_spin_unlock(&rx_ring_lock, key);
 
-    if ((rx_buf_pos == sizeof(rx_buf) - 1) || is_break) {
-      rx_buf[rx_buf_pos] = '\0';
+    for (uint32_t i = 0; i < len;) {
+      uint32_t consumed = bulk.active ? serial_bulk_consume(chunk + i, len - i) : 0;
+      if (consumed > 0) i += consumed;
+      else serial_rx_char(chunk[i++]);
+    }
+  } while (len > 0);
+}
 
-      /* if queue is full, message is silently dropped */
-      k_msgq_put(&uart_msgq, &rx_buf, K_NO_WAIT);
+/*
+ * Starts transmitting the next contiguous chunk of tx_ring if the UART is idle.
+ * Must be called with tx_lock held.
+ */
+static void serial_tx_start_locked(void) {
+  if (tx_busy) return;
 
-      /* reset the buffer (it was copied to the msgq) */
-      rx_buf_pos = 0;
+  uint8_t* data;
+  uint32_t len = ring_buf_get_claim(&tx_ring, &data, TX_RING_SIZE);
+  if (len == 0) {
+    k_event_post(&tx_events, TX_EVT_IDLE);
+    return;
+  }
+  int err = uart_tx(uart1_dev, data, len, SYS_FOREVER_US);
+  if (err) {
+    // Drop the chunk rather than wedging every later command behind it
+    ring_buf_get_finish(&tx_ring, len);
+    printk("UART TX failed (err %d)\n", err);
+    k_event_post(&tx_events, TX_EVT_IDLE | TX_EVT_PROGRESS);
+    return;
+  }
+  tx_busy = true;
+}
+
+/*
+ * Async UART callback, EasyDMA fills rx_dma_bufs and we get notified once per
+ * buffer (or after RX_TIMEOUT_US of silence) instead of once per character.
+ * Transmission completions continue with the next queued chunk.
+ */
+static void serial_cb(const struct device* dev, struct uart_event* evt, void* user_data)
+{
+  switch (evt->type) {
+  case UART_TX_DONE:
+  case UART_TX_ABORTED: {
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    ring_buf_get_finish(&tx_ring, evt->data.tx.len);
+    tx_busy = false;
+    k_event_post(&tx_events, TX_EVT_PROGRESS);
+    serial_tx_start_locked();
+    k_spin_unlock(&tx_lock, key);
+    break;
+  }
+  case UART_RX_RDY: {
+    uint32_t written = ring_buf_put(&rx_ring, evt->data.rx.buf + evt->data.rx.offset, evt->data.rx.len);
+    if (written < evt->data.rx.len) rx_overruns++;
+    k_work_submit_to_queue(&serial_work_q, &rx_work);
+    break;
+  }
+  case UART_RX_BUF_REQUEST:
+    uart_rx_buf_rsp(dev, rx_dma_bufs[rx_dma_next], RX_DMA_BUF_SIZE);
+    rx_dma_next ^= 1;
+    break;
+  case UART_RX_STOPPED:
+    printk("UART RX stopped (reason %d)\n", evt->data.rx_stop.reason);
+    break;
+  case UART_RX_DISABLED:
+    if (rx_reconfiguring) {
+      k_sem_give(&rx_disabled_sem);
+      break;
     }
+    // Happens after an RX error, restart reception so we don't go deaf
+    rx_dma_next = 1;
+    uart_rx_enable(dev, rx_dma_bufs[0], RX_DMA_BUF_SIZE, RX_TIMEOUT_US);
+    break;
+  default:
+    break;
   }
 }
 
@@ -55,86 +359,290 @@ void serial_init(void) {
     return;
   }
 
-  /* configure interrupt and callback to receive data */
-  uart_irq_callback_user_data_set(uart1_dev, serial_cb, NULL);
-  uart_irq_rx_enable(uart1_dev);
+  k_work_queue_start(&serial_work_q, serial_stack_area,
+    K_THREAD_STACK_SIZEOF(serial_stack_area),
+    CONFIG_SYSTEM_WORKQUEUE_PRIORITY, &serial_work_q_config);
+  k_work_init(&rx_work, serial_rx_work_handler);
+  k_work_init(&urc_work, serial_urc_work_handler);
+
+  /* configure async callback and start receiving into the DMA buffers */
+  int err = uart_callback_set(uart1_dev, serial_cb, NULL);
+  if (err) {
+    printk("Unable to set UART callback (err %d)\n", err);
+    return;
+  }
+  k_event_post(&tx_events, TX_EVT_IDLE);
+  rx_dma_next = 1;
+  err = uart_rx_enable(uart1_dev, rx_dma_bufs[0], RX_DMA_BUF_SIZE, RX_TIMEOUT_US);
+  if (err) {
+    printk("Unable to enable UART RX (err %d)\n", err);
+    return;
+  }
   printk("\tSerial online\n");
 }
 
-void serial_print_uart(const char* buf) {
-  int msg_len = strlen(buf);
+int serial_set_baudrate(uint32_t baud, bool flow_control) {
+  struct uart_config cfg;
+  int err = uart_config_get(uart1_dev, &cfg);
+  if (err) return err;
+  if (cfg.baudrate == baud && (cfg.flow_ctrl == UART_CFG_FLOW_CTRL_RTS_CTS) == flow_control) return 0;
+
+  cfg.baudrate = baud;
+  cfg.flow_ctrl = flow_control ? UART_CFG_FLOW_CTRL_RTS_CTS : UART_CFG_FLOW_CTRL_NONE;
+
+  // Let queued commands go out at the old rate, then stop DMA reception while switching
+  serial_tx_flush(1000LL);
+  k_sem_reset(&rx_disabled_sem);
+  rx_reconfiguring = true;
+  if (uart_rx_disable(uart1_dev) == 0) {
+    k_sem_take(&rx_disabled_sem, K_MSEC(100));
+  }
+  err = uart_configure(uart1_dev, &cfg);
+  rx_reconfiguring = false;
+  rx_dma_next = 1;
+  uart_rx_enable(uart1_dev, rx_dma_bufs[0], RX_DMA_BUF_SIZE, RX_TIMEOUT_US);
+
+  if (err) printk("Unable to set baud %u (err %d)\n", baud, err);
+  else printk("\tSerial baud set to %u, flow control %s\n", baud, flow_control ? "on" : "off");
+  return err;
+}
+
+uint32_t serial_get_baudrate(void) {
+  struct uart_config cfg;
+  if (uart_config_get(uart1_dev, &cfg)) return 0;
+  return cfg.baudrate;
+}
+
+uint32_t serial_rx_overruns(void) {
+  return rx_overruns;
+}
+
+uint32_t serial_line_drops(void) {
+  return line_drops;
+}
 
-  for (int i = 0; i < msg_len; i++) {
-    uart_poll_out(uart1_dev, buf[i]);
+/*
+ * Copies len bytes into tx_ring and kicks off transmission. Only blocks
+ * while the ring is full, waiting for EasyDMA to free up space.
+ */
+static void serial_tx_queue(const uint8_t* data, size_t len) {
+  while (len > 0) {
+    k_spinlock_key_t key = k_spin_lock(&tx_lock);
+    k_event_clear(&tx_events, TX_EVT_PROGRESS);
+    uint32_t written = ring_buf_put(&tx_ring, data, len);
+    if (written > 0) {
+      k_event_clear(&tx_events, TX_EVT_IDLE);
+      serial_tx_start_locked();
+    }
+    k_spin_unlock(&tx_lock, key);
+
+    data += written;
+    len -= written;
+    if (len > 0 && !k_event_wait(&tx_events, TX_EVT_PROGRESS, false, K_MSEC(1000))) {
+      printk("UART TX stalled, dropping %u bytes\n", len);
+      return;
+    }
   }
 }
 
+void serial_print_uart(const char* buf) {
+  modem_trace_record(MODEM_TRACE_TX, buf, strlen(buf));
+  serial_tx_queue((const uint8_t*)buf, strlen(buf));
+}
+
+bool serial_tx_flush(int64_t timeout) {
+  return k_event_wait(&tx_events, TX_EVT_IDLE, false, K_MSEC(timeout)) != 0;
+}
+
 void serial_purge(void) {
-  k_msgq_purge(&uart_msgq);
+  k_spinlock_key_t key = k_spin_lock(&line_lock);
+  if (line_borrowed) {
+    // Drop everything behind the borrowed line, resetting the ring would let the next
+    // line overwrite it and the stale release free that line instead
+    uint16_t record_len = line_ring[line_tail] + 2;
+    line_head = line_tail + record_len;
+    line_used = record_len;
+  } else {
+    line_head = 0;
+    line_tail = 0;
+    line_used = 0;
+  }
+  k_sem_reset(&line_sem);
+  k_spin_unlock(&line_lock, key);
 }
 
 bool serial_did_return_ok(int64_t timeout, bool print) {
   return serial_did_return_str("OK", timeout, print);
 }
 
-bool serial_did_return_str(const char* str, int64_t timeout, bool print) {
-  char tx_buf[MSG_SIZE];
+const char* serial_line_borrow(k_timeout_t timeout) {
   int64_t start_time = k_uptime_get();
-  while (k_uptime_get() < start_time + timeout) {
-    if (k_msgq_get(&uart_msgq, &tx_buf, K_NO_WAIT) == 0) {
-      if (print) printk("\tSIM7000 says: %s\n", tx_buf);
-      if (strncmp(str, tx_buf, strlen(str)) == 0) {
-        return true;
-      } else if (strncmp("ERROR", tx_buf, 5) == 0) {
-        return false;
-      }
-    }
+#ifdef CONFIG_THREAD_RUNTIME_STATS
+  k_thread_runtime_stats_t start_stats;
+  k_thread_runtime_stats_get(k_current_get(), &start_stats);
+#endif
+
+  bool received = k_sem_take(&line_sem, timeout) == 0;
+
+  // Only account real waits, not the K_NO_WAIT polling in serial_infinite_io
+  if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+#ifdef CONFIG_THREAD_RUNTIME_STATS
+    k_thread_runtime_stats_t end_stats;
+    k_thread_runtime_stats_get(k_current_get(), &end_stats);
+    wait_stats.cpu_cycles += end_stats.execution_cycles - start_stats.execution_cycles;
+#endif
+    wait_stats.waits++;
+    wait_stats.wait_ms += k_uptime_get() - start_time;
   }
-  return false;
+  if (!received) return NULL;
+
+  k_spinlock_key_t key = k_spin_lock(&line_lock);
+  if (line_tail == LINE_RING_SIZE || line_ring[line_tail] == LINE_WRAP_MARKER) {
+    line_used -= LINE_RING_SIZE - line_tail;
+    line_tail = 0;
+  }
+  const char* line = (const char*)&line_ring[line_tail + 1];
+  line_borrowed = true;
+  k_spin_unlock(&line_lock, key);
+  return line;
 }
 
-bool serial_read_queue(char* out_buf, int64_t timeout, bool print) {
-  char tx_buf[MSG_SIZE];
-  int64_t start_time = k_uptime_get();
-  while (k_uptime_get() < start_time + timeout) {
-    if (k_msgq_get(&uart_msgq, &tx_buf, K_NO_WAIT) == 0) {
-      if (print) printk("\tSIM7000 says: %s\n", tx_buf);
-      strcpy(out_buf, tx_buf);
+void serial_line_release(const char* line) {
+  k_spinlock_key_t key = k_spin_lock(&line_lock);
+  if (line_borrowed && line == (const char*)&line_ring[line_tail + 1]) {
+    uint16_t record_len = line_ring[line_tail] + 2;
+    line_tail += record_len;
+    line_used -= record_len;
+    line_borrowed = false;
+  }
+  k_spin_unlock(&line_lock, key);
+}
+
+/*
+ * Sleeps until a line arrives or the deadline passes and borrows it.
+ * @return The borrowed line, release with serial_line_release, or NULL on timeout
+ */
+static const char* serial_wait_line(const Deadline& deadline) {
+  return serial_line_borrow(deadline.remaining());
+}
+
+bool serial_did_return_str(const char* str, int64_t timeout, bool print) {
+  Deadline deadline(timeout);
+  const char* line;
+  while ((line = serial_wait_line(deadline))) {
+    if (print) printk("\tSIM7000 says: %s\n", line);
+    bool is_match = strncmp(str, line, strlen(str)) == 0;
+    bool is_error = strncmp("ERROR", line, 5) == 0;
+    serial_line_release(line);
+    if (is_match) {
       return true;
+    } else if (is_error) {
+      return false;
     }
   }
   return false;
 }
 
+bool serial_read_queue(char* out_buf, int64_t timeout, bool print) {
+  Deadline deadline(timeout);
+  const char* line = serial_wait_line(deadline);
+  if (!line) return false;
+
+  if (print) printk("\tSIM7000 says: %s\n", line);
+  strcpy(out_buf, line);
+  serial_line_release(line);
+  return true;
+}
+
 bool serial_read_raw_until(const char* str, char* out_buf, int64_t timeout) {
-  char tx_buf[MSG_SIZE];
-  int64_t start_time = k_uptime_get();
-  while (k_uptime_get() < start_time + timeout) {
-    if (k_msgq_get(&uart_msgq, &tx_buf, K_NO_WAIT) == 0) {
-      printk("\tSIM7000 says: %s\n", tx_buf);
-      uint8_t left_padding = 0;
-      if (strncmp(str, tx_buf, strlen(str)) == 0) {
-        return true;
-      }
-      while (tx_buf[left_padding] == ' ') left_padding++;
-      strcpy(out_buf + strlen(out_buf), tx_buf + left_padding);
+  Deadline deadline(timeout);
+  const char* line;
+  while ((line = serial_wait_line(deadline))) {
+    printk("\tSIM7000 says: %s\n", line);
+    uint8_t left_padding = 0;
+    if (strncmp(str, line, strlen(str)) == 0) {
+      serial_line_release(line);
+      return true;
     }
+    while (line[left_padding] == ' ') left_padding++;
+    strcpy(out_buf + strlen(out_buf), line + left_padding);
+    serial_line_release(line);
   }
   return false;
 }
 
+int serial_urc_register(const char* prefix, serial_urc_handler_t handler, void* user_data) {
+  if (urc_handlers_len >= URC_HANDLERS_MAX) {
+    printk("No room to register URC handler for %s\n", prefix);
+    return -ENOMEM;
+  }
+  urc_handlers[urc_handlers_len] = { prefix, handler, user_data };
+  // Publish the entry only once it's complete, the splitter may be reading the table
+  compiler_barrier();
+  urc_handlers_len++;
+  return 0;
+}
+
+void serial_bulk_arm(const char* header, char* out_buf, size_t out_size) {
+  k_spinlock_key_t key = k_spin_lock(&bulk_lock);
+  bulk.header = header;
+  bulk.out_buf = out_buf;
+  bulk.out_size = out_size;
+  bulk.expected = 0;
+  bulk.received = 0;
+  bulk.active = false;
+  bulk.armed = true;
+  k_sem_reset(&bulk_sem);
+  k_spin_unlock(&bulk_lock, key);
+}
+
+void serial_bulk_cancel(void) {
+  k_spinlock_key_t key = k_spin_lock(&bulk_lock);
+  bulk.armed = false;
+  bulk.active = false;
+  k_spin_unlock(&bulk_lock, key);
+}
+
+int serial_bulk_wait(int64_t timeout) {
+  bool done = k_sem_take(&bulk_sem, K_MSEC(timeout)) == 0;
+  k_spinlock_key_t key = k_spin_lock(&bulk_lock);
+  int ret = done ? (int)MIN(bulk.received, bulk.out_size - 1) : -1;
+  if (done && bulk.received > bulk.out_size - 1) {
+    printk("Bulk read truncated from %u to %u bytes\n", bulk.received, bulk.out_size - 1);
+  } else if (!done) {
+    printk("Bulk read timed out after %u of %u bytes\n", bulk.received, bulk.expected);
+  }
+  bulk.armed = false;
+  bulk.active = false;
+  k_spin_unlock(&bulk_lock, key);
+  return ret;
+}
+
+void serial_get_wait_stats(struct serial_wait_stats* out_stats) {
+  *out_stats = wait_stats;
+}
+
+void serial_print_wait_stats(void) {
+  printk("Serial waits: %u, waited %lldms, dropped lines: %u", wait_stats.waits, wait_stats.wait_ms, line_drops);
+#ifdef CONFIG_THREAD_RUNTIME_STATS
+  printk(", CPU busy %llu cycles (%lluus)", wait_stats.cpu_cycles,
+    k_cyc_to_us_floor64(wait_stats.cpu_cycles));
+#endif
+  printk("\n");
+}
+
 bool serial_infinite_io() {
-  char tx_buf[MSG_SIZE]{};
+  const char* line;
   unsigned char c;
   while (1) {
-    while (k_msgq_get(&uart_msgq, &tx_buf, K_NO_WAIT) == 0) {
-      tx_buf[MSG_SIZE - 1] = '\0';
-      printk("Echo: %s\r\n", tx_buf);
+    while ((line = serial_line_borrow(K_NO_WAIT))) {
+      printk("Echo: %s\r\n", line);
+      serial_line_release(line);
     }
 
     while (uart_poll_in(uart0_dev, &c) == 0) {
       printk("%c", c);
-      uart_poll_out(uart1_dev, c);
+      serial_tx_queue(&c, 1);
     }
 
   }
@@ -2,23 +2,89 @@
 #define SERIAL_UART_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
 
 #define MSG_SIZE 256
 
+// Totals for the time callers spent blocked waiting on modem responses
+struct serial_wait_stats {
+  // Number of waits for a received line
+  uint32_t waits;
+  // Wall clock ms spent waiting
+  int64_t wait_ms;
+  // Cycles the waiting thread actually ran while waiting, needs CONFIG_THREAD_RUNTIME_STATS
+  uint64_t cpu_cycles;
+};
+
+/**
+ * @brief Called from the system work queue with a line matching a registered URC prefix
+ * @param line the received line, truncated to 63 characters
+ * @param user_data the pointer given to serial_urc_register
+ */
+typedef void (*serial_urc_handler_t)(const char* line, void* user_data);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
-  // Sets up uart1 device, registers IRQ and message queue
+  // Sets up uart1 device for async (EasyDMA) reception and starts the line splitter
   void serial_init(void);
 
+  /**
+   * @brief Reconfigures uart1, waiting for queued commands to be sent first
+   * @param baud the new baud rate
+   * @param flow_control whether to use RTS/CTS hardware flow control
+   * @return 0 on success, negative errno from the UART driver otherwise
+   */
+  int serial_set_baudrate(uint32_t baud, bool flow_control);
+
+  /**
+   * @return The current uart1 baud rate, 0 if unknown
+   */
+  uint32_t serial_get_baudrate(void);
+
+  /**
+   * @brief Number of times received bytes were lost because the RX ring buffer was full
+   */
+  uint32_t serial_rx_overruns(void);
+
+  /**
+   * @brief Number of received lines dropped because the line ring was full
+   */
+  uint32_t serial_line_drops(void);
+
+  /**
+   * @brief Waits for the oldest received line and lends it out without copying
+   * Only one line can be borrowed at a time, it must be released before the next borrow.
+   * Time spent waiting is included in the wait stats
+   * @param timeout how long to wait for a line
+   * @return The null-terminated line, or NULL if timed out
+   */
+  const char* serial_line_borrow(k_timeout_t timeout);
+
+  /**
+   * @brief Returns a line from serial_line_borrow so its space can be reused
+   * @param line the pointer returned by serial_line_borrow
+   */
+  void serial_line_release(const char* line);
+
   /*
-   * @brief Prints a null-terminated string character by character to the UART1 interface
+   * @brief Queues a null-terminated string for transmission on the UART1 interface
+   * Returns as soon as buf is copied, only blocks if the TX ring is full
    * @param buf the char array to print, needs to be null terminated
    */
   void serial_print_uart(const char* buf);
 
   /**
-   * @brief Purges out the message queue
+   * @brief Blocks until everything queued by serial_print_uart has been sent
+   * @param timeout ms to wait for the TX ring to drain
+   * @return True if all queued bytes were sent before timeout
+   */
+  bool serial_tx_flush(int64_t timeout);
+
+  /**
+   * @brief Purges out all received lines, except a borrowed one which stays valid
+   * until serial_line_release
    */
   void serial_purge(void);
 
@@ -49,7 +115,7 @@ extern "C" {
   bool serial_read_queue(char* out_buf, int64_t timeout, bool print = true);
 
   /**
-   * @brief Blocks while concatenating all message queue messages until
+   * @brief Blocks while concatenating all received lines until
    * a message starting with str is read
    * @param str the exact string to read until
    * @param out_buf the buffer to copy the full string into if str is read
@@ -58,6 +124,50 @@ extern "C" {
    */
   bool serial_read_raw_until(const char* str, char* out_buf, int64_t timeout);
 
+  /**
+   * @brief Registers a handler for unsolicited result codes (URCs) starting with prefix.
+   * Matching lines are still queued for readers as well, handlers should be quick
+   * and must not send AT commands themselves
+   * @param prefix the start of the line to match, e.g. "+CREG: ", must stay valid
+   * @param handler called from the system work queue for every matching line
+   * @param user_data passed through to handler
+   * @return 0 on success, -ENOMEM if all handler slots are used
+   */
+  int serial_urc_register(const char* prefix, serial_urc_handler_t handler, void* user_data);
+
+  /**
+   * @brief Prepares a binary-safe read of a length-delimited payload such as AT+SHREAD.
+   * Must be called before sending the command. Once a line starting with header is
+   * received, the number following it is the payload length and exactly that many bytes
+   * are copied into out_buf without line splitting. The header line is still queued.
+   * @param header the line prefix announcing the payload length, e.g. "+SHREAD: "
+   * @param out_buf the buffer to stream the payload into, stays in use until serial_bulk_wait returns
+   * @param out_size the size of out_buf, the payload is null terminated and truncated to fit
+   */
+  void serial_bulk_arm(const char* header, char* out_buf, size_t out_size);
+
+  /**
+   * @brief Blocks until the payload armed with serial_bulk_arm has been fully received
+   * @param timeout ms to wait for the header and payload
+   * @return Number of bytes stored in out_buf, or -1 if timed out
+   */
+  int serial_bulk_wait(int64_t timeout);
+
+  /**
+   * @brief Stops a bulk read armed with serial_bulk_arm, out_buf is no longer written to
+   */
+  void serial_bulk_cancel(void);
+
+  /**
+   * @brief Copies the accumulated wait statistics into out_stats
+   */
+  void serial_get_wait_stats(struct serial_wait_stats* out_stats);
+
+  /**
+   * @brief Prints the accumulated wait statistics
+   */
+  void serial_print_wait_stats(void);
+
   /**
    * @brief Enters infinite read/write loop to debug SIMCOM modem
   */
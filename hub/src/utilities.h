@@ -1,14 +1,42 @@
 #ifndef HUB_UTILITIES_H
 #define HUB_UTILITIES_H
 
+#include <zephyr/kernel.h>
 #include <zephyr/drivers/uart.h>
-#include <cJSON.h>
 
 struct Command {
   char type[30]{};
   char value[50]{};
 };
 
+/**
+ * An absolute point in time to bound blocking waits, so that loops made of
+ * several waits share one timeout instead of restarting it on every wait
+ */
+struct Deadline {
+  int64_t end_time;
+
+  // Already expired, for members that are set later
+  Deadline() : end_time(0) {}
+
+  explicit Deadline(int64_t timeout_ms) : end_time(k_uptime_get() + timeout_ms) {}
+
+  // True once the deadline has passed
+  bool expired() const { return k_uptime_get() >= end_time; }
+
+  // ms left before the deadline, never negative
+  int64_t remaining_ms() const {
+    int64_t remaining = end_time - k_uptime_get();
+    return remaining > 0 ? remaining : 0;
+  }
+
+  // Time left before the deadline, for passing to kernel APIs
+  k_timeout_t remaining() const { return K_MSEC(remaining_ms()); }
+
+  // timeout_ms cut down to the time left, for a nested wait that has its own limit
+  int64_t clamp_ms(int64_t timeout_ms) const { return MIN(timeout_ms, remaining_ms()); }
+};
+
 
 namespace Utilities {
 
@@ -46,14 +74,6 @@ namespace Utilities {
    * @brief Prints the current thread stack space remaining
   */
   void print_thread_stack_space(void);
-
-  /**
-   * @brief Shortcut to parse through n nested objects in a cJSON object
-   * @param parent the starting cJSON object from which to search
-   * @param path an array of JSON object names to search through
-   * @return A pointer to the found cJSON object or NULL
-  */
-  // cJSON* cJSON_GetNested(cJSON* parent, const char* const path[]);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Decodes and replays modem traces recorded by the hub firmware.
+
+The firmware prints its trace as "MTRACE" hex lines at the end of a
+diagnostic run, and on boot for the trace saved by the last failed AT
+script. Save the console output to a file and:
+
+    ./modem_trace.py decode console.log         # timeline and time per command
+    ./modem_trace.py replay console.log --pty   # act as the modem with the recorded timings
+
+Replay answers each command the firmware sends with the lines and payloads
+the real modem sent after the matching recorded command, with the same
+delays. This reproduces a slow field request against the firmware's parsing
+and state logic. At the end the time the firmware took per command is
+compared with the recording.
+"""
+
+import argparse
+import os
+import select
+import struct
+import sys
+import time
+
+from sim7000_emu import log, open_port, BAUD_RATES
+
+HEADER = struct.Struct("<IBB")
+TX, RX, BULK = ord("T"), ord("R"), ord("B")
+
+
+def load(path, name=None):
+    """Returns the records of the last trace in path as (time_us, type, bytes)"""
+    traces = []
+    current = None
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            idx = line.find("MTRACE ")
+            if idx < 0:
+                continue
+            words = line[idx:].split()
+            if words[1] == "BEGIN":
+                current = (words[2], bytearray())
+            elif words[1] == "END" and current:
+                traces.append(current)
+                current = None
+            elif current:
+                current[1].extend(bytes.fromhex(words[1]))
+    traces = [t for t in traces if name is None or t[0] == name]
+    if not traces:
+        sys.exit("no trace found in %s" % path)
+
+    data = traces[-1][1]
+    records = []
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        time_us, kind, length = HEADER.unpack_from(data, pos)
+        pos += HEADER.size
+        records.append((time_us, kind, bytes(data[pos:pos + length])))
+        pos += length
+    return records
+
+
+def elapsed_us(start, end):
+    # Timestamps are the low 32 bits of the uptime
+    return (end - start) & 0xFFFFFFFF
+
+
+def command_name(data):
+    text = data.decode(errors="replace").strip()
+    return text.split("=")[0].split("?")[0][:24]
+
+
+def decode(args):
+    records = load(args.log, args.trace)
+    if not records:
+        return
+    start = records[0][0]
+    last_tx = None
+    per_command = {}
+    for time_us, kind, data in records:
+        t_ms = elapsed_us(start, time_us) / 1000.0
+        if kind == TX:
+            if last_tx:
+                name, tx_time = last_tx
+                per_command.setdefault(name, []).append(elapsed_us(tx_time, time_us) / 1000.0)
+            last_tx = (command_name(data), time_us)
+            text = data.decode(errors="replace").strip()
+        elif kind == BULK:
+            text = "<%d payload bytes>" % len(data)
+        else:
+            text = data.decode(errors="replace")
+        print("%10.1f  %s  %s" % (t_ms, chr(kind), text if len(text) < 100 else text[:97] + "..."))
+
+    print("\n%-24s %6s %10s %10s" % ("command", "count", "avg ms", "max ms"))
+    for name, times in sorted(per_command.items(), key=lambda item: -sum(item[1])):
+        print("%-24s %6d %10.1f %10.1f" % (name, len(times), sum(times) / len(times), max(times)))
+
+
+class Replay:
+    """Splits a trace into the modem output that followed each recorded command"""
+
+    def __init__(self, records, speed):
+        self.speed = speed
+        # Output before the first command, e.g. the power on banner
+        self.preamble = []
+        # (command, time_us, [(delay_us, bytes)])
+        self.exchanges = []
+        for time_us, kind, data in records:
+            if kind == TX:
+                self.exchanges.append((data.strip(), time_us, []))
+                continue
+            out = data if kind == BULK else b"\r\n" + data + b"\r\n"
+            if self.exchanges:
+                _, tx_time, outputs = self.exchanges[-1]
+                outputs.append((elapsed_us(tx_time, time_us), out))
+            else:
+                self.preamble.append((elapsed_us(records[0][0], time_us), out))
+        self.next = 0
+        self.timing = []
+
+    def match(self, cmd):
+        """Finds the next recorded exchange for cmd, skipping commands the firmware didn't resend"""
+        name = command_name(cmd)
+        for i in range(self.next, len(self.exchanges)):
+            if command_name(self.exchanges[i][0]) == name:
+                self.next = i + 1
+                return self.exchanges[i]
+        return None
+
+
+def replay(args):
+    replay = Replay(load(args.log, args.trace), args.speed)
+    log("replaying %d commands" % len(replay.exchanges))
+    fd = open_port(args)
+
+    pending = []
+    now = time.monotonic()
+    for delay_us, out in replay.preamble:
+        pending.append((now + delay_us / 1e6 / args.speed, out))
+
+    rx = b""
+    last = None
+    try:
+        while replay.next < len(replay.exchanges) or pending:
+            timeout = max(0.0, pending[0][0] - time.monotonic()) if pending else None
+            readable, _, _ = select.select([fd], [], [], timeout)
+            if readable:
+                rx += os.read(fd, 4096)
+                while b"\r" in rx:
+                    raw, _, rx = rx.partition(b"\r")
+                    cmd = raw.strip(b"\n")
+                    if not cmd:
+                        continue
+                    now = time.monotonic()
+                    exchange = replay.match(cmd)
+                    if exchange is None:
+                        log("not in trace: %s" % cmd.decode(errors="replace"))
+                        pending.append((now, b"\r\nERROR\r\n"))
+                        continue
+                    recorded_cmd, tx_time, outputs = exchange
+                    if last:
+                        last_name, last_now, last_tx = last
+                        replay.timing.append((last_name, (now - last_now) * 1000.0,
+                                              elapsed_us(last_tx, tx_time) / 1000.0))
+                    last = (command_name(cmd), now, tx_time)
+                    log("<- %s" % cmd.decode(errors="replace")[:100])
+                    for delay_us, out in outputs:
+                        pending.append((now + delay_us / 1e6 / args.speed, out))
+                    pending.sort(key=lambda item: item[0])
+            while pending and pending[0][0] <= time.monotonic():
+                os.write(fd, pending.pop(0)[1])
+    except KeyboardInterrupt:
+        pass
+
+    print("\n%-24s %10s %10s" % ("command", "replay ms", "trace ms"))
+    for name, replay_ms, trace_ms in replay.timing:
+        print("%-24s %10.1f %10.1f" % (name, replay_ms, trace_ms))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="action", required=True)
+
+    dec = sub.add_parser("decode", help="print the trace as a timeline")
+    dec.add_argument("log", help="console output containing MTRACE lines")
+    dec.add_argument("--trace", choices=["ram", "nvs"], help="which trace to use, default is the last one")
+    dec.set_defaults(func=decode)
+
+    rep = sub.add_parser("replay", help="act as the modem using the recorded responses and timings")
+    rep.add_argument("log", help="console output containing MTRACE lines")
+    rep.add_argument("--trace", choices=["ram", "nvs"], help="which trace to use, default is the last one")
+    where = rep.add_mutually_exclusive_group(required=True)
+    where.add_argument("--port", help="serial device or native_sim pseudotty to attach to")
+    where.add_argument("--pty", action="store_true", help="create a new pseudotty and print its path")
+    rep.add_argument("--baud", type=int, choices=sorted(BAUD_RATES), help="line rate for real serial ports")
+    rep.add_argument("--speed", type=float, default=1.0, help="replay faster (>1) or slower than recorded")
+    rep.set_defaults(func=replay)
+
+    args = parser.parse_args()
+    args.func(args)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,359 @@
+#!/usr/bin/env python3
+"""SIM7000 emulator for running the hub firmware without the modem.
+
+Speaks the subset of the SIM7000 AT command set the firmware uses (power on
+banner, AT+CREG, AT+CNMP, AT+GSN, AT+CGNSINF, AT+CNACT, AT+SH*, ...) over a
+serial device. That can be the pseudotty a native_sim build prints for its
+UART, or a USB-serial adapter wired to uart1 of a real hub.
+
+Latency, error injection and response sizes are configurable so request
+timing and failure handling can be measured on a plain Linux box:
+
+    ./sim7000_emu.py --port /dev/pts/5 --latency tls=3000 --fail SHCONN=0.2
+    ./sim7000_emu.py --pty --sensors 40 --pad 1500 --profile slow_lte.json
+
+A summary of the time spent per command is printed on exit (Ctrl+C).
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import select
+import sys
+import termios
+import time
+import tty
+
+# Default delays (ms) before the modem answers, see --latency
+DEFAULT_LATENCY = {
+    # power on until the SMS Ready banner
+    "boot": 6000,
+    # SMS Ready until +CREG reports registered
+    "reg": 3000,
+    # AT+CNACT=1 until +APP PDP: ACTIVE
+    "pdp": 1500,
+    # AT+SHCONN, TLS handshake
+    "tls": 2500,
+    # AT+SHREQ until +SHREQ with the server response
+    "server": 800,
+    # any other command
+    "default": 20,
+}
+
+BAUD_RATES = {
+    9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+    57600: termios.B57600, 115200: termios.B115200, 230400: termios.B230400,
+    460800: termios.B460800, 921600: termios.B921600,
+}
+
+# Mutations answered with {"id": n}, keyed by alias if the request used one
+MUTATION_RE = re.compile(
+    r"(?:(\w+)\s*:\s*)?\b(createEvent|createSensor|updateHubBatteryLevel|createLocation|loginAndFetchHub)\b")
+
+
+def log(msg):
+    print("[%10.3f] %s" % (time.monotonic(), msg), flush=True)
+
+
+class Sim7000:
+    def __init__(self, args):
+        self.args = args
+        self.latency = dict(DEFAULT_LATENCY)
+        self.fail = {}
+        self.rng = random.Random(args.seed)
+        self.pending = []  # (due time, bytes) sorted by due time
+        self.urcs = []  # (due time, bytes) sent on their own clock, see urc()
+        self.echo = True
+        self.creg_n = 0
+        self.cnmp = 2
+        self.registered_at = None
+        self.pdp_active = False
+        self.connected = False
+        self.body = ""
+        self.response = b""
+        self.next_id = 1
+        self.stats = {}
+
+    # -- output ----------------------------------------------------------
+
+    def send(self, data, delay_ms=0):
+        if isinstance(data, str):
+            data = data.encode()
+        due = time.monotonic() + delay_ms / 1000.0
+        # Keep responses in order, a later line never overtakes an earlier one
+        if self.pending:
+            due = max(due, self.pending[-1][0])
+        self.pending.append((due, data))
+
+    def line(self, text, delay_ms=0):
+        self.send("\r\n%s\r\n" % text, delay_ms)
+
+    def urc(self, text, due):
+        # Unlike line() it doesn't hold back the responses queued after it
+        self.urcs.append((due, ("\r\n%s\r\n" % text).encode()))
+        self.urcs.sort(key=lambda urc: urc[0])
+
+    def due_output(self):
+        now = time.monotonic()
+        out = b""
+        while True:
+            queue = min((q for q in (self.pending, self.urcs) if q), key=lambda q: q[0][0], default=None)
+            if queue is None or queue[0][0] > now:
+                return out
+            out += queue.pop(0)[1]
+
+    def next_due(self):
+        return min((q[0][0] for q in (self.pending, self.urcs) if q), default=None)
+
+    # -- state -------------------------------------------------------------
+
+    def boot(self):
+        delay = self.latency["boot"]
+        log("power on, banner in %dms" % delay)
+        for text in ("RDY", "+CFUN: 1", "+CPIN: READY", "SMS Ready"):
+            self.line(text, delay)
+        self.registered_at = time.monotonic() + (delay + self.latency["reg"]) / 1000.0
+        # URC settings don't survive a power cycle, the firmware sends AT+CREG=1 again
+        self.creg_n = 0
+        self.urcs = []
+
+    def reg_status(self):
+        if self.registered_at is None or time.monotonic() < self.registered_at:
+            return 2
+        return 1
+
+    def should_fail(self, name):
+        prob = self.fail.get(name, 0.0)
+        return prob > 0 and self.rng.random() < prob
+
+    # -- responses to HTTP requests -----------------------------------------
+
+    def build_response(self):
+        body = self.body
+        if self.args.unauthenticated:
+            doc = {"errors": [{"message": "Not authenticated",
+                               "extensions": {"code": "UNAUTHENTICATED"}}], "data": None}
+        elif "getMySensors" in body:
+            sensors = [{"id": i + 1, "serial": "C0:00:00:00:%02X:%02X" % (i >> 8, i & 0xFF)}
+                       for i in range(self.args.sensors)]
+            doc = {"data": {"hubViewer": {"sensors": sensors}}}
+        else:
+            data = {}
+            for alias, field in MUTATION_RE.findall(body):
+                if field == "loginAndFetchHub":
+                    data[alias or field] = {"hub": {"id": 1}, "token": "emulated-token"}
+                else:
+                    data[alias or field] = {"id": self.next_id}
+                    self.next_id += 1
+            doc = {"data": data}
+        text = json.dumps(doc, separators=(",", ":"))
+        if self.args.pad > len(text):
+            # Pad inside the document so it stays valid JSON
+            doc["pad"] = "x" * (self.args.pad - len(text) - 9)
+            text = json.dumps(doc, separators=(",", ":"))
+        return text.encode()
+
+    # -- commands ------------------------------------------------------------
+
+    def handle(self, cmd):
+        start = time.monotonic()
+        name = re.match(r"AT\+?([A-Z&]*)", cmd.upper())
+        name = name.group(1) if name and name.group(1) else "AT"
+        if self.echo:
+            self.send(cmd + "\r")
+        latency = self.latency.get(name.lower(), self.latency["default"])
+
+        if self.should_fail(name):
+            log("injecting ERROR for %s" % cmd)
+            self.line("ERROR", latency)
+        else:
+            self.respond(cmd, name, latency)
+
+        stat = self.stats.setdefault(name, [0, 0.0])
+        stat[0] += 1
+        stat[1] += (self.pending[0][0] if self.pending else start) - start
+
+    def respond(self, cmd, name, latency):
+        up = cmd.upper()
+        ok = lambda delay=latency: self.line("OK", delay)
+        if up in ("AT", "ATE1", "AT&W") or name in ("IPR", "IFC", "CFUN", "CGNSPWR", "CSSLCFG", "SHSSL",
+                                                     "SHCONF", "SHCHEAD", "SHAHEAD", "CPSMS", "CEDRXS",
+                                                     "CBANDCFG", "COPS", "CMNB", "CLTS", "CSCLK") and "?" not in up:
+            ok()
+        elif up == "ATE0":
+            self.echo = False
+            ok()
+        elif name == "GSN":
+            self.line("869951000000001", latency)
+            ok()
+        elif name == "CSQ":
+            self.line("+CSQ: %d,99" % self.args.csq, latency)
+            ok()
+        elif up.startswith("AT+CCLK?"):
+            # Network time as UTC, the zone is in quarter hours
+            self.line(time.strftime('+CCLK: "%y/%m/%d,%H:%M:%S+00"', time.gmtime()), latency)
+            ok()
+        elif up.startswith("AT+CNMP?"):
+            self.line("+CNMP: %d" % self.cnmp, latency)
+            ok()
+        elif name == "CNMP":
+            self.cnmp = int(cmd.split("=")[1])
+            ok()
+        elif up.startswith("AT+CREG?"):
+            if self.creg_n == 2 and self.reg_status() == 1:
+                self.line('+CREG: 2,1,"00C3","0A4B",7', latency)
+            else:
+                self.line("+CREG: %d,%d" % (self.creg_n, self.reg_status()), latency)
+            ok()
+        elif name == "CREG":
+            self.creg_n = int(cmd.split("=")[1])
+            ok()
+            self.urcs = [urc for urc in self.urcs if not urc[1].startswith(b"\r\n+CREG")]
+            if self.creg_n and self.registered_at is not None:
+                # Reported once registered, right after the OK if it already is
+                if self.reg_status() == 1:
+                    self.line("+CREG: 1", latency)
+                else:
+                    self.urc("+CREG: 1", self.registered_at)
+        elif up.startswith("AT+COPS?"):
+            self.line('+COPS: 0,2,"310260",7', latency)
+            ok()
+        elif up.startswith("AT+CPSI?"):
+            self.line("+CPSI: LTE CAT-M1,Online,310-260,0x00C3,1234567,123,EUTRAN-BAND12,5110,3,3,-10,-95,-70,15", latency)
+            ok()
+        elif up.startswith("AT+CBANDCFG?"):
+            self.line('+CBANDCFG: "CAT-M",2,4,12,13', latency)
+            ok()
+        elif name == "CGNSINF":
+            self.line("+CGNSINF: 1,1,20231017120000.000,45.123456,-105.123456,1200.0,0.00,0.0,1,,0.9,1.2,0.8,,11,8,,,40,,", latency)
+            ok()
+        elif up.startswith("AT+CNACT?"):
+            self.line('+CNACT: %d,"10.170.0.2"' % (1 if self.pdp_active else 0), latency)
+            ok()
+        elif name == "CNACT":
+            activate = cmd.split("=")[1].startswith("1")
+            ok()
+            self.pdp_active = activate
+            self.line("+APP PDP: %s" % ("ACTIVE" if activate else "DEACTIVE"), self.latency["pdp"] if activate else 0)
+        elif up.startswith("AT+SHSTATE?"):
+            self.line("+SHSTATE: %d" % (1 if self.connected else 0), latency)
+            ok()
+        elif name == "SHCONN":
+            if not self.pdp_active:
+                self.line("ERROR", latency)
+                return
+            self.connected = True
+            ok(self.latency["tls"])
+        elif name == "SHDISC":
+            self.connected = False
+            ok()
+        elif name == "SHBOD":
+            match = re.match(r'AT\+SHBOD="(.*)",(\d+)$', cmd, re.S)
+            self.body = match.group(1).replace('\\"', '"').replace("\\\\", "\\") if match else ""
+            ok()
+        elif name == "SHREQ":
+            if not self.connected:
+                self.line("ERROR", latency)
+                return
+            self.response = self.build_response()
+            method = "POST" if cmd.rstrip().endswith("3") else "GET"
+            ok()
+            self.line('+SHREQ: "%s",200,%d' % (method, len(self.response)), self.latency["server"])
+        elif name == "SHREAD":
+            start, length = (int(x) for x in cmd.split("=")[1].split(","))
+            payload = self.response[start:start + length]
+            ok()
+            self.line("+SHREAD: %d" % len(payload), latency)
+            self.send(payload + b"\r\n")
+        else:
+            log("unsupported command %r" % cmd)
+            self.line("ERROR", latency)
+
+    def print_summary(self):
+        print("\n%-10s %6s %10s" % ("command", "count", "avg ms"))
+        for name, (count, total) in sorted(self.stats.items()):
+            print("%-10s %6d %10.1f" % (name, count, total * 1000.0 / count))
+
+
+def parse_pairs(pairs, cast):
+    out = {}
+    for pair in pairs or []:
+        key, _, value = pair.partition("=")
+        out[key] = cast(value)
+    return out
+
+
+def open_port(args):
+    if args.pty:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        log("emulated modem on %s" % os.ttyname(slave))
+        return master
+    fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    if args.baud:
+        attrs = termios.tcgetattr(fd)
+        attrs[4] = attrs[5] = BAUD_RATES[args.baud]
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    log("attached to %s" % args.port)
+    return fd
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    where = parser.add_mutually_exclusive_group(required=True)
+    where.add_argument("--port", help="serial device or native_sim pseudotty to attach to")
+    where.add_argument("--pty", action="store_true", help="create a new pseudotty and print its path")
+    parser.add_argument("--baud", type=int, choices=sorted(BAUD_RATES), help="line rate for real serial ports")
+    parser.add_argument("--profile", help="JSON file with \"latency\" and \"fail\" objects, overridden by flags")
+    parser.add_argument("--latency", action="append", metavar="NAME=MS",
+                        help="boot, reg, pdp, tls, server, default or a command name like shread")
+    parser.add_argument("--fail", action="append", metavar="CMD=PROB",
+                        help="probability of answering ERROR, e.g. SHCONN=0.2")
+    parser.add_argument("--sensors", type=int, default=3, help="sensors returned by getMySensors")
+    parser.add_argument("--pad", type=int, default=0, help="pad responses to at least this many bytes")
+    parser.add_argument("--csq", type=int, default=20, help="signal quality reported by AT+CSQ")
+    parser.add_argument("--unauthenticated", action="store_true", help="answer every request with UNAUTHENTICATED")
+    parser.add_argument("--no-banner", action="store_true", help="don't send the power on banner at start")
+    parser.add_argument("--seed", type=int, help="seed for error injection")
+    args = parser.parse_args()
+
+    modem = Sim7000(args)
+    if args.profile:
+        with open(args.profile) as f:
+            profile = json.load(f)
+        modem.latency.update(profile.get("latency", {}))
+        modem.fail.update(profile.get("fail", {}))
+    modem.latency.update(parse_pairs(args.latency, int))
+    modem.fail.update(parse_pairs(args.fail, float))
+
+    fd = open_port(args)
+    if not args.no_banner:
+        modem.boot()
+
+    rx = b""
+    try:
+        while True:
+            due = modem.next_due()
+            timeout = None if due is None else max(0.0, due - time.monotonic())
+            readable, _, _ = select.select([fd], [], [], timeout)
+            if readable:
+                rx += os.read(fd, 4096)
+                while b"\r" in rx:
+                    raw, _, rx = rx.partition(b"\r")
+                    cmd = raw.strip(b"\n").decode(errors="replace")
+                    if cmd:
+                        log("<- %s" % (cmd if len(cmd) < 120 else cmd[:117] + "..."))
+                        modem.handle(cmd)
+            out = modem.due_output()
+            if out:
+                os.write(fd, out)
+    except KeyboardInterrupt:
+        modem.print_summary()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())